@@ -0,0 +1,263 @@
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <cstring>
+#include <algorithm>
+#include <functional>
+#include "Protocol.h"
+#ifdef HAVE_CRYPTOPP
+#include <boost/filesystem.hpp>
+#include "KeyManager.h"
+#include "KeyPool.h"
+#endif
+
+/*
+* Micro-benchmarks of the client's hot paths: packing requests and parsing responses, and (when built with Crypto++)
+* the symmetric and RSA operations of KeyManager and the client's startup paths for loading a key.
+* Results are written as JSON, to stdout or to the file given with --output, for comparing releases.
+*/
+
+const double MIN_RUN_SECONDS = 0.2;
+const int RUN_COUNT = 5;
+
+
+struct BenchmarkResult {
+	std::string name;
+	uint64_t iterations;
+	double ns_per_op;
+	double bytes_per_second;
+};
+
+
+template <class T>
+void KeepAlive(T const& value) {
+	asm volatile("" : : "g"(&value) : "memory");
+}
+
+
+/*
+* Runs operation in growing batches until a batch takes MIN_RUN_SECONDS, then times RUN_COUNT batches of that size
+* and keeps the median. bytes is the amount of data one operation processes, 0 if throughput is meaningless.
+*/
+BenchmarkResult Run(std::string name, uint64_t bytes, std::function<void()> operation) {
+	uint64_t batch = 1;
+	double seconds = 0;
+	while (true) {
+		auto start = std::chrono::steady_clock::now();
+		for (uint64_t i = 0; i < batch; i++) {
+			operation();
+		}
+		seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		if (seconds >= MIN_RUN_SECONDS) {
+			break;
+		}
+		batch = seconds > 0 ? std::max(batch * 2, (uint64_t)(batch * MIN_RUN_SECONDS / seconds * 1.2)) : batch * 10;
+	}
+	std::vector<double> runs;
+	runs.push_back(seconds);
+	for (int run = 1; run < RUN_COUNT; run++) {
+		auto start = std::chrono::steady_clock::now();
+		for (uint64_t i = 0; i < batch; i++) {
+			operation();
+		}
+		runs.push_back(std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+	}
+	std::sort(runs.begin(), runs.end());
+	double median = runs[runs.size() / 2];
+	BenchmarkResult result = { name, batch, median / batch * 1e9, bytes ? bytes * batch / median : 0 };
+	std::cerr << name << ": " << result.ns_per_op << " ns/op" << std::endl;
+	return result;
+}
+
+
+std::string RandomBytes(size_t size) {
+	std::string result(size, 0);
+	for (size_t i = 0; i < size; i++) {
+		result[i] = (char)(i * 2654435761u >> 13);
+	}
+	return result;
+}
+
+
+std::string UserListPayload(int users) {
+	std::string payload;
+	for (int i = 0; i < users; i++) {
+		std::string record = RandomBytes(16 + 255);
+		std::memcpy(&record[0], &i, sizeof(i));
+		payload += record;
+	}
+	return payload;
+}
+
+
+std::string MessageListPayload(int messages, int message_size) {
+	std::string payload;
+	std::string content = RandomBytes(message_size);
+	for (int i = 0; i < messages; i++) {
+		payload += RandomBytes(16);
+		payload += (char)3;
+		payload.append((char*)&message_size, sizeof(int));
+		payload += content;
+	}
+	return payload;
+}
+
+
+void BenchmarkProtocol(std::vector<BenchmarkResult>& results) {
+	std::array<char, 16> client_id;
+	client_id.fill(7);
+	for (int size : { 0, 1024, 65536 }) {
+		std::string content = RandomBytes(size);
+		results.push_back(Run("SendMessageRequest/" + std::to_string(size), size, [&]() {
+			SendMessageRequest request = SendMessageRequest(client_id, 3, size, size ? &content[0] : NULL);
+			KeepAlive(request);
+			free(request.get_data());
+		}));
+		SendMessageRequest request = SendMessageRequest(client_id, 3, size, size ? &content[0] : NULL);
+		results.push_back(Run("RequestHeader::pack/" + std::to_string(size), size, [&]() {
+			RequestHeader header = RequestHeader(client_id, MESSAGE_USER_REQUEST, &request);
+			PackedPayload* packed = header.pack();
+			KeepAlive(packed->_data);
+			free(packed->_data);
+			delete packed;
+		}));
+		free(request.get_data());
+	}
+	char header_data[7] = { 2, (char)0xd4, 0x07, 0x10, 0, 0, 0 };
+	results.push_back(Run("ResponseHeader", 7, [&]() {
+		ResponseHeader header = ResponseHeader(header_data);
+		KeepAlive(header);
+	}));
+	for (int users : { 10, 1000, 10000 }) {
+		std::string payload = UserListPayload(users);
+		results.push_back(Run("UserListResponse/" + std::to_string(users), payload.size(), [&]() {
+			UserListResponse response = UserListResponse(&payload[0], payload.size());
+			KeepAlive(response);
+		}));
+	}
+	for (int messages : { 1, 100, 1000 }) {
+		for (int message_size : { 64, 4096 }) {
+			std::string payload = MessageListPayload(messages, message_size);
+			results.push_back(Run("AwaitingMessagesResponse/" + std::to_string(messages) + "x" + std::to_string(message_size), payload.size(), [&]() {
+				AwaitingMessagesResponse response = AwaitingMessagesResponse(&payload[0], payload.size());
+				KeepAlive(response);
+			}));
+		}
+	}
+}
+
+
+#ifdef HAVE_CRYPTOPP
+void BenchmarkCrypto(std::vector<BenchmarkResult>& results) {
+	SymmetricKeyEncryptor symmetric_key = SymmetricKeyEncryptor();
+	for (int size : { 64, 4096, 65536 }) {
+		std::string text = RandomBytes(size);
+		std::string cipher = symmetric_key.ECBMode_Encrypt(text);
+		results.push_back(Run("SymmetricKeyEncryptor::ECBMode_Encrypt/" + std::to_string(size), size, [&]() {
+			KeepAlive(symmetric_key.ECBMode_Encrypt(text));
+		}));
+		results.push_back(Run("SymmetricKeyEncryptor::ECBMode_Decrypt/" + std::to_string(size), size, [&]() {
+			KeepAlive(symmetric_key.ECBMode_Decrypt(cipher));
+		}));
+	}
+	results.push_back(Run("KeyManager::KeyManager", 0, []() {
+		KeyManager key_manager = KeyManager();
+		KeepAlive(key_manager);
+	}));
+	KeyManager key_manager = KeyManager();
+	std::string* public_key = key_manager.GetPublicKey();
+	PublicKeyManager public_key_manager = PublicKeyManager(*public_key);
+	std::string* encrypted_key = public_key_manager.EncryptSymmetricKey(symmetric_key);
+	results.push_back(Run("PublicKeyManager::EncryptSymmetricKey", 16, [&]() {
+		delete public_key_manager.EncryptSymmetricKey(symmetric_key);
+	}));
+	results.push_back(Run("KeyManager::DecryptSymmetricKey", 16, [&]() {
+		delete key_manager.DecryptSymmetricKey(*encrypted_key);
+	}));
+	delete encrypted_key;
+	delete public_key;
+	results.push_back(Run("KeyManager::KeyManager/x25519", 0, []() {
+		KeyManager key_manager = KeyManager(X25519_KEY_EXCHANGE);
+		KeepAlive(key_manager);
+	}));
+	KeyManager x25519_key_manager = KeyManager(X25519_KEY_EXCHANGE);
+	public_key = x25519_key_manager.GetPublicKey();
+	PublicKeyManager x25519_public_key_manager = PublicKeyManager(*public_key);
+	encrypted_key = x25519_public_key_manager.EncryptSymmetricKey(symmetric_key);
+	results.push_back(Run("PublicKeyManager::EncryptSymmetricKey/x25519", 16, [&]() {
+		delete x25519_public_key_manager.EncryptSymmetricKey(symmetric_key);
+	}));
+	results.push_back(Run("KeyManager::DecryptSymmetricKey/x25519", 16, [&]() {
+		delete x25519_key_manager.DecryptSymmetricKey(*encrypted_key);
+	}));
+	delete encrypted_key;
+	delete public_key;
+}
+
+
+/*
+* What a starting client spends on its key: a registered user's key is decoded from me.info, a new user's key is
+* taken from a key pool (generating one is KeyManager::KeyManager above). Both now run in the background.
+*/
+void BenchmarkStartup(std::vector<BenchmarkResult>& results) {
+	const int POOL_SIZE = 1024;
+	KeyManager key_manager = KeyManager();
+	std::string* encoded = key_manager.GetEncodedPrivateKey();
+	std::string key_line = *encoded;
+	key_line.erase(std::remove_if(key_line.begin(), key_line.end(), [](char c) { return c == '\r' || c == '\n'; }), key_line.end());
+	results.push_back(Run("Startup/KeyManager::KeyManager(encoded)", encoded->size(), [&]() {
+		KeyManager decoded = KeyManager(*encoded);
+		KeepAlive(decoded);
+	}));
+	delete encoded;
+	std::string pool_filename = (boost::filesystem::temp_directory_path() / boost::filesystem::unique_path()).string();
+	auto fill_pool = [&]() {
+		std::ofstream pool(pool_filename, std::ios::binary | std::ios::trunc);
+		for (int i = 0; i < POOL_SIZE; i++) {
+			pool << key_line << "\n";
+		}
+	};
+	fill_pool();
+	KeyPool pool = KeyPool(pool_filename);
+	results.push_back(Run("Startup/KeyPool::TakeKey/" + std::to_string(POOL_SIZE), key_line.size(), [&]() {
+		KeyManager* taken = pool.TakeKey();
+		if (!taken) {
+			fill_pool();
+			taken = pool.TakeKey();
+		}
+		delete taken;
+	}));
+	boost::filesystem::remove(pool_filename);
+}
+#endif
+
+
+void WriteJson(std::ostream& out, const std::vector<BenchmarkResult>& results) {
+	out << "{" << std::endl << "  \"benchmarks\": [" << std::endl;
+	for (size_t i = 0; i < results.size(); i++) {
+		out << "    {\"name\": \"" << results[i].name << "\", \"iterations\": " << results[i].iterations
+			<< ", \"ns_per_op\": " << results[i].ns_per_op << ", \"bytes_per_second\": " << results[i].bytes_per_second << "}"
+			<< (i + 1 < results.size() ? "," : "") << std::endl;
+	}
+	out << "  ]" << std::endl << "}" << std::endl;
+}
+
+
+int main(int argc, char* argv[]) {
+	std::vector<BenchmarkResult> results;
+	BenchmarkProtocol(results);
+#ifdef HAVE_CRYPTOPP
+	BenchmarkCrypto(results);
+	BenchmarkStartup(results);
+#endif
+	if (argc == 3 && std::string(argv[1]) == "--output") {
+		std::ofstream out(argv[2]);
+		WriteJson(out, results);
+	}
+	else {
+		WriteJson(std::cout, results);
+	}
+	return 0;
+}
@@ -0,0 +1,221 @@
+#include <memory>
+#include <chrono>
+#include <cstdlib>
+#include <algorithm>
+#include "AsyncDispatcher.h"
+#include "Tracing.h"
+
+
+AsyncExecutor::AsyncExecutor(int thread_count) : _work(boost::asio::make_work_guard(_io_context)) {
+	for (int i = 0; i < std::max(thread_count, 1); i++) {
+		_threads.push_back(std::thread([this]() {
+			/* A handler that throws must not take the thread, and the operations queued behind it, down */
+			while (true) {
+				try {
+					_io_context.run();
+					return;
+				}
+				catch (const std::exception&) {
+				}
+			}
+		}));
+	}
+}
+
+
+AsyncExecutor::~AsyncExecutor() {
+	_work.reset();
+	for (auto& thread : _threads) {
+		thread.join();
+	}
+}
+
+
+boost::asio::io_context& AsyncExecutor::GetIOContext() {
+	return _io_context;
+}
+
+
+/* The state of one request in flight, kept alive by the handlers waiting on it */
+class AsyncRequest : public std::enable_shared_from_this<AsyncRequest> {
+private:
+	boost::asio::io_context& _io_context;
+	std::string _target_host;
+	std::string _target_port;
+	std::vector<char> _packed_request;
+	boost::asio::ip::tcp::resolver _resolver;
+	boost::asio::ip::tcp::socket _socket;
+	boost::asio::steady_timer _retry_timer;
+	char _header_data[7];
+	std::vector<char> _payload_data;
+	int _attempt = 0;
+	ResponseHandler _on_response;
+	/* The operation that sent the request, the span is recorded under it when the response arrives */
+	uint64_t _trace_id;
+	std::chrono::system_clock::time_point _start;
+	bool _is_timed;
+	DispatchTiming _timing;
+
+	void _Mark(DispatchPhase phase) {
+		if (_is_timed) {
+			_timing.marks[phase] = std::chrono::steady_clock::now();
+		}
+	}
+
+	void _Send();
+	void _ReadHeader();
+	void _ReadPayload();
+	void _OnPayload();
+	void _Fail();
+	void _Finish(ResponsePayload* response);
+
+public:
+	AsyncRequest(boost::asio::io_context& io_context, std::string target_host, int target_port, RequestHeader* request, ResponseHandler on_response);
+	void Start();
+};
+
+
+AsyncRequest::AsyncRequest(boost::asio::io_context& io_context, std::string target_host, int target_port, RequestHeader* request, ResponseHandler on_response) :
+	_io_context(io_context), _resolver(io_context), _socket(io_context), _retry_timer(io_context) {
+	_target_host = target_host;
+	_target_port = std::to_string(target_port);
+	_on_response = on_response;
+	_trace_id = Tracer::GetTraceID();
+	if (Tracer::Instance().IsEnabled()) {
+		_start = std::chrono::system_clock::now();
+	}
+	_is_timed = DispatchMetrics::Instance().IsEnabled();
+	_timing.request_code = request->GetCode();
+	request->SetTraceID(_trace_id);
+	PackedPayload* packed = request->pack();
+	_packed_request.assign(packed->_data, packed->_data + packed->_data_length);
+	free(packed->_data);
+	delete packed;
+}
+
+
+void AsyncRequest::Start() {
+	auto self = shared_from_this();
+	this->_Mark(RESOLVE_PHASE);
+	_resolver.async_resolve(_target_host, _target_port, [self](const boost::system::error_code& error, boost::asio::ip::tcp::resolver::results_type endpoints) {
+		if (error) {
+			self->_Fail();
+			return;
+		}
+		self->_Mark(CONNECT_PHASE);
+		boost::asio::async_connect(self->_socket, endpoints, [self](const boost::system::error_code& error, const boost::asio::ip::tcp::endpoint&) {
+			if (error) {
+				self->_Fail();
+				return;
+			}
+			self->_Send();
+		});
+	});
+}
+
+
+void AsyncRequest::_Send() {
+	auto self = shared_from_this();
+	this->_Mark(SEND_PHASE);
+	boost::asio::async_write(_socket, boost::asio::buffer(_packed_request), [self](const boost::system::error_code& error, size_t) {
+		if (error) {
+			self->_Fail();
+			return;
+		}
+		self->_timing.bytes_sent = self->_packed_request.size();
+		self->_Mark(FIRST_BYTE_PHASE);
+		self->_ReadHeader();
+	});
+}
+
+
+void AsyncRequest::_ReadHeader() {
+	auto self = shared_from_this();
+	boost::asio::async_read(_socket, boost::asio::buffer(_header_data, sizeof(_header_data)), [self](const boost::system::error_code& error, size_t) {
+		if (error) {
+			self->_Fail();
+			return;
+		}
+		self->_Mark(RECEIVE_PHASE);
+		self->_ReadPayload();
+	});
+}
+
+
+void AsyncRequest::_ReadPayload() {
+	ResponseHeader header = ResponseHeader(_header_data);
+	if (header.GetPyaloadSize() < 0) {
+		this->_Fail();
+		return;
+	}
+	_payload_data.resize(header.GetPyaloadSize());
+	if (_payload_data.empty()) {
+		this->_OnPayload();
+		return;
+	}
+	auto self = shared_from_this();
+	boost::asio::async_read(_socket, boost::asio::buffer(_payload_data), [self](const boost::system::error_code& error, size_t) {
+		if (error) {
+			self->_Fail();
+			return;
+		}
+		self->_OnPayload();
+	});
+}
+
+
+void AsyncRequest::_OnPayload() {
+	ResponseHeader header = ResponseHeader(_header_data);
+	_timing.response_code = header.GetResponseCode();
+	_timing.bytes_received = sizeof(_header_data) + _payload_data.size();
+	this->_Mark(PARSE_PHASE);
+	ResponsePayload* response;
+	try {
+		response = Dispatcher::ParseResponse(&header, _payload_data.empty() ? NULL : _payload_data.data());
+	}
+	catch (const std::exception& e) {
+		this->_Fail();
+		return;
+	}
+	this->_Mark(PHASE_COUNT);
+	if (_is_timed) {
+		DispatchMetrics::Instance().Record(_timing);
+	}
+	/* Same back off as Dispatcher, but waiting on a timer instead of blocking a thread */
+	ServerOverloaded* overloaded = dynamic_cast<ServerOverloaded*>(response);
+	if (!overloaded || _attempt == MAX_OVERLOAD_RETRIES) {
+		this->_Finish(response);
+		return;
+	}
+	unsigned long long retry_after = (unsigned long long)overloaded->GetRetryAfter() << _attempt;
+	delete response;
+	_attempt++;
+	boost::system::error_code ignored;
+	_socket.close(ignored);
+	_socket = boost::asio::ip::tcp::socket(_io_context);
+	auto self = shared_from_this();
+	_retry_timer.expires_after(std::chrono::milliseconds(retry_after));
+	_retry_timer.async_wait([self](const boost::system::error_code&) { self->Start(); });
+}
+
+
+void AsyncRequest::_Fail() {
+	if (_is_timed) {
+		DispatchMetrics::Instance().RecordFailure(_timing.request_code);
+	}
+	this->_Finish(NULL);
+}
+
+
+void AsyncRequest::_Finish(ResponsePayload* response) {
+	if (Tracer::Instance().IsEnabled()) {
+		/* The io thread runs many operations, the span belongs to the trace of the one that sent the request */
+		Tracer::Instance().Record("AsyncDispatch", _start, std::chrono::system_clock::now(), _trace_id);
+	}
+	_on_response(response);
+}
+
+
+void AsyncDispatch(boost::asio::io_context& io_context, std::string target_host, int target_port, RequestHeader* request, ResponseHandler on_response) {
+	std::make_shared<AsyncRequest>(io_context, target_host, target_port, request, on_response)->Start();
+}
@@ -0,0 +1,34 @@
+#pragma once
+#include <string>
+#include <thread>
+#include <vector>
+#include <functional>
+#include "Dispatcher.h"
+
+
+/*
+* Threads running one io_context, for the async operations of any number of Controllers. The destructor waits for the
+* operations in flight to complete.
+*/
+class AsyncExecutor {
+private:
+	boost::asio::io_context _io_context;
+	boost::asio::executor_work_guard<boost::asio::io_context::executor_type> _work;
+	std::vector<std::thread> _threads;
+public:
+	AsyncExecutor(int thread_count);
+	virtual ~AsyncExecutor();
+	boost::asio::io_context& GetIOContext();
+};
+
+
+/* Called with the response, or with NULL if the request failed on the network. The handler must delete the response */
+typedef std::function<void(ResponsePayload*)> ResponseHandler;
+
+
+/*
+* Sends the request without blocking the calling thread, and calls on_response on one of the io_context's threads.
+* Like Dispatcher, every request gets its own connection, is timed and traced, and is retried with a growing delay when
+* the server is overloaded. The request is packed before returning, so it does not have to outlive the call.
+*/
+void AsyncDispatch(boost::asio::io_context& io_context, std::string target_host, int target_port, RequestHeader* request, ResponseHandler on_response);
@@ -0,0 +1,161 @@
+#include <fstream>
+#include <cstring>
+#include <algorithm>
+#include <boost/filesystem.hpp>
+#include <boost/interprocess/file_mapping.hpp>
+#include "ContactStore.h"
+
+
+const char CONTACT_STORE_MAGIC[4] = { 'M', 'U', 'C', 'S' };
+const uint32_t CONTACT_STORE_VERSION = 1;
+const uint32_t INITIAL_CAPACITY = 64;
+
+
+uint64_t FileSizeFor(uint32_t capacity) {
+	return sizeof(ContactStoreHeader) + (uint64_t)capacity * sizeof(ContactRecord);
+}
+
+
+ContactStore::ContactStore(std::string filename, std::array<char, 16> owner_id) {
+	_filename = filename;
+	try {
+		if (!boost::filesystem::exists(_filename) || boost::filesystem::file_size(_filename) < sizeof(ContactStoreHeader)) {
+			this->_Create(owner_id);
+		}
+		this->_Map();
+		if (!this->_IsValid(owner_id)) {
+			delete _region;
+			_region = NULL;
+			this->_Create(owner_id);
+			this->_Map();
+		}
+	}
+	catch (const std::exception&) {
+		throw ContactStoreException();
+	}
+	for (uint32_t slot = 0; slot < _Header()->record_count; slot++) {
+		std::array<char, 16> client_id;
+		std::copy_n(_Record(slot)->client_id, client_id.size(), client_id.begin());
+		_slots[client_id] = slot;
+	}
+}
+
+
+ContactStore::~ContactStore() {
+	if (_region) {
+		this->Flush();
+		delete _region;
+	}
+}
+
+
+ContactStoreHeader* ContactStore::_Header() {
+	return (ContactStoreHeader*)_region->get_address();
+}
+
+
+ContactRecord* ContactStore::_Record(uint32_t slot) {
+	return (ContactRecord*)((char*)_region->get_address() + sizeof(ContactStoreHeader)) + slot;
+}
+
+
+bool ContactStore::_IsValid(std::array<char, 16> owner_id) {
+	ContactStoreHeader* header = _Header();
+	return std::memcmp(header->magic, CONTACT_STORE_MAGIC, sizeof(header->magic)) == 0 &&
+		header->version == CONTACT_STORE_VERSION &&
+		std::memcmp(header->owner_id, owner_id.data(), owner_id.size()) == 0 &&
+		header->record_count <= header->capacity &&
+		_region->get_size() >= FileSizeFor(header->capacity);
+}
+
+
+void ContactStore::_Map() {
+	boost::interprocess::file_mapping mapping(_filename.c_str(), boost::interprocess::read_write);
+	_region = new boost::interprocess::mapped_region(mapping, boost::interprocess::read_write);
+}
+
+
+void ContactStore::_Create(std::array<char, 16> owner_id) {
+	ContactStoreHeader header;
+	std::memcpy(header.magic, CONTACT_STORE_MAGIC, sizeof(header.magic));
+	header.version = CONTACT_STORE_VERSION;
+	header.record_count = 0;
+	header.capacity = INITIAL_CAPACITY;
+	std::copy_n(owner_id.begin(), owner_id.size(), header.owner_id);
+	std::ofstream ofs(_filename, std::ios::binary | std::ios::trunc);
+	ofs.write((char*)&header, sizeof(header));
+	ofs.close();
+	boost::filesystem::resize_file(_filename, FileSizeFor(INITIAL_CAPACITY));
+}
+
+
+void ContactStore::_Grow() {
+	uint32_t capacity = _Header()->capacity * 2;
+	this->Flush();
+	delete _region;
+	_region = NULL;
+	boost::filesystem::resize_file(_filename, FileSizeFor(capacity));
+	this->_Map();
+	_Header()->capacity = capacity;
+}
+
+
+void ContactStore::Load(std::map<std::array<char, 16>, User*>* users) {
+	for (auto const& slot : _slots) {
+		if (users->find(slot.first) != users->end()) {
+			continue;
+		}
+		ContactRecord* record = _Record(slot.second);
+		std::array<char, 255> client_name;
+		std::copy_n(record->client_name, client_name.size(), client_name.begin());
+		User* user = new User(slot.first, client_name);
+		if (record->flags & PUBLIC_KEY_SET) {
+			std::array<char, 160> public_key;
+			std::copy_n(record->public_key, public_key.size(), public_key.begin());
+			user->UpdatePublicKey(public_key);
+		}
+		if (record->flags & SYMMETRIC_KEY_SET) {
+			std::array<char, 16> symmetric_key;
+			std::copy_n(record->symmetric_key, symmetric_key.size(), symmetric_key.begin());
+			user->UpdateSymmetricKey(symmetric_key);
+		}
+		(*users)[slot.first] = user;
+	}
+}
+
+
+void ContactStore::Put(User* user) {
+	uint32_t slot;
+	bool is_new = false;
+	auto existing = _slots.find(*user->GetClientID());
+	if (existing != _slots.end()) {
+		slot = existing->second;
+	}
+	else {
+		try {
+			if (_Header()->record_count == _Header()->capacity) {
+				this->_Grow();
+			}
+		}
+		catch (const std::exception&) {
+			throw ContactStoreException();
+		}
+		slot = _Header()->record_count;
+		is_new = true;
+	}
+	ContactRecord* record = _Record(slot);
+	std::copy_n(user->GetClientID()->begin(), sizeof(record->client_id), record->client_id);
+	std::copy_n(user->GetClientName()->begin(), sizeof(record->client_name), record->client_name);
+	std::copy_n(user->GetPublicKey()->begin(), sizeof(record->public_key), record->public_key);
+	std::copy_n(user->GetSymmetricKey()->begin(), sizeof(record->symmetric_key), record->symmetric_key);
+	record->flags = (user->GetIsPublicKeySet() ? PUBLIC_KEY_SET : 0) | (user->GetIsSymmetricKeySet() ? SYMMETRIC_KEY_SET : 0);
+	if (is_new) {
+		_Header()->record_count++;
+		_slots[*user->GetClientID()] = slot;
+	}
+}
+
+
+void ContactStore::Flush() {
+	_region->flush();
+}
@@ -0,0 +1,66 @@
+#pragma once
+#include <map>
+#include <array>
+#include <string>
+#include <cstdint>
+#include <boost/interprocess/mapped_region.hpp>
+#include "User.h"
+
+
+const std::string CONTACTS_FILENAME = "contacts.dat";
+
+class ContactStoreException : public std::exception {
+};
+
+
+#pragma pack(push, 1)
+struct ContactStoreHeader {
+	char magic[4];
+	uint32_t version;
+	uint32_t record_count;
+	uint32_t capacity;
+	/* The contacts (and symmetric keys) belong to this user, the store is dropped if another user registers */
+	char owner_id[16];
+};
+
+enum ContactFlags {
+	PUBLIC_KEY_SET = 1,
+	SYMMETRIC_KEY_SET = 2,
+};
+
+struct ContactRecord {
+	char client_id[16];
+	char client_name[255];
+	char public_key[160];
+	char symmetric_key[16];
+	uint8_t flags;
+};
+#pragma pack(pop)
+
+
+/*
+* A memory-mapped file of fixed-size contact records, so a restarted client knows the user list and every public and
+* symmetric key without asking the server. Records are updated in place and appended at the end; record_count is
+* only raised once a new record is written.
+*/
+class ContactStore {
+private:
+	std::string _filename;
+	boost::interprocess::mapped_region* _region = NULL;
+	std::map<std::array<char, 16>, uint32_t> _slots;
+
+	ContactStoreHeader* _Header();
+	ContactRecord* _Record(uint32_t slot);
+	bool _IsValid(std::array<char, 16> owner_id);
+	void _Map();
+	void _Create(std::array<char, 16> owner_id);
+	void _Grow();
+
+public:
+	ContactStore(std::string filename, std::array<char, 16> owner_id);
+	virtual ~ContactStore();
+	/* Adds a User to users for every stored contact that is not in it */
+	void Load(std::map<std::array<char, 16>, User*>* users);
+	void Put(User* user);
+	void Flush();
+};
@@ -1,28 +1,21 @@
 #include <fstream>
-#include <iostream>
 #include <iomanip>
 #include "Controller.h"
 #include "Dispatcher.h"
+#include "AsyncDispatcher.h"
+#include "DispatchMetrics.h"
+#include "Tracing.h"
+#include "KeyPool.h"
 #include "Protocol.h"
-#include <Windows.h>
 #include <algorithm>
+#include <boost/filesystem.hpp>
 #include <boost/dll/runtime_symbol_info.hpp>
 
 
 
-std::string* getBinaryPath() {
-	boost::filesystem::path p = boost::dll::program_location();
-	return new std::string(p.string());
-}
-
-
-std::string getDirectoryPath(std::string filename) {
-	std::string directory = ".";
-	const size_t last_slash_idx = filename.rfind('\\');
-	if (std::string::npos != last_slash_idx)
-	{
-		directory = filename.substr(0, last_slash_idx);
-	}
+std::string getBinaryDirectory() {
+	/* Looked up once, the data files are next to the binary by default */
+	static const std::string directory = boost::dll::program_location().parent_path().string();
 	return directory;
 }
 
@@ -33,40 +26,73 @@ int getHexFromChar(char* in) {
 }
 
 
-std::string getServerInfoFilename() {
-	std::string* filename = getBinaryPath();
-	std::string directory = getDirectoryPath(*filename);
-	delete filename;
-	return directory + SERVER_INFO_FILENAME;
+const char* GetStatusDescription(ControllerStatus status) {
+	switch (status) {
+	case OPERATION_SUCCEEDED:
+		return "Success";
+	case NETWORK_FAILURE:
+		return "Could not connect to server!";
+	case SERVER_FAILURE:
+		return "Server responded with an error!";
+	case SERVER_BUSY:
+		return "Server is overloaded, please try again later!";
+	case UNEXPECTED_RESPONSE:
+		return "Server responded with unexpected response!";
+	case ALREADY_REGISTERED:
+		return "User already registered!";
+	case INVALID_USER_NAME:
+		return "User names must be 1 to 254 characters long!";
+	case USER_NOT_FOUND:
+		return "User does not exist! Request the client list first.";
+	case PUBLIC_KEY_NOT_SET:
+		return "Public key for the user isn't found! Request it from server.";
+	case SYMMETRIC_KEY_NOT_SET:
+		return "Symmetric key for the user isn't found! Request it from the user.";
+	case NO_RECIPIENTS:
+		return "No user to send to! Request the client list and symmetric keys first.";
+	case KEY_FAILURE:
+		return "Could not use the key!";
+	case FILE_FAILURE:
+		return "Could not write me.info file!";
+	case METRICS_DISABLED:
+		return "Request timings are disabled, run the client with --metrics to enable them.";
+	default:
+		return "Unknown error!";
+	}
 }
 
 
-std::string getMeInfoFilename() {
-	std::string* filename = getBinaryPath();
-	std::string directory = getDirectoryPath(*filename);
-	delete filename;
-	return directory + USER_INFO_FILENAME;
+ControllerStatus GetResponseStatus(ResponsePayload* response) {
+	if (dynamic_cast<ServerOverloaded*>(response)) {
+		return SERVER_BUSY;
+	}
+	if (dynamic_cast<ServerError*>(response)) {
+		return SERVER_FAILURE;
+	}
+	return OPERATION_SUCCEEDED;
+}
+
+
+std::string Controller::_GetDataFilename(std::string filename) {
+	return (boost::filesystem::path(_data_directory) / filename).string();
 }
 
 
 void Controller::_LoadServerInfo() {
 	std::string content;
 	try {
-		std::cout << getServerInfoFilename() << std::endl;
-		std::ifstream ifs(getServerInfoFilename());
+		std::ifstream ifs(this->_GetDataFilename(SERVER_INFO_FILENAME));
 		if (ifs) {
 			content = std::string((std::istreambuf_iterator<char>(ifs)),
 				(std::istreambuf_iterator<char>()));
 			ifs.close();
 		}
 		else {
-			std::cerr << "Could not open server.info file - server.info file not found";
-			throw ControllerException();
+			throw ControllerException("Could not open server.info file - server.info file not found");
 		}
 	}
 	catch (std::ifstream::failure e){
-		std::cerr << "Could not open server.info file - " << e.what();
-		throw ControllerException();
+		throw ControllerException(std::string("Could not open server.info file - ") + e.what());
 	}
 	int index_of_split = content.find_first_of(":");
 	_server_host = content.substr(0, index_of_split);
@@ -78,15 +104,14 @@ void Controller::_LoadUserInfo() {
 	std::ifstream ifs;
 	std::string content;
 	try {
-		ifs = std::ifstream(getMeInfoFilename());
+		ifs = std::ifstream(this->_GetDataFilename(USER_INFO_FILENAME));
 		if (!ifs) {
-			_key_manager = new KeyManager();
+			this->_StartKeyGeneration();
 			return;
 		}
 	}
 	catch (std::ifstream::failure e) {
-		std::cerr << "Could not open me.info file - " << e.what() << std::endl;
-		_key_manager = new KeyManager();
+		this->_StartKeyGeneration();
 		return;
 	}
 	try {
@@ -95,8 +120,7 @@ void Controller::_LoadUserInfo() {
 		ifs.close();
 	}
 	catch (std::ifstream::failure e) {
-		std::cerr << "Could not open me.info file - " << e.what() << std::endl;
-		throw ControllerException();
+		throw ControllerException(std::string("Could not open me.info file - ") + e.what());
 	}
 	try {
 		int index_of_split = content.find_first_of("\n");
@@ -109,34 +133,108 @@ void Controller::_LoadUserInfo() {
 		for (i=0; i < _user_id.size(); i++) {
 			_user_id[i] = (char)(getHexFromChar((char*)(client_id.data() + i * 2)));
 		}
-		_key_manager = new KeyManager(content.substr(index_of_split + 34, content.length() - index_of_split - 35));
+		std::string encoded_key = content.substr(index_of_split + 34, content.length() - index_of_split - 35);
+		_pending_key_manager = std::async(std::launch::async, [encoded_key]() { return new KeyManager(encoded_key); });
 		_is_registered = true;
+		this->_OpenContacts();
 	}
 	catch (std::out_of_range e) {
-		std::cerr << "Could not parse me.info file - " << e.what();
-		throw ControllerException();
+		throw ControllerException(std::string("Could not parse me.info file - ") + e.what());
+	}
+}
+
+
+void Controller::_StartKeyGeneration() {
+	std::string key_pool_filename = _key_pool_filename;
+	KeyExchangeMode key_exchange_mode = _key_exchange_mode;
+	_pending_key_manager = std::async(std::launch::async, [key_pool_filename, key_exchange_mode]() {
+		if (key_exchange_mode != RSA_OAEP_KEY_EXCHANGE) {
+			/* Only RSA keys are worth pooling */
+			return new KeyManager(key_exchange_mode);
+		}
+		KeyManager* key_manager = NULL;
+		if (!key_pool_filename.empty()) {
+			key_manager = KeyPool(key_pool_filename).TakeKey();
+		}
+		if (!key_manager) {
+			key_manager = new KeyManager();
+		}
+		return key_manager;
+	});
+}
+
+
+KeyManager* Controller::_GetKeyManager() {
+	std::lock_guard<std::mutex> guard(_key_lock);
+	if (!_key_manager && _pending_key_manager.valid()) {
+		try {
+			_key_manager = _pending_key_manager.get();
+		}
+		catch (...) {
+			/* get() invalidates the future, the failure is kept so every later call fails the same way */
+			_key_failure = std::current_exception();
+		}
 	}
+	if (_key_failure) {
+		std::rethrow_exception(_key_failure);
+	}
+	if (!_key_manager) {
+		throw KeyManagerException();
+	}
+	return _key_manager;
 }
 
 
-void Controller::_DumpUserInfo() {
+bool Controller::_DumpUserInfo() {
 	std::ofstream ofs;
 	try {
-		ofs = std::ofstream(getMeInfoFilename(), std::ios::trunc);
+		ofs = std::ofstream(this->_GetDataFilename(USER_INFO_FILENAME), std::ios::trunc);
+		if (!ofs) {
+			return false;
+		}
 		ofs << _user_name.data() << std::endl;
-		std::array<BYTE, 16> _user_id_bytes;
+		std::array<unsigned char, 16> _user_id_bytes;
 		std::copy_n(_user_id.begin(), _user_id.size(), _user_id_bytes.begin());
-		for (int i = 0; i < _user_id_bytes.size(); ++i) 
+		for (int i = 0; i < _user_id_bytes.size(); ++i)
 			ofs << std::hex << std::setfill('0') << std::setw(2) << (int)_user_id_bytes[i];
 		ofs << std::endl;
-		std::string* key = _key_manager->GetEncodedPrivateKey();
+		std::string* key = this->_GetKeyManager()->GetEncodedPrivateKey();
 		ofs << *key;
 		delete key;
 		ofs.close();
 	} catch (std::ifstream::failure e) {
-		std::cerr << "Could not open me.info file to write - " << e.what();
+		return false;
+	}
+	catch (std::exception& e) {
+		/* The key could not be generated */
+		return false;
+	}
+	return true;
+}
+
+
+void Controller::_OpenContacts() {
+	try {
+		_contacts = new ContactStore(this->_GetDataFilename(CONTACTS_FILENAME), _user_id);
+		_contacts->Load(_users);
+	}
+	catch (ContactStoreException& e) {
+		/* The contacts are only a cache, the client works without them */
+		_contacts = NULL;
+	}
+}
+
+
+void Controller::_StoreContact(User* user) {
+	if (!_contacts) {
 		return;
 	}
+	try {
+		_contacts->Put(user);
+	}
+	catch (ContactStoreException& e) {
+		/* The contact is fetched from the server again after a restart */
+	}
 }
 
 
@@ -144,18 +242,26 @@ bool Controller::_GenerateNewKeyForUser(std::array<char, 16> target_user_id) {
 	std::array<char, 16> key;
 	auto s = _users->find(target_user_id);
 	if (s == _users->end()) {
-		std::cerr << "User is not in user list! check your input";
 		return false;
 	}
 	SymmetricKeyEncryptor sym_key = SymmetricKeyEncryptor();
-	std::array<CryptoPP::byte, 16> key_source = *sym_key.GetKey();
-	std::copy_n(key_source.begin(), key_source.size(), key.begin());
+	std::array<CryptoPP::byte, 16>* key_source = sym_key.GetKey();
+	std::copy_n(key_source->begin(), key_source->size(), key.begin());
+	delete key_source;
 	s->second->UpdateSymmetricKey(key);
+	this->_StoreContact(s->second);
 	return true;
 }
 
 
-Controller::Controller() {
+Controller::Controller() : Controller("", "", RSA_OAEP_KEY_EXCHANGE) {
+}
+
+
+Controller::Controller(std::string data_directory, std::string key_pool_filename, KeyExchangeMode key_exchange_mode) {
+	_data_directory = data_directory.empty() ? getBinaryDirectory() : data_directory;
+	_key_pool_filename = key_pool_filename;
+	_key_exchange_mode = key_exchange_mode;
 	_users = new std::map<std::array<char, 16>, User*>();
 	this->_LoadServerInfo();
 	this->_LoadUserInfo();
@@ -163,104 +269,128 @@ Controller::Controller() {
 
 
 Controller::~Controller() {
+	{
+		std::unique_lock<std::mutex> guard(_lock);
+		_idle.wait(guard, [this]() { return _pending_operations == 0; });
+	}
+	if (_owned_executor) {
+		delete _owned_executor;
+	}
+	if (_contacts) {
+		delete _contacts;
+	}
 	for (auto& user : *_users) {
 		delete user.second;
 	}
 	delete _users;
-	delete _key_manager;
+	try {
+		delete this->_GetKeyManager();
+	}
+	catch (std::exception& e) {
+	}
 }
 
-std::string* ReadUserNameFromCIN() {
-	std::string user_name;
-	std::cout << "Please enter the user's name: ";
-	std::cin >> user_name;
-	while (user_name.length() < 0 || user_name.length() > 254) {
-		if (user_name.length() == 0) {
-			std::cerr << "Empty user names are not supported!" << std::endl;
-		}
-		if (user_name.length() > 255) {
-			std::cerr << "User name too long!";
-		}
-		std::cout << "Please enter the user's name: " << std::endl;
-		std::cin >> user_name;
-	}
-	return new std::string(user_name);
+PreparedRequest FailedRequest(ControllerStatus status) {
+	PreparedRequest prepared;
+	prepared.status = status;
+	return prepared;
 }
 
-bool IsServerError(ResponsePayload* response) {
-	if (ServerError* s = dynamic_cast<ServerError*>(response)) {
-		std::cerr << "Server responded with an error!" << std::endl;
-		return true;
+
+PreparedRequest Controller::_Prepare(unsigned short code, std::shared_ptr<RequestPayload> payload, std::function<ControllerStatus(ResponsePayload*)> on_response) {
+	PreparedRequest prepared;
+	prepared.status = OPERATION_SUCCEEDED;
+	prepared.payload = payload;
+	prepared.header = std::make_shared<RequestHeader>(_user_id, code, payload.get());
+	prepared.on_response = on_response;
+	return prepared;
+}
+
+
+ControllerStatus Controller::_HandleResponse(PreparedRequest& prepared, ResponsePayload* response) {
+	ControllerStatus status = GetResponseStatus(response);
+	if (status != OPERATION_SUCCEEDED) {
+		return status;
 	}
-	return false;
+	std::lock_guard<std::mutex> guard(_lock);
+	return prepared.on_response(response);
 }
 
-void Controller::Register() {
-	if (_is_registered) {
-		std::cerr << "User already registered!" << std::endl;
-		return;
+
+ControllerStatus Controller::_Run(PreparedRequest prepared) {
+	if (prepared.status != OPERATION_SUCCEEDED) {
+		return prepared.status;
 	}
-	std::array<char, 160> public_key_array;
- 	std::string* user_name = ReadUserNameFromCIN();
-	std::string* public_key = _key_manager->GetPublicKey();
-	_user_id.fill(0);
-	_user_name.fill(0);
-	std::copy_n(user_name->begin(), user_name->length(), _user_name.begin());
-	std::copy_n(public_key->begin(), public_key->length(), public_key_array.begin());
-	SignupRequest s = SignupRequest(_user_name, public_key_array);
-	RequestHeader h = RequestHeader(_user_id, SIGNUP_REQUEST, &s);
 	try {
-		Dispatcher d = Dispatcher(_server_host.c_str(), _server_port, &h);
-		delete user_name;
-		delete public_key;
-		ResponsePayload* server_response = d.GetResult();
-		if (IsServerError(server_response)) {
-			return;
-		}
-		SignupSuccessResponse* signup_response = dynamic_cast<SignupSuccessResponse*>(server_response);
-		if (!signup_response) {
-			std::cerr << "Server responded with unexpected response!" << std::endl << "--- Signup Failed! ---" << std::endl;
-		}
-		std::copy_n(signup_response->GetClientID().begin(), 16, std::begin(_user_id));
-		this->_DumpUserInfo();
-		_is_registered = true;
+		Dispatcher d = Dispatcher(_server_host.c_str(), _server_port, prepared.header.get());
+		return this->_HandleResponse(prepared, d.GetResult());
 	}
 	catch (NetworkException& e) {
-		std::cerr << "Could not connect to server! Shutting down" << std::endl << "--- Signup Failed! ---" << std::endl;
-		delete user_name;
-		delete public_key;
-		exit(-1);
+		return NETWORK_FAILURE;
 	}
 }
 
-void Controller::UpdateUserList() {
-	UserListRequest user_list = UserListRequest();
-	RequestHeader h = RequestHeader(_user_id, USER_LIST_REQUEST, &user_list);
-	try {
-		Dispatcher d = Dispatcher(_server_host.c_str(), _server_port, &h);
-		ResponsePayload* server_response = d.GetResult();
-		if (IsServerError(server_response)) {
-			return;
-		}
-		UserListResponse* user_list_response = dynamic_cast<UserListResponse*>(server_response);
-		if (!user_list_response) {
-			std::cerr << "Server responded with unexpected response!" << std::endl << "--- User List Update Request Failed! ---" << std::endl;
-			return;
+
+void Controller::_RunAsync(PreparedRequest prepared, AsyncTraceScope& trace, std::function<void(ControllerStatus, std::exception_ptr)> on_done) {
+	std::function<void()> finish_trace = trace.GetFinisher();
+	if (prepared.status != OPERATION_SUCCEEDED) {
+		finish_trace();
+		on_done(prepared.status, NULL);
+		return;
+	}
+	AsyncExecutor* executor;
+	{
+		std::lock_guard<std::mutex> guard(_lock);
+		if (!_async_executor) {
+			_owned_executor = new AsyncExecutor(std::thread::hardware_concurrency());
+			_async_executor = _owned_executor;
 		}
-		for (auto const& user : user_list_response->users)
-		{
-			User* u = new User(user->GetClientID(), user->GetClientName());
-			std::cout << "\tUser Name: " << u->GetClientName()->data() << std::endl;
-			(*_users)[*u->GetClientID()] = u;
+		executor = _async_executor;
+		_pending_operations++;
+	}
+	auto on_response = [this, prepared, finish_trace, on_done](ResponsePayload* response) mutable {
+		ControllerStatus status = NETWORK_FAILURE;
+		std::exception_ptr error;
+		if (response) {
+			/* Nothing may escape to the io thread, the caller waits for on_done */
+			try {
+				status = this->_HandleResponse(prepared, response);
+			}
+			catch (...) {
+				error = std::current_exception();
+			}
+			delete response;
 		}
+		finish_trace();
+		on_done(status, error);
+		std::lock_guard<std::mutex> guard(_lock);
+		_pending_operations--;
+		_idle.notify_all();
+	};
+	try {
+		AsyncDispatch(executor->GetIOContext(), _server_host, _server_port, prepared.header.get(), on_response);
 	}
-	catch (NetworkException& e) {
-		std::cerr << "Could not connect to server! Shutting down" << std::endl << "--- User List Update Request Failed! ---" << std::endl;
-		exit(-1);
+	catch (const std::exception& e) {
+		on_response(NULL);
 	}
 }
 
 
+std::future<ControllerStatus> Controller::_RunAsync(PreparedRequest prepared, AsyncTraceScope& trace) {
+	auto promise = std::make_shared<std::promise<ControllerStatus>>();
+	std::future<ControllerStatus> result = promise->get_future();
+	this->_RunAsync(prepared, trace, [promise](ControllerStatus status, std::exception_ptr error) {
+		if (error) {
+			promise->set_exception(error);
+		}
+		else {
+			promise->set_value(status);
+		}
+	});
+	return result;
+}
+
+
 std::array<char, 16> Controller::_GetUserIDByName(std::array<char, 255> user_name) {
 	for (auto it = _users->begin(); it != _users->end(); it++)
 	{
@@ -272,189 +402,413 @@ std::array<char, 16> Controller::_GetUserIDByName(std::array<char, 255> user_nam
 }
 
 
-void Controller::RequestPublicKey(std::array<char, 255> user_name) {
+PreparedRequest Controller::_PrepareRegister(std::string user_name) {
+	{
+		std::lock_guard<std::mutex> guard(_lock);
+		if (_is_registered) {
+			return FailedRequest(ALREADY_REGISTERED);
+		}
+	}
+	if (user_name.length() == 0 || user_name.length() > 254) {
+		return FailedRequest(INVALID_USER_NAME);
+	}
+	/* The key may still be generated, which must not stall the operations waiting for _lock */
+	std::string* public_key;
+	try {
+		public_key = this->_GetKeyManager()->GetPublicKey();
+	}
+	catch (std::exception& e) {
+		return FailedRequest(KEY_FAILURE);
+	}
+	std::lock_guard<std::mutex> guard(_lock);
+	if (_is_registered) {
+		delete public_key;
+		return FailedRequest(ALREADY_REGISTERED);
+	}
+	std::array<char, 160> public_key_array;
+	_user_id.fill(0);
+	_user_name.fill(0);
+	public_key_array.fill(0);
+	std::copy_n(user_name.begin(), user_name.length(), _user_name.begin());
+	std::copy_n(public_key->begin(), std::min(public_key->length(), public_key_array.size()), public_key_array.begin());
+	delete public_key;
+	return this->_Prepare(SIGNUP_REQUEST, std::make_shared<SignupRequest>(_user_name, public_key_array), [this](ResponsePayload* response) {
+		SignupSuccessResponse* signup_response = dynamic_cast<SignupSuccessResponse*>(response);
+		if (!signup_response) {
+			return UNEXPECTED_RESPONSE;
+		}
+		std::copy_n(signup_response->GetClientID().begin(), 16, std::begin(_user_id));
+		bool is_dumped = this->_DumpUserInfo();
+		_is_registered = true;
+		this->_OpenContacts();
+		return is_dumped ? OPERATION_SUCCEEDED : FILE_FAILURE;
+	});
+}
+
+
+PreparedRequest Controller::_PrepareUpdateUserList(std::list<std::string>* user_names) {
+	std::lock_guard<std::mutex> guard(_lock);
+	return this->_Prepare(USER_LIST_REQUEST, std::make_shared<UserListRequest>(), [this, user_names](ResponsePayload* response) {
+		UserListResponse* user_list_response = dynamic_cast<UserListResponse*>(response);
+		if (!user_list_response) {
+			return UNEXPECTED_RESPONSE;
+		}
+		for (auto const& user : user_list_response->users)
+		{
+			if (user_names) {
+				user_names->push_back(std::string(user->GetClientName().data()));
+			}
+			/* Known users keep the keys they already have */
+			if (_users->find(user->GetClientID()) != _users->end()) {
+				continue;
+			}
+			User* u = new User(user->GetClientID(), user->GetClientName());
+			(*_users)[*u->GetClientID()] = u;
+			this->_StoreContact(u);
+		}
+		return OPERATION_SUCCEEDED;
+	});
+}
+
+
+PreparedRequest Controller::_PrepareRequestPublicKey(std::array<char, 255> user_name) {
+	std::lock_guard<std::mutex> guard(_lock);
 	std::array<char, 16> user_id;
 	try {
 		user_id = this->_GetUserIDByName(user_name);
 	}
 	catch (UserNotFoundException) {
-		std::cerr << "User " << user_name.data() << " does not exist!" << std::endl;
-		return;
+		return FailedRequest(USER_NOT_FOUND);
 	}
-	UserPublicKeyRequest user_list = UserPublicKeyRequest(user_id);
-	RequestHeader h = RequestHeader(_user_id, USER_PUBLIC_KEY_REQUEST, &user_list);
-	try {
-		Dispatcher d = Dispatcher(_server_host.c_str(), _server_port, &h);
-		ResponsePayload* server_response = d.GetResult();
-		if (IsServerError(server_response)) {
-			return;
-		}
-		UserPublicKeyResponse* user_public_key_response = dynamic_cast<UserPublicKeyResponse*>(server_response);
+	return this->_Prepare(USER_PUBLIC_KEY_REQUEST, std::make_shared<UserPublicKeyRequest>(user_id), [this, user_id](ResponsePayload* response) {
+		UserPublicKeyResponse* user_public_key_response = dynamic_cast<UserPublicKeyResponse*>(response);
 		if (!user_public_key_response) {
-			std::cerr << "Server responded with unexpected response!" << std::endl << "--- User Public Key Request Failed! ---" << std::endl;
+			return UNEXPECTED_RESPONSE;
 		}
 		(*_users)[user_id]->UpdatePublicKey(user_public_key_response->GetPublicKey());
-	}
-	catch (NetworkException& e) {
-		std::cerr << "Server unexpectedly closed the connection!" << std::endl << "--- User Public Key Request Failed! ---" << std::endl;
-		exit(-1);
-	}
+		this->_StoreContact((*_users)[user_id]);
+		return OPERATION_SUCCEEDED;
+	});
+}
+
+
+/* The handler of requests answered with MessageSentResponse */
+ControllerStatus ExpectMessageSent(ResponsePayload* response) {
+	return dynamic_cast<MessageSentResponse*>(response) ? OPERATION_SUCCEEDED : UNEXPECTED_RESPONSE;
 }
 
 
-void Controller::GenerateSymmetricKeyForUser(std::array<char, 255> user_name) {
+PreparedRequest Controller::_PrepareGenerateSymmetricKeyForUser(std::array<char, 255> user_name) {
+	std::lock_guard<std::mutex> guard(_lock);
 	std::array<char, 16> user_id;
 	try {
 		user_id = this->_GetUserIDByName(user_name);
 	}
 	catch (UserNotFoundException) {
-		std::cerr << "User " << user_name.data() << " does not exist!" << std::endl;
-		return;
+		return FailedRequest(USER_NOT_FOUND);
 	}
 	auto s = _users->find(user_id);
 	if (!s->second->GetIsPublicKeySet()) {
-		std::cerr << "Public key for user " << user_name.data() << " isn't found! Request if from server." << std::endl;
-		return;
+		return FailedRequest(PUBLIC_KEY_NOT_SET);
 	}
 	if (!this->_GenerateNewKeyForUser(user_id)) {
-		return;
+		return FailedRequest(USER_NOT_FOUND);
 	}
 	std::array<char, 160> public_key = *s->second->GetPublicKey();
-	PublicKeyManager km = PublicKeyManager(std::string(public_key.data(), public_key.size()));
-	std::string encrypted_key = *km.EncryptSymmetricKey(*s->second->GetSymmetricKey());
-	SendMessageRequest symmetic_key_message = SendMessageRequest(user_id, SYMMETRIC_KEY_RESPONSE, encrypted_key.size(), (char*)encrypted_key.data());
-	RequestHeader h = RequestHeader(_user_id, MESSAGE_USER_REQUEST, &symmetic_key_message);
+	std::string encrypted_key;
 	try {
-		Dispatcher d = Dispatcher(_server_host.c_str(), _server_port, &h);
-		ResponsePayload* server_response = d.GetResult();
-		if (IsServerError(server_response)) {
-			return;
-		}
-		MessageSentResponse* user_public_key_response = dynamic_cast<MessageSentResponse*>(server_response);
-		if (!user_public_key_response) {
-			std::cerr << "Server responded with unexpected response!" << std::endl << "--- Could not send symmetric key to user! ---" << std::endl;
-		}
+		PublicKeyManager km = PublicKeyManager(std::string(public_key.data(), public_key.size()));
+		std::string* encrypted = km.EncryptSymmetricKey(*s->second->GetSymmetricKey());
+		encrypted_key = *encrypted;
+		delete encrypted;
 	}
-	catch (NetworkException& e) {
-		std::cerr << "Server unexpectedly closed the connection!" << std::endl << "--- Could not send symmetric key to user! ---" << std::endl;
-		exit(-1);
+	catch (std::exception& e) {
+		return FailedRequest(KEY_FAILURE);
 	}
+	auto symmetic_key_message = std::make_shared<SendMessageRequest>(user_id, SYMMETRIC_KEY_RESPONSE, encrypted_key.size(), (char*)encrypted_key.data());
+	return this->_Prepare(MESSAGE_USER_REQUEST, symmetic_key_message, ExpectMessageSent);
 }
 
-void Controller::SendMessageToUser(std::array<char, 255> user_name, char* message_content, int message_size) {
+
+PreparedRequest Controller::_PrepareSendMessageToUser(std::array<char, 255> user_name, std::string message_content) {
+	std::lock_guard<std::mutex> guard(_lock);
 	std::array<char, 16> user_id;
 	try {
 		user_id = this->_GetUserIDByName(user_name);
 	}
 	catch (UserNotFoundException) {
-		std::cerr << "User " << user_name.data() << " does not exist!" << std::endl;
-		return;
+		return FailedRequest(USER_NOT_FOUND);
 	}
 	auto s = _users->find(user_id);
 	if (!s->second->GetIsPublicKeySet()) {
-		std::cerr << "Public key for user " << user_name.data() << " isn't found! Request if from server." << std::endl;
-		return;
+		return FailedRequest(PUBLIC_KEY_NOT_SET);
 	}
 	if (!s->second->GetIsSymmetricKeySet()) {
-		std::cerr << "Symetric key for user " << user_name.data() << " isn't found! Request if from the user." << std::endl;
-		return;
+		return FailedRequest(SYMMETRIC_KEY_NOT_SET);
 	}
-	SymmetricKeyEncryptor encrypotor = SymmetricKeyEncryptor(*s->second->GetSymmetricKey());
-	std::string encrypted_message = encrypotor.ECBMode_Encrypt(message_content);
-	SendMessageRequest encrypted_message_request = SendMessageRequest(user_id, REGULAR_MESSAGE_REQUEST, encrypted_message.length(), (char*)encrypted_message.c_str());
-	RequestHeader h = RequestHeader(_user_id, MESSAGE_USER_REQUEST, &encrypted_message_request);
+	std::string encrypted_message;
 	try {
-		Dispatcher d = Dispatcher(_server_host.c_str(), _server_port, &h);
-		ResponsePayload* server_response = d.GetResult();
-		if (IsServerError(server_response)) {
-			return;
-		}
-		MessageSentResponse* user_public_key_response = dynamic_cast<MessageSentResponse*>(server_response);
-		if (!user_public_key_response) {
-			std::cerr << "Server responded with unexpected response!" << std::endl << "--- Could not send message to user! ---" << std::endl;
-		}
-	} catch (NetworkException& e) {
-		std::cerr << "Server unexpectedly closed the connection!" << std::endl << "--- Could not send message to user! ---" << std::endl;
-		exit(-1);
+		SymmetricKeyEncryptor encrypotor = SymmetricKeyEncryptor(*s->second->GetSymmetricKey());
+		encrypted_message = encrypotor.ECBMode_Encrypt(message_content);
+	}
+	catch (std::exception& e) {
+		return FailedRequest(KEY_FAILURE);
 	}
+	auto encrypted_message_request = std::make_shared<SendMessageRequest>(user_id, REGULAR_MESSAGE_REQUEST, encrypted_message.length(), (char*)encrypted_message.c_str());
+	return this->_Prepare(MESSAGE_USER_REQUEST, encrypted_message_request, ExpectMessageSent);
 }
 
-void Controller::RequestSymmetricKeyFromUser(std::array<char, 255> user_name) {
+
+PreparedRequest Controller::_PrepareRequestSymmetricKeyFromUser(std::array<char, 255> user_name) {
+	std::lock_guard<std::mutex> guard(_lock);
 	std::array<char, 16> user_id;
 	try {
 		user_id = this->_GetUserIDByName(user_name);
 	}
 	catch (UserNotFoundException) {
-		std::cerr << "User " << user_name.data() << " does not exist!" << std::endl;
-		return;
+		return FailedRequest(USER_NOT_FOUND);
 	}
-	SendMessageRequest symmetic_key_request = SendMessageRequest(user_id, SYMMETRIC_KEY_REQUEST, 0, NULL);
-	RequestHeader h = RequestHeader(_user_id, MESSAGE_USER_REQUEST, &symmetic_key_request);
+	auto symmetic_key_request = std::make_shared<SendMessageRequest>(user_id, SYMMETRIC_KEY_REQUEST, 0, (char*)NULL);
+	return this->_Prepare(MESSAGE_USER_REQUEST, symmetic_key_request, ExpectMessageSent);
+}
+
+
+PreparedRequest Controller::_PrepareSendMessageToAllUsers(std::string message_content, int* sent_count) {
+	std::lock_guard<std::mutex> guard(_lock);
+	std::list<std::pair<std::array<char, 16>, std::string>> messages;
 	try {
-		Dispatcher d = Dispatcher(_server_host.c_str(), _server_port, &h);
-		ResponsePayload* server_response = d.GetResult();
-		if (IsServerError(server_response)) {
-			return;
+		for (auto const& user : *_users) {
+			/* Users without a symmetric key are skipped */
+			if (!user.second->GetIsSymmetricKeySet()) {
+				continue;
+			}
+			SymmetricKeyEncryptor encrypotor = SymmetricKeyEncryptor(*user.second->GetSymmetricKey());
+			messages.push_back(std::make_pair(user.first, encrypotor.ECBMode_Encrypt(message_content)));
 		}
-		MessageSentResponse* user_public_key_response = dynamic_cast<MessageSentResponse*>(server_response);
-		if (!user_public_key_response) {
-			std::cerr << "Server responded with unexpected response!" << std::endl << "--- Could not send symmetric key request to user! ---" << std::endl;
+	}
+	catch (std::exception& e) {
+		return FailedRequest(KEY_FAILURE);
+	}
+	if (messages.empty()) {
+		return FailedRequest(NO_RECIPIENTS);
+	}
+	auto encrypted_messages_request = std::make_shared<MultiSendMessageRequest>(messages, REGULAR_MESSAGE_REQUEST);
+	return this->_Prepare(MULTI_MESSAGE_USER_REQUEST, encrypted_messages_request, [sent_count](ResponsePayload* response) {
+		MessagesSentResponse* messages_sent_response = dynamic_cast<MessagesSentResponse*>(response);
+		if (!messages_sent_response) {
+			return UNEXPECTED_RESPONSE;
 		}
+		if (sent_count) {
+			*sent_count = messages_sent_response->messages.size();
+		}
+		return OPERATION_SUCCEEDED;
+	});
+}
+
+
+PreparedRequest Controller::_PrepareRequestSymmetricKeyFromAllUsers() {
+	std::lock_guard<std::mutex> guard(_lock);
+	std::list<std::array<char, 16>> user_ids;
+	for (auto const& user : *_users) {
+		user_ids.push_back(user.first);
 	}
-	catch (NetworkException& e) {
-		std::cerr << "Server unexpectedly closed the connection!" << std::endl << "--- Could not send symmetric key request to user! ---" << std::endl;
-		exit(-1);
+	if (user_ids.empty()) {
+		return FailedRequest(NO_RECIPIENTS);
 	}
+	auto symmetic_key_requests = std::make_shared<MultiSendMessageRequest>(user_ids, SYMMETRIC_KEY_REQUEST, 0, (char*)NULL);
+	return this->_Prepare(MULTI_MESSAGE_USER_REQUEST, symmetic_key_requests, [](ResponsePayload* response) {
+		return dynamic_cast<MessagesSentResponse*>(response) ? OPERATION_SUCCEEDED : UNEXPECTED_RESPONSE;
+	});
 }
 
-void Controller::RequestMessages() {
-	MessageListRequest message_list_request = MessageListRequest();
-	RequestHeader h = RequestHeader(_user_id, QUEUED_MESSAGES_REQUEST, &message_list_request);
-	try {
-		Dispatcher d = Dispatcher(_server_host.c_str(), _server_port, &h);
-		ResponsePayload* server_response = d.GetResult();
+
+PreparedRequest Controller::_PrepareRequestMessages(std::list<ReceivedMessage>* messages) {
+	std::lock_guard<std::mutex> guard(_lock);
+	return this->_Prepare(QUEUED_MESSAGES_REQUEST, std::make_shared<MessageListRequest>(), [this, messages](ResponsePayload* response) {
 		SymmetricKeyEncryptor* encrypotor;
-		std::string encrypted_message, decrypted_message;
-		if (IsServerError(server_response)) {
-			return;
-		}
-		AwaitingMessagesResponse* awaiting_messages = dynamic_cast<AwaitingMessagesResponse*>(server_response);
+		std::string encrypted_message;
+		AwaitingMessagesResponse* awaiting_messages = dynamic_cast<AwaitingMessagesResponse*>(response);
 		if (!awaiting_messages) {
-			std::cerr << "Server responded with unexpected response!" << std::endl << "--- Could not retrieve awaiting messages! ---" << std::endl;
-			return;
+			return UNEXPECTED_RESPONSE;
 		}
 		for (auto message : awaiting_messages->messages) {
 			auto sender = _users->find(message->GetSender());
 			if (sender == _users->end()) { continue; }
-			std::cout << "From: " << sender->second->GetClientName()->data() << std::endl << "Content: " << std::endl;
-			switch (message->GetMessageType()) {
-			case SYMMETRIC_KEY_REQUEST:
-				std::cout << "\tRequest for symmetric key" << std::endl;
-				break;
-			case SYMMETRIC_KEY_RESPONSE:
-				std::array<char, 16> user_symmetric_key;
-				encrypted_message = std::string(message->GetMessageContent(), message->GetMessageSize());
-				encrypotor = _key_manager->DecryptSymmetricKey(encrypted_message);
-				std::copy_n(encrypotor->GetKey()->begin(), user_symmetric_key.size(), user_symmetric_key.begin());
-				sender->second->UpdateSymmetricKey(user_symmetric_key);
-				delete encrypotor;
-				std::cout << "\tSymmetric key recieved" << std::endl;
-				break;
-			case REGULAR_MESSAGE_REQUEST:
-				encrypotor = new SymmetricKeyEncryptor(*sender->second->GetSymmetricKey());
-				encrypted_message = std::string(message->GetMessageContent(), message->GetMessageSize());
-				decrypted_message = encrypotor->ECBMode_Decrypt(encrypted_message);
-				delete encrypotor;
-				std::cout << decrypted_message << std::endl;
-				break;
-			default:
-				std::cerr << "--- Unexpected message type! ---" << std::endl;
+			ReceivedMessage received;
+			received.sender_id = sender->first;
+			received.sender_name = std::string(sender->second->GetClientName()->data());
+			received.message_type = message->GetMessageType();
+			received.is_decrypted = true;
+			encrypted_message = std::string(message->GetMessageContent(), message->GetMessageSize());
+			try {
+				switch (message->GetMessageType()) {
+				case SYMMETRIC_KEY_RESPONSE: {
+					std::array<char, 16> user_symmetric_key;
+					encrypotor = this->_GetKeyManager()->DecryptSymmetricKey(encrypted_message);
+					std::array<CryptoPP::byte, 16>* key = encrypotor->GetKey();
+					std::copy_n(key->begin(), user_symmetric_key.size(), user_symmetric_key.begin());
+					delete key;
+					delete encrypotor;
+					sender->second->UpdateSymmetricKey(user_symmetric_key);
+					this->_StoreContact(sender->second);
+					break;
+				}
+				case REGULAR_MESSAGE_REQUEST:
+					if (!sender->second->GetIsSymmetricKeySet()) {
+						received.is_decrypted = false;
+						break;
+					}
+					encrypotor = new SymmetricKeyEncryptor(*sender->second->GetSymmetricKey());
+					received.content = encrypotor->ECBMode_Decrypt(encrypted_message);
+					delete encrypotor;
+					break;
+				}
+			}
+			catch (std::exception& e) {
+				received.is_decrypted = false;
+			}
+			if (messages) {
+				messages->push_back(received);
 			}
-			std::cout << "----<EOM>----" << std::endl << std::endl;
 		}
+		return OPERATION_SUCCEEDED;
+	});
+}
+
+
+bool Controller::IsRegistered() {
+	std::lock_guard<std::mutex> guard(_lock);
+	return _is_registered;
+}
+
+
+ControllerStatus Controller::Register(std::string user_name) {
+	TraceScope trace("Controller::Register");
+	return this->_Run(this->_PrepareRegister(user_name));
+}
+
+
+ControllerStatus Controller::UpdateUserList(std::list<std::string>* user_names) {
+	TraceScope trace("Controller::UpdateUserList");
+	return this->_Run(this->_PrepareUpdateUserList(user_names));
+}
+
+
+ControllerStatus Controller::RequestPublicKey(std::array<char, 255> user_name) {
+	TraceScope trace("Controller::RequestPublicKey");
+	return this->_Run(this->_PrepareRequestPublicKey(user_name));
+}
+
+
+ControllerStatus Controller::GenerateSymmetricKeyForUser(std::array<char, 255> user_name) {
+	TraceScope trace("Controller::GenerateSymmetricKeyForUser");
+	return this->_Run(this->_PrepareGenerateSymmetricKeyForUser(user_name));
+}
+
+
+ControllerStatus Controller::SendMessageToUser(std::array<char, 255> user_name, char* message_content, int message_size) {
+	TraceScope trace("Controller::SendMessageToUser");
+	return this->_Run(this->_PrepareSendMessageToUser(user_name, std::string(message_content, message_size)));
+}
+
+
+ControllerStatus Controller::RequestSymmetricKeyFromUser(std::array<char, 255> user_name) {
+	TraceScope trace("Controller::RequestSymmetricKeyFromUser");
+	return this->_Run(this->_PrepareRequestSymmetricKeyFromUser(user_name));
+}
+
+
+ControllerStatus Controller::SendMessageToAllUsers(char* message_content, int message_size, int* sent_count) {
+	TraceScope trace("Controller::SendMessageToAllUsers");
+	if (sent_count) {
+		*sent_count = 0;
 	}
-	catch (NetworkException& e) {
-		std::cerr << "Server unexpectedly closed the connection!" << std::endl << "--- Could not retrieve awaiting messages! ---" << std::endl;
-		exit(-1);
+	return this->_Run(this->_PrepareSendMessageToAllUsers(std::string(message_content, message_size), sent_count));
+}
+
+
+ControllerStatus Controller::RequestSymmetricKeyFromAllUsers() {
+	TraceScope trace("Controller::RequestSymmetricKeyFromAllUsers");
+	return this->_Run(this->_PrepareRequestSymmetricKeyFromAllUsers());
+}
+
+
+ControllerStatus Controller::RequestMessages(std::list<ReceivedMessage>* messages) {
+	TraceScope trace("Controller::RequestMessages");
+	return this->_Run(this->_PrepareRequestMessages(messages));
+}
+
+
+void Controller::SetAsyncExecutor(AsyncExecutor* executor) {
+	std::lock_guard<std::mutex> guard(_lock);
+	_async_executor = executor;
+}
+
+
+std::future<UserListResult> Controller::UpdateUserListAsync() {
+	AsyncTraceScope trace("Controller::UpdateUserListAsync");
+	auto promise = std::make_shared<std::promise<UserListResult>>();
+	auto result = std::make_shared<UserListResult>();
+	std::future<UserListResult> future = promise->get_future();
+	this->_RunAsync(this->_PrepareUpdateUserList(&result->user_names), trace, [promise, result](ControllerStatus status, std::exception_ptr error) {
+		if (error) {
+			promise->set_exception(error);
+			return;
+		}
+		result->status = status;
+		promise->set_value(*result);
+	});
+	return future;
+}
+
+
+std::future<ControllerStatus> Controller::RequestPublicKeyAsync(std::array<char, 255> user_name) {
+	AsyncTraceScope trace("Controller::RequestPublicKeyAsync");
+	return this->_RunAsync(this->_PrepareRequestPublicKey(user_name), trace);
+}
+
+
+std::future<ControllerStatus> Controller::SendMessageToUserAsync(std::array<char, 255> user_name, std::string message_content) {
+	AsyncTraceScope trace("Controller::SendMessageToUserAsync");
+	return this->_RunAsync(this->_PrepareSendMessageToUser(user_name, message_content), trace);
+}
+
+
+std::future<ControllerStatus> Controller::RequestSymmetricKeyFromUserAsync(std::array<char, 255> user_name) {
+	AsyncTraceScope trace("Controller::RequestSymmetricKeyFromUserAsync");
+	return this->_RunAsync(this->_PrepareRequestSymmetricKeyFromUser(user_name), trace);
+}
+
+
+std::future<MessagesResult> Controller::RequestMessagesAsync() {
+	AsyncTraceScope trace("Controller::RequestMessagesAsync");
+	auto promise = std::make_shared<std::promise<MessagesResult>>();
+	auto result = std::make_shared<MessagesResult>();
+	std::future<MessagesResult> future = promise->get_future();
+	this->_RunAsync(this->_PrepareRequestMessages(&result->messages), trace, [promise, result](ControllerStatus status, std::exception_ptr error) {
+		if (error) {
+			promise->set_exception(error);
+			return;
+		}
+		result->status = status;
+		promise->set_value(*result);
+	});
+	return future;
+}
+
+
+void Controller::EnableMetrics(std::string dump_filename, int dump_interval_seconds) {
+	DispatchMetrics::Instance().Enable(dump_filename, dump_interval_seconds);
+}
+
+void Controller::EnableTracing(std::string trace_filename) {
+	Tracer::Instance().Enable(trace_filename);
+}
+
+ControllerStatus Controller::DumpMetrics(std::ostream& out) {
+	if (!DispatchMetrics::Instance().IsEnabled()) {
+		return METRICS_DISABLED;
 	}
+	DispatchMetrics::Instance().Dump(out);
+	return OPERATION_SUCCEEDED;
 }
@@ -2,14 +2,28 @@
 #include <list>
 #include <array>
 #include <string>
+#include <mutex>
+#include <memory>
+#include <future>
+#include <exception>
+#include <ostream>
+#include <functional>
+#include <condition_variable>
 #include "User.h"
 #include "KeyManager.h"
+#include "ContactStore.h"
 
 
-const std::string SERVER_INFO_FILENAME = "\\server.info";
-const std::string USER_INFO_FILENAME = "\\me.info";
+const std::string SERVER_INFO_FILENAME = "server.info";
+const std::string USER_INFO_FILENAME = "me.info";
 
+/* Thrown when the Controller cannot start, what() tells why */
 class ControllerException : public std::exception {
+private:
+	std::string _message;
+public:
+	ControllerException(std::string message) : _message(message) {}
+	const char* what() const noexcept override { return _message.c_str(); }
 };
 class UserNotFoundException : public std::exception {
 };
@@ -21,28 +35,167 @@ enum MessageTypes
 	REGULAR_MESSAGE_REQUEST = 3
 };
 
+/* The outcome of a Controller operation */
+enum ControllerStatus {
+	OPERATION_SUCCEEDED = 0,
+	NETWORK_FAILURE,
+	SERVER_FAILURE,
+	SERVER_BUSY,
+	UNEXPECTED_RESPONSE,
+	ALREADY_REGISTERED,
+	INVALID_USER_NAME,
+	USER_NOT_FOUND,
+	PUBLIC_KEY_NOT_SET,
+	SYMMETRIC_KEY_NOT_SET,
+	NO_RECIPIENTS,
+	KEY_FAILURE,
+	FILE_FAILURE,
+	METRICS_DISABLED,
+};
+
+const char* GetStatusDescription(ControllerStatus status);
+
+/* A message fetched by RequestMessages */
+struct ReceivedMessage {
+	std::array<char, 16> sender_id;
+	std::string sender_name;
+	int message_type;
+	/* The decrypted text of a regular message, empty for other types */
+	std::string content;
+	/* False if the content or the symmetric key in the message could not be decrypted */
+	bool is_decrypted;
+};
+
+/* The results of UpdateUserListAsync */
+struct UserListResult {
+	ControllerStatus status;
+	std::list<std::string> user_names;
+};
+
+/* The results of RequestMessagesAsync */
+struct MessagesResult {
+	ControllerStatus status;
+	std::list<ReceivedMessage> messages;
+};
+
+class AsyncExecutor;
+class AsyncTraceScope;
+class RequestPayload;
+class RequestHeader;
+class ResponsePayload;
+
+/* A request built by a Controller operation, and how the operation handles its response */
+struct PreparedRequest {
+	/* Anything but OPERATION_SUCCEEDED if the operation failed before sending a request */
+	ControllerStatus status;
+	std::shared_ptr<RequestPayload> payload;
+	std::shared_ptr<RequestHeader> header;
+	/* Called with a response that is not an error, with the Controller locked */
+	std::function<ControllerStatus(ResponsePayload*)> on_response;
+};
+
+/*
+* The client's operations, without any console I/O - every operation returns a ControllerStatus and hands its results
+* back through its arguments. The Model is the interactive and batch front end of it.
+* Operations can be called from many threads at once. The Async operations return at once and complete on the threads
+* of an AsyncExecutor, so one thread can keep many requests in flight.
+*/
 class Controller {
 private:
+	/* server.info, me.info and the contacts file are kept in this directory */
+	std::string _data_directory;
 	std::string _server_host;
 	int _server_port;
 	std::map<std::array<char, 16>, User*>* _users;
 	std::array<char, 16> _user_id;
 	std::array<char, 255> _user_name;
 	bool _is_registered = false;
-	KeyManager* _key_manager;
+	/* Set by _GetKeyManager once the key, generated or decoded in the background on startup, is ready */
+	KeyManager* _key_manager = NULL;
+	std::future<KeyManager*> _pending_key_manager;
+	/* What generating or decoding the key threw, rethrown by every _GetKeyManager call */
+	std::exception_ptr _key_failure;
+	/* Guards the three above, so waiting for the key does not hold _lock */
+	std::mutex _key_lock;
+	/* Pre-generated keys are taken from this pool before generating one, if it is not empty */
+	std::string _key_pool_filename;
+	/* The kind of key generated for a new user */
+	KeyExchangeMode _key_exchange_mode = RSA_OAEP_KEY_EXCHANGE;
+	/* The contacts of the registered user, NULL before registration or if the store could not be opened */
+	ContactStore* _contacts = NULL;
+	/* Guards everything above but the key, it is not held while waiting for the server */
+	std::mutex _lock;
+	/* The async operations in flight, the destructor waits for them */
+	int _pending_operations = 0;
+	std::condition_variable _idle;
+	AsyncExecutor* _async_executor = NULL;
+	/* Created on the first async operation if SetAsyncExecutor was not called */
+	AsyncExecutor* _owned_executor = NULL;
+	std::string _GetDataFilename(std::string filename);
 	void _LoadServerInfo();
+	void _OpenContacts();
+	void _StoreContact(User* user);
 	void _LoadUserInfo();
-	void _DumpUserInfo();
+	void _StartKeyGeneration();
+	/* Waits for the key, throws if it could not be generated or decoded */
+	KeyManager* _GetKeyManager();
+	bool _DumpUserInfo();
 	std::array<char, 16> _GetUserIDByName(std::array<char, 255> user_name);
 	bool _GenerateNewKeyForUser(std::array<char, 16> target_user_id);
+	/* The _Prepare functions lock the Controller to read the state a request is built from */
+	PreparedRequest _Prepare(unsigned short code, std::shared_ptr<RequestPayload> payload, std::function<ControllerStatus(ResponsePayload*)> on_response);
+	PreparedRequest _PrepareRegister(std::string user_name);
+	PreparedRequest _PrepareUpdateUserList(std::list<std::string>* user_names);
+	PreparedRequest _PrepareRequestPublicKey(std::array<char, 255> user_name);
+	PreparedRequest _PrepareGenerateSymmetricKeyForUser(std::array<char, 255> user_name);
+	PreparedRequest _PrepareSendMessageToUser(std::array<char, 255> user_name, std::string message_content);
+	PreparedRequest _PrepareRequestSymmetricKeyFromUser(std::array<char, 255> user_name);
+	PreparedRequest _PrepareSendMessageToAllUsers(std::string message_content, int* sent_count);
+	PreparedRequest _PrepareRequestSymmetricKeyFromAllUsers();
+	PreparedRequest _PrepareRequestMessages(std::list<ReceivedMessage>* messages);
+	ControllerStatus _HandleResponse(PreparedRequest& prepared, ResponsePayload* response);
+	ControllerStatus _Run(PreparedRequest prepared);
+	/*
+	* Calls on_done with the status of the operation, or with what handling the response threw, on an io thread unless
+	* it fails before sending. The span of trace is recorded when the operation completes
+	*/
+	void _RunAsync(PreparedRequest prepared, AsyncTraceScope& trace, std::function<void(ControllerStatus, std::exception_ptr)> on_done);
+	std::future<ControllerStatus> _RunAsync(PreparedRequest prepared, AsyncTraceScope& trace);
 public:
 	Controller();
+	/*
+	* data_directory holds server.info and the user's files, the binary's directory if it is empty. Throws
+	* ControllerException if server.info or me.info cannot be read.
+	*/
+	Controller(std::string data_directory, std::string key_pool_filename, KeyExchangeMode key_exchange_mode);
+	/* Waits for the async operations in flight, so it must not be called from one of their threads */
 	virtual ~Controller();
-	void Register();
-	void UpdateUserList();
-	void RequestPublicKey(std::array<char, 255> user_name);
-	void RequestMessages();
-	void GenerateSymmetricKeyForUser(std::array<char, 255> user_name);
-	void SendMessageToUser(std::array<char, 255> user_name, char* message_content, int message_size);
-	void RequestSymmetricKeyFromUser(std::array<char, 255> user_name);
+	bool IsRegistered();
+	ControllerStatus Register(std::string user_name);
+	/* Adds the names of all the users on the server to user_names, if it is not NULL */
+	ControllerStatus UpdateUserList(std::list<std::string>* user_names);
+	ControllerStatus RequestPublicKey(std::array<char, 255> user_name);
+	/* Adds the awaiting messages from known users to messages. Received symmetric keys are stored */
+	ControllerStatus RequestMessages(std::list<ReceivedMessage>* messages);
+	ControllerStatus GenerateSymmetricKeyForUser(std::array<char, 255> user_name);
+	ControllerStatus SendMessageToUser(std::array<char, 255> user_name, char* message_content, int message_size);
+	ControllerStatus RequestSymmetricKeyFromUser(std::array<char, 255> user_name);
+	/* Sends the message to every user with a symmetric key, sent_count is set to the number of recipients */
+	ControllerStatus SendMessageToAllUsers(char* message_content, int message_size, int* sent_count);
+	ControllerStatus RequestSymmetricKeyFromAllUsers();
+	/*
+	* Runs the async operations on the executor, which can be shared by many Controllers and must outlive them. Without
+	* it, the first async operation starts an executor with a thread per core.
+	*/
+	void SetAsyncExecutor(AsyncExecutor* executor);
+	std::future<UserListResult> UpdateUserListAsync();
+	std::future<ControllerStatus> RequestPublicKeyAsync(std::array<char, 255> user_name);
+	std::future<ControllerStatus> SendMessageToUserAsync(std::array<char, 255> user_name, std::string message_content);
+	std::future<ControllerStatus> RequestSymmetricKeyFromUserAsync(std::array<char, 255> user_name);
+	std::future<MessagesResult> RequestMessagesAsync();
+	/* Starts timing every request, writing the timings to dump_filename (if not empty) every dump_interval_seconds */
+	void EnableMetrics(std::string dump_filename, int dump_interval_seconds);
+	ControllerStatus DumpMetrics(std::ostream& out);
+	/* Writes the spans of every operation to trace_filename as Chrome trace events */
+	void EnableTracing(std::string trace_filename);
 };
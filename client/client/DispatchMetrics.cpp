@@ -0,0 +1,102 @@
+#include <fstream>
+#include <iomanip>
+#include "DispatchMetrics.h"
+#include "Protocol.h"
+
+
+const char* PHASE_NAMES[PHASE_COUNT] = { "resolve", "connect", "send", "first byte", "receive", "parse" };
+
+
+DispatchMetrics& DispatchMetrics::Instance() {
+	static DispatchMetrics instance;
+	return instance;
+}
+
+
+void DispatchMetrics::Enable(std::string dump_filename, int dump_interval_seconds) {
+	std::lock_guard<std::mutex> guard(_lock);
+	_dump_filename = dump_filename;
+	_dump_interval = std::chrono::seconds(dump_interval_seconds);
+	_last_dump = std::chrono::steady_clock::now();
+	_enabled = true;
+}
+
+
+uint64_t ToMicroseconds(std::chrono::steady_clock::duration duration) {
+	return (uint64_t)std::chrono::duration_cast<std::chrono::microseconds>(duration).count();
+}
+
+
+void DispatchMetrics::Record(const DispatchTiming& timing) {
+	std::lock_guard<std::mutex> guard(_lock);
+	RequestMetrics& metrics = _metrics[timing.request_code];
+	for (int phase = 0; phase < PHASE_COUNT; phase++) {
+		metrics.phases[phase].Record(ToMicroseconds(timing.marks[phase + 1] - timing.marks[phase]));
+	}
+	metrics.total.Record(ToMicroseconds(timing.marks[PHASE_COUNT] - timing.marks[RESOLVE_PHASE]));
+	if (timing.response_code == SERVER_OVERLOADED) {
+		metrics.overloaded++;
+	}
+	metrics.bytes_sent += timing.bytes_sent;
+	metrics.bytes_received += timing.bytes_received;
+	_DumpToFileIfDue(timing.marks[PHASE_COUNT]);
+}
+
+
+void DispatchMetrics::RecordFailure(unsigned short request_code) {
+	std::lock_guard<std::mutex> guard(_lock);
+	_metrics[request_code].failures++;
+}
+
+
+void DispatchMetrics::_DumpToFileIfDue(std::chrono::steady_clock::time_point now) {
+	if (_dump_filename.empty() || now - _last_dump < _dump_interval) {
+		return;
+	}
+	_last_dump = now;
+	std::ofstream ofs(_dump_filename, std::ios::trunc);
+	if (ofs) {
+		this->_Dump(ofs);
+	}
+}
+
+
+void DumpHistogram(std::ostream& out, const char* name, const Histogram& histogram) {
+	out << "  " << std::left << std::setw(12) << name << std::right
+		<< std::setw(10) << histogram.GetTotalCount()
+		<< std::setw(12) << std::fixed << std::setprecision(1) << histogram.GetMean()
+		<< std::setw(10) << histogram.GetValueAtPercentile(50)
+		<< std::setw(10) << histogram.GetValueAtPercentile(90)
+		<< std::setw(10) << histogram.GetValueAtPercentile(99)
+		<< std::setw(10) << histogram.GetValueAtPercentile(99.9)
+		<< std::setw(10) << histogram.GetMax() << std::endl;
+}
+
+
+void DispatchMetrics::_Dump(std::ostream& out) {
+	for (auto const& entry : _metrics) {
+		const RequestMetrics& metrics = entry.second;
+		out << "Request " << entry.first << ": failures=" << metrics.failures << " overloaded=" << metrics.overloaded
+			<< " bytes_sent=" << metrics.bytes_sent << " bytes_received=" << metrics.bytes_received << std::endl;
+		out << "  " << std::left << std::setw(12) << "phase (us)" << std::right << std::setw(10) << "count"
+			<< std::setw(12) << "mean" << std::setw(10) << "p50" << std::setw(10) << "p90" << std::setw(10) << "p99"
+			<< std::setw(10) << "p99.9" << std::setw(10) << "max" << std::endl;
+		for (int phase = 0; phase < PHASE_COUNT; phase++) {
+			DumpHistogram(out, PHASE_NAMES[phase], metrics.phases[phase]);
+		}
+		DumpHistogram(out, "total", metrics.total);
+	}
+	out.flush();
+}
+
+
+void DispatchMetrics::Dump(std::ostream& out) {
+	std::lock_guard<std::mutex> guard(_lock);
+	this->_Dump(out);
+}
+
+
+void DispatchMetrics::Reset() {
+	std::lock_guard<std::mutex> guard(_lock);
+	_metrics.clear();
+}
@@ -0,0 +1,72 @@
+#pragma once
+#include <map>
+#include <array>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <ostream>
+#include "Histogram.h"
+
+
+enum DispatchPhase {
+	RESOLVE_PHASE = 0,
+	CONNECT_PHASE = 1,
+	SEND_PHASE = 2,
+	FIRST_BYTE_PHASE = 3,
+	RECEIVE_PHASE = 4,
+	PARSE_PHASE = 5,
+	PHASE_COUNT = 6,
+};
+
+
+/*
+* The timings of one dispatch attempt: marks[phase] is the time the phase started and marks[PHASE_COUNT] the time
+* the response was parsed.
+*/
+struct DispatchTiming {
+	unsigned short request_code = 0;
+	unsigned short response_code = 0;
+	std::array<std::chrono::steady_clock::time_point, PHASE_COUNT + 1> marks;
+	uint64_t bytes_sent = 0;
+	uint64_t bytes_received = 0;
+};
+
+
+/*
+* Per-phase latency histograms (in microseconds) and byte counts of every dispatch, by request code.
+* Disabled by default - Dispatcher only reads the clock when IsEnabled() returns true.
+*/
+class DispatchMetrics {
+private:
+	struct RequestMetrics {
+		std::array<Histogram, PHASE_COUNT> phases;
+		Histogram total;
+		uint64_t failures = 0;
+		uint64_t overloaded = 0;
+		uint64_t bytes_sent = 0;
+		uint64_t bytes_received = 0;
+	};
+	std::atomic<bool> _enabled{ false };
+	std::mutex _lock;
+	std::map<unsigned short, RequestMetrics> _metrics;
+	std::string _dump_filename;
+	std::chrono::steady_clock::duration _dump_interval;
+	std::chrono::steady_clock::time_point _last_dump;
+
+	DispatchMetrics() = default;
+	void _Dump(std::ostream& out);
+	void _DumpToFileIfDue(std::chrono::steady_clock::time_point now);
+
+public:
+	static DispatchMetrics& Instance();
+
+	/* When dump_filename is not empty, the metrics are also written to it at most every dump_interval_seconds */
+	void Enable(std::string dump_filename, int dump_interval_seconds);
+	bool IsEnabled() const { return _enabled.load(std::memory_order_relaxed); }
+
+	void Record(const DispatchTiming& timing);
+	void RecordFailure(unsigned short request_code);
+	void Dump(std::ostream& out);
+	void Reset();
+};
@@ -1,19 +1,43 @@
-#include <iostream>
+#include <thread>
+#include <chrono>
 #include "Dispatcher.h"
-
+#include "Tracing.h"
 
 
 Dispatcher::Dispatcher(const char* target_host, int target_port, RequestHeader* request) {
-	try {
-		boost::asio::io_service io_service;
-		boost::asio::ip::tcp::socket sock = boost::asio::ip::tcp::socket(io_service);
-		boost::asio::ip::tcp::resolver resolver(io_service);
-		boost::asio::connect(sock, resolver.resolve(target_host, std::to_string(target_port)));
-		_result = this->_dispatch(request, &sock);
-	}
-	catch (const std::exception& e) {
-		std::cerr << e.what() << std::endl;
-		throw NetworkException();
+	TraceSpan span("Dispatcher::Dispatcher");
+	request->SetTraceID(Tracer::GetTraceID());
+	DispatchMetrics& metrics = DispatchMetrics::Instance();
+	_is_timed = metrics.IsEnabled();
+	_timing.request_code = request->GetCode();
+	for (int attempt = 0; ; attempt++) {
+		try {
+			boost::asio::io_service io_service;
+			boost::asio::ip::tcp::socket sock = boost::asio::ip::tcp::socket(io_service);
+			boost::asio::ip::tcp::resolver resolver(io_service);
+			this->_Mark(RESOLVE_PHASE);
+			auto endpoints = resolver.resolve(target_host, std::to_string(target_port));
+			this->_Mark(CONNECT_PHASE);
+			boost::asio::connect(sock, endpoints);
+			_result = this->_dispatch(request, &sock);
+		}
+		catch (const std::exception& e) {
+			if (_is_timed) {
+				metrics.RecordFailure(_timing.request_code);
+			}
+			throw NetworkException();
+		}
+		if (_is_timed) {
+			metrics.Record(_timing);
+		}
+		/* The server asks overloaded clients to wait before retrying, back off further on every attempt */
+		ServerOverloaded* overloaded = dynamic_cast<ServerOverloaded*>(_result);
+		if (!overloaded || attempt == MAX_OVERLOAD_RETRIES) {
+			return;
+		}
+		std::this_thread::sleep_for(std::chrono::milliseconds((unsigned long long)overloaded->GetRetryAfter() << attempt));
+		delete _result;
+		_result = NULL;
 	}
 }
 
@@ -25,6 +49,13 @@ Dispatcher::~Dispatcher() {
 }
 
 
+void Dispatcher::_Mark(DispatchPhase phase) {
+	if (_is_timed) {
+		_timing.marks[phase] = std::chrono::steady_clock::now();
+	}
+}
+
+
 char* Dispatcher::_ReadUntilMeetsLength(boost::asio::ip::tcp::socket* sock, int expected_length) {
 	/* User must free returned buffer! */
 	if (expected_length <= 0) { return NULL; }
@@ -43,14 +74,14 @@ ResponseHeader* Dispatcher::_ReadHeader(boost::asio::ip::tcp::socket* sock) {
 	/* user must free return value */
 	char* header_data = this->_ReadUntilMeetsLength(sock, 7);
 	if (!header_data) {
-		throw new NetworkException();
+		throw NetworkException();
 	}
 	ResponseHeader* result = new ResponseHeader(header_data);
 	free(header_data);
 	return result;
 }
 
-ResponsePayload* Dispatcher::_ParseResponse(ResponseHeader* header, char* data_read) {
+ResponsePayload* Dispatcher::ParseResponse(ResponseHeader* header, char* data_read) {
 	int buffer_size = header->GetPyaloadSize();
 	switch (header->GetResponseCode()) {
 	case SIGNUP_SUCCESS_RESPONSE:
@@ -63,20 +94,31 @@ ResponsePayload* Dispatcher::_ParseResponse(ResponseHeader* header, char* data_r
 		return new MessageSentResponse(data_read, buffer_size);
 	case QUEUED_MESSAGES_RESPONSE:
 		return new AwaitingMessagesResponse(data_read, buffer_size);
+	case MESSAGES_SENT_TO_USERS_RESPONSE:
+		return new MessagesSentResponse(data_read, buffer_size);
 	case SERVER_ERROR:
 		return new ServerError();
+	case SERVER_OVERLOADED:
+		return new ServerOverloaded(data_read, buffer_size);
 	default:
-		std::cerr << "Server responded with code: " << header->GetResponseCode() << std::endl;
 		return new ServerError();
 	}
 }
 
 ResponsePayload* Dispatcher::_dispatch(RequestHeader* request, boost::asio::ip::tcp::socket* sock) {
+	this->_Mark(SEND_PHASE);
 	PackedPayload* data = request->pack();
 	sock->send(boost::asio::buffer(data->_data, data->_data_length));
+	_timing.bytes_sent = data->_data_length;
+	this->_Mark(FIRST_BYTE_PHASE);
 	ResponseHeader* header = this->_ReadHeader(sock);
+	this->_Mark(RECEIVE_PHASE);
 	char* payload_data = this->_ReadUntilMeetsLength(sock, header->GetPyaloadSize());
-	ResponsePayload* return_value = this->_ParseResponse(header, payload_data);
+	_timing.response_code = header->GetResponseCode();
+	_timing.bytes_received = 7 + header->GetPyaloadSize();
+	this->_Mark(PARSE_PHASE);
+	ResponsePayload* return_value = Dispatcher::ParseResponse(header, payload_data);
+	this->_Mark(PHASE_COUNT);
 	if (payload_data) {
 		free(payload_data);
 	}
@@ -2,6 +2,11 @@
 #define BOOST_USE_WINDOWS_H
 #include <boost/asio.hpp>
 #include "Protocol.h"
+#include "DispatchMetrics.h"
+
+
+/* Times a request is sent again after the server answers that it is overloaded */
+const int MAX_OVERLOAD_RETRIES = 3;
 
 
 class NetworkException : public std::exception {
@@ -11,13 +16,16 @@ class NetworkException : public std::exception {
 class Dispatcher {
 private:
 	ResponsePayload* _result = NULL;
+	/* Phase timings are only taken when DispatchMetrics is enabled */
+	bool _is_timed = false;
+	DispatchTiming _timing;
+
+	void _Mark(DispatchPhase phase);
 
 	char* _ReadUntilMeetsLength(boost::asio::ip::tcp::socket* sock, int expected_length);
 
 	ResponseHeader* _ReadHeader(boost::asio::ip::tcp::socket* sock);
 
-	ResponsePayload* _ParseResponse(ResponseHeader* header, char* data_read);
-
 	ResponsePayload* _dispatch(RequestHeader* request, boost::asio::ip::tcp::socket* sock);
 
 public:
@@ -25,4 +33,7 @@ public:
 	virtual ~Dispatcher();
 
 	ResponsePayload* GetResult();
+
+	/* Builds the response of the code in the header from its payload, the caller must delete it */
+	static ResponsePayload* ParseResponse(ResponseHeader* header, char* data_read);
 };
\ No newline at end of file
@@ -0,0 +1,82 @@
+#pragma once
+#include <array>
+#include <cstdint>
+#include <algorithm>
+
+
+/*
+* A latency histogram in the style of HdrHistogram: values are counted in buckets whose width grows with the value,
+* so every recorded value is kept with a relative error below 2/SUB_BUCKET_COUNT (1.6%), up to 2^40 units.
+* Recording is a few shifts and an increment. Not thread safe - keep one histogram per thread and Merge them.
+*/
+class Histogram {
+private:
+	static const int SUB_BUCKET_BITS = 7;
+	static const int SUB_BUCKET_COUNT = 1 << SUB_BUCKET_BITS;
+	static const int BUCKET_COUNT = 40 - SUB_BUCKET_BITS + 1;
+	std::array<uint64_t, BUCKET_COUNT * SUB_BUCKET_COUNT> _counts{};
+	uint64_t _total_count = 0;
+	uint64_t _max = 0;
+	uint64_t _sum = 0;
+
+	static int _IndexOf(uint64_t value) {
+		int bucket = 0;
+		while ((value >> bucket) >= SUB_BUCKET_COUNT && bucket < BUCKET_COUNT - 1) {
+			bucket++;
+		}
+		uint64_t sub_bucket = std::min<uint64_t>(value >> bucket, SUB_BUCKET_COUNT - 1);
+		return bucket * SUB_BUCKET_COUNT + (int)sub_bucket;
+	}
+
+	static uint64_t _HighestValueAt(int index) {
+		int bucket = index / SUB_BUCKET_COUNT;
+		uint64_t sub_bucket = index % SUB_BUCKET_COUNT;
+		return ((sub_bucket + 1) << bucket) - 1;
+	}
+
+public:
+	void Record(uint64_t value) {
+		_counts[_IndexOf(value)]++;
+		_total_count++;
+		_sum += value;
+		_max = std::max(_max, value);
+	}
+
+	void Merge(const Histogram& other) {
+		for (size_t i = 0; i < _counts.size(); i++) {
+			_counts[i] += other._counts[i];
+		}
+		_total_count += other._total_count;
+		_sum += other._sum;
+		_max = std::max(_max, other._max);
+	}
+
+	void Reset() {
+		_counts.fill(0);
+		_total_count = 0;
+		_sum = 0;
+		_max = 0;
+	}
+
+	uint64_t GetTotalCount() const { return _total_count; }
+
+	uint64_t GetMax() const { return _max; }
+
+	double GetMean() const { return _total_count ? (double)_sum / _total_count : 0; }
+
+	/* The highest value the given percentage of the recorded values are equal to or below, e.g. 99.9 */
+	uint64_t GetValueAtPercentile(double percentile) const {
+		if (!_total_count) {
+			return 0;
+		}
+		uint64_t target = std::max<uint64_t>(1, (uint64_t)(percentile / 100 * _total_count + 0.5));
+		uint64_t seen = 0;
+		for (size_t i = 0; i < _counts.size(); i++) {
+			seen += _counts[i];
+			if (seen >= target) {
+				return std::min(_HighestValueAt((int)i), _max);
+			}
+		}
+		return _max;
+	}
+};
@@ -1,25 +1,83 @@
-#include <iostream>
+#include <gcm.h>
+#include <hkdf.h>
+#include <sha.h>
+#include <xed25519.h>
 #include "KeyManager.h"
+#include "Tracing.h"
 
 
-KeyManager::KeyManager() {
-	_private_key = CryptoPP::RSA::PrivateKey();
+const size_t X25519_KEY_SIZE = 32;
+const size_t WRAPPED_KEY_TAG_SIZE = 16;
+
+
+/*
+* The key that wraps a symmetric key sent to an X25519 user, derived from the agreed value and bound to both public
+* keys. The sender's key is used once, so the wrapping key is never reused and a zero IV is safe.
+*/
+CryptoPP::SecByteBlock DeriveWrappingKey(const CryptoPP::SecByteBlock& agreed, const CryptoPP::byte* sender_public_key, const CryptoPP::byte* recipient_public_key) {
+	CryptoPP::SecByteBlock info(2 * X25519_KEY_SIZE);
+	std::copy_n(sender_public_key, X25519_KEY_SIZE, info.begin());
+	std::copy_n(recipient_public_key, X25519_KEY_SIZE, info.begin() + X25519_KEY_SIZE);
+	CryptoPP::SecByteBlock wrapping_key(CryptoPP::AES::DEFAULT_KEYLENGTH);
+	CryptoPP::HKDF<CryptoPP::SHA256> hkdf;
+	hkdf.DeriveKey(wrapping_key, wrapping_key.size(), agreed, agreed.size(), NULL, 0, info, info.size());
+	return wrapping_key;
+}
+
+
+KeyManager::KeyManager() : KeyManager(RSA_OAEP_KEY_EXCHANGE) {
+}
+
+
+KeyManager::KeyManager(KeyExchangeMode mode) {
+	TraceSpan span("KeyManager::KeyManager");
+	_mode = mode;
 	CryptoPP::AutoSeededRandomPool  prng;
-	_private_key.GenerateRandomWithKeySize(prng, 1024);
-    _public_key = CryptoPP::RSA::PublicKey (_private_key);
+	if (mode == RSA_OAEP_KEY_EXCHANGE) {
+		_private_key = CryptoPP::RSA::PrivateKey();
+		_private_key.GenerateRandomWithKeySize(prng, 1024);
+		_public_key = CryptoPP::RSA::PublicKey (_private_key);
+		return;
+	}
+	_x25519_private_key.resize(X25519_KEY_SIZE);
+	CryptoPP::x25519().GeneratePrivateKey(prng, _x25519_private_key);
+	this->_GenerateX25519PublicKey();
+}
+
+
+void KeyManager::_GenerateX25519PublicKey() {
+	CryptoPP::AutoSeededRandomPool prng;
+	_x25519_public_key.resize(X25519_KEY_SIZE);
+	CryptoPP::x25519().GeneratePublicKey(prng, _x25519_private_key, _x25519_public_key);
 }
 
 
 KeyManager::KeyManager(std::string encoded) {
+	if (encoded.compare(0, X25519_PRIVATE_KEY_PREFIX.size(), X25519_PRIVATE_KEY_PREFIX) == 0) {
+		_mode = X25519_KEY_EXCHANGE;
+		std::string decoded;
+		CryptoPP::StringSource ss(encoded.substr(X25519_PRIVATE_KEY_PREFIX.size()), true, new CryptoPP::Base64Decoder(new CryptoPP::StringSink(decoded)));
+		if (decoded.size() != X25519_KEY_SIZE) {
+			throw KeyManagerException();
+		}
+		_x25519_private_key.Assign((const CryptoPP::byte*)decoded.data(), decoded.size());
+		this->_GenerateX25519PublicKey();
+		return;
+	}
     CryptoPP::Base64Decoder encoder(new CryptoPP::StringSource(encoded, true, new CryptoPP::Base64Decoder));
     _private_key.BERDecode(encoder);
-	CryptoPP::RSA::PublicKey _public_key(_private_key);
+	_public_key = CryptoPP::RSA::PublicKey(_private_key);
 }
 
 
 std::string* KeyManager::GetEncodedPrivateKey() {
 	/* User must free */
 	std::string* encoded = new std::string();
+	if (_mode == X25519_KEY_EXCHANGE) {
+		*encoded = X25519_PRIVATE_KEY_PREFIX;
+		CryptoPP::StringSource ss(_x25519_private_key, _x25519_private_key.size(), true, new CryptoPP::Base64Encoder(new CryptoPP::StringSink(*encoded)));
+		return encoded;
+	}
     CryptoPP::Base64Encoder encoder(new CryptoPP::StringSink(*encoded));
 	_private_key.DEREncode(encoder);
     encoder.MessageEnd();
@@ -28,6 +86,12 @@ std::string* KeyManager::GetEncodedPrivateKey() {
 
 std::string* KeyManager::GetPublicKey() {
 	/* User must free */
+	if (_mode == X25519_KEY_EXCHANGE) {
+		std::string* slot = new std::string(X25519_PUBLIC_KEY_TAG);
+		slot->append((const char*)_x25519_public_key.data(), _x25519_public_key.size());
+		slot->resize(PUBLIC_KEY_SLOT_SIZE, 0);
+		return slot;
+	}
     std::string key;
 	CryptoPP::StringSink stringSource(key);
 	_public_key.DEREncode(stringSource.Ref());
@@ -63,8 +127,7 @@ std::string SymmetricKeyEncryptor::ECBMode_Encrypt(std::string text) {
     }
     catch (const CryptoPP::Exception& e)
     {
-        std::cerr << e.what() << std::endl;
-        exit(1);
+        throw KeyManagerException();
     }
     return cipher;
 }
@@ -84,8 +147,7 @@ std::string SymmetricKeyEncryptor::ECBMode_Decrypt(std::string cipher) {
     }
     catch (const CryptoPP::Exception& e)
     {
-        std::cerr << e.what() << std::endl;
-        exit(1);
+        throw KeyManagerException();
     }
     return recovered;
 }
@@ -98,12 +160,38 @@ std::array<CryptoPP::byte, 16>* SymmetricKeyEncryptor::GetKey() {
 
 
 SymmetricKeyEncryptor* KeyManager::DecryptSymmetricKey(std::string enc) {
+    TraceSpan span("KeyManager::DecryptSymmetricKey");
     std::string decrypted;
-    CryptoPP::RSAES_OAEP_SHA_Decryptor d(_private_key);
-    CryptoPP::AutoSeededRandomPool prng;
-    CryptoPP::StringSource ss(enc, true,
-        new CryptoPP::PK_DecryptorFilter(prng, d,
-            new CryptoPP::StringSink(decrypted)));
+    if (_mode == X25519_KEY_EXCHANGE) {
+        /* The sender's one-time public key followed by the wrapped key and its tag */
+        if (enc.size() != X25519_KEY_SIZE + 16 + WRAPPED_KEY_TAG_SIZE) {
+            throw KeyManagerException();
+        }
+        const CryptoPP::byte* sender_public_key = (const CryptoPP::byte*)enc.data();
+        CryptoPP::x25519 domain;
+        CryptoPP::SecByteBlock agreed(domain.AgreedValueLength());
+        if (!domain.Agree(agreed, _x25519_private_key, sender_public_key)) {
+            throw KeyManagerException();
+        }
+        CryptoPP::SecByteBlock wrapping_key = DeriveWrappingKey(agreed, sender_public_key, _x25519_public_key);
+        CryptoPP::byte iv[12] = { 0 };
+        CryptoPP::GCM<CryptoPP::AES>::Decryption dec;
+        dec.SetKeyWithIV(wrapping_key, wrapping_key.size(), iv, sizeof(iv));
+        try {
+            CryptoPP::StringSource ss(enc.substr(X25519_KEY_SIZE), true,
+                new CryptoPP::AuthenticatedDecryptionFilter(dec, new CryptoPP::StringSink(decrypted)));
+        }
+        catch (const CryptoPP::Exception&) {
+            throw KeyManagerException();
+        }
+    }
+    else {
+        CryptoPP::RSAES_OAEP_SHA_Decryptor d(_private_key);
+        CryptoPP::AutoSeededRandomPool prng;
+        CryptoPP::StringSource ss(enc, true,
+            new CryptoPP::PK_DecryptorFilter(prng, d,
+                new CryptoPP::StringSink(decrypted)));
+    }
     if (decrypted.size() != 16) {
         throw KeyManagerException();
     }
@@ -114,20 +202,47 @@ SymmetricKeyEncryptor* KeyManager::DecryptSymmetricKey(std::string enc) {
 
 
 std::string* PublicKeyManager::EncryptSymmetricKey(SymmetricKeyEncryptor key) {
+    TraceSpan span("PublicKeyManager::EncryptSymmetricKey");
     std::string* encrypted = new std::string();
-    CryptoPP::RSAES_OAEP_SHA_Encryptor e(_public_key);
     CryptoPP::AutoSeededRandomPool prng;
     std::array<CryptoPP::byte, 16>* key_data = key.GetKey();
     std::string string_key_data = std::string(key_data->begin(), key_data->end());
+    delete key_data;
+    if (_mode == X25519_KEY_EXCHANGE) {
+        CryptoPP::x25519 domain;
+        CryptoPP::SecByteBlock private_key(domain.PrivateKeyLength()), public_key(domain.PublicKeyLength());
+        domain.GenerateKeyPair(prng, private_key, public_key);
+        CryptoPP::SecByteBlock agreed(domain.AgreedValueLength());
+        if (!domain.Agree(agreed, private_key, _x25519_public_key)) {
+            delete encrypted;
+            throw KeyManagerException();
+        }
+        CryptoPP::SecByteBlock wrapping_key = DeriveWrappingKey(agreed, public_key, _x25519_public_key);
+        CryptoPP::byte iv[12] = { 0 };
+        CryptoPP::GCM<CryptoPP::AES>::Encryption enc;
+        enc.SetKeyWithIV(wrapping_key, wrapping_key.size(), iv, sizeof(iv));
+        encrypted->assign((const char*)public_key.data(), public_key.size());
+        CryptoPP::StringSource ss(string_key_data, true,
+            new CryptoPP::AuthenticatedEncryptionFilter(enc, new CryptoPP::StringSink(*encrypted), false, WRAPPED_KEY_TAG_SIZE));
+        return encrypted;
+    }
+    CryptoPP::RSAES_OAEP_SHA_Encryptor e(_public_key);
     CryptoPP::StringSource ss(string_key_data, true,
         new CryptoPP::PK_EncryptorFilter(prng, e,
             new CryptoPP::StringSink(*encrypted)));
-    delete key_data;
     return encrypted;
 }
 
 
 PublicKeyManager::PublicKeyManager(std::string encoded) {
+    if (encoded.compare(0, X25519_PUBLIC_KEY_TAG.size(), X25519_PUBLIC_KEY_TAG) == 0) {
+        if (encoded.size() < X25519_PUBLIC_KEY_TAG.size() + X25519_KEY_SIZE) {
+            throw KeyManagerException();
+        }
+        _mode = X25519_KEY_EXCHANGE;
+        _x25519_public_key.Assign((const CryptoPP::byte*)encoded.data() + X25519_PUBLIC_KEY_TAG.size(), X25519_KEY_SIZE);
+        return;
+    }
     CryptoPP::StringSource s(encoded, true);
     _public_key.Load(s.Ref());
 }
\ No newline at end of file
@@ -6,12 +6,32 @@
 #include <aes.h>
 #include <base64.h>
 #include <modes.h>
+#include <secblock.h>
 
 
 class KeyManagerException : public std::exception {
 };
 
 
+/*
+* How symmetric keys are sent to a user, chosen by the user's own key. RSA_OAEP_KEY_EXCHANGE is the legacy exchange.
+* With X25519_KEY_EXCHANGE the public key slot holds X25519_PUBLIC_KEY_TAG and a Curve25519 key, and senders encrypt
+* the symmetric key with a key agreed between a one-time key of theirs and the recipient's key, which is far cheaper
+* to decrypt than RSA. Senders use whichever exchange the recipient's public key asks for, so users of both kinds can
+* talk to each other as long as the sender's client knows X25519.
+*/
+enum KeyExchangeMode {
+	RSA_OAEP_KEY_EXCHANGE = 0,
+	X25519_KEY_EXCHANGE = 1,
+};
+
+const size_t PUBLIC_KEY_SLOT_SIZE = 160;
+/* Does not start with 0x30 like a DER encoded RSA key */
+const std::string X25519_PUBLIC_KEY_TAG = "MUX25519";
+/* The prefix of an encoded X25519 private key in me.info and key pools */
+const std::string X25519_PRIVATE_KEY_PREFIX = "x25519:";
+
+
 class SymmetricKeyEncryptor {
 private:
 	CryptoPP::byte _key[16];
@@ -26,11 +46,19 @@ public:
 
 class KeyManager {
 private:
+	KeyExchangeMode _mode = RSA_OAEP_KEY_EXCHANGE;
 	CryptoPP::RSA::PublicKey _public_key;
 	CryptoPP::RSA::PrivateKey _private_key;
+	CryptoPP::SecByteBlock _x25519_private_key;
+	CryptoPP::SecByteBlock _x25519_public_key;
+	void _GenerateX25519PublicKey();
 public:
 	KeyManager();
+	KeyManager(KeyExchangeMode mode);
+	/* Decodes a key of either mode from GetEncodedPrivateKey */
 	KeyManager(std::string encoded);
+	KeyExchangeMode GetMode() { return _mode; }
+	/* The content of the public key slot, a DER encoded RSA key or the tagged X25519 key. User must free */
 	std::string* GetPublicKey();
 	std::string* GetEncodedPrivateKey();
 	SymmetricKeyEncryptor* DecryptSymmetricKey(std::string enc);
@@ -39,7 +67,9 @@ public:
 
 class PublicKeyManager {
 private:
+	KeyExchangeMode _mode = RSA_OAEP_KEY_EXCHANGE;
 	CryptoPP::RSA::PublicKey _public_key;
+	CryptoPP::SecByteBlock _x25519_public_key;
 public:
 	PublicKeyManager(std::string encoded);
 	std::string* EncryptSymmetricKey(SymmetricKeyEncryptor key);
@@ -0,0 +1,119 @@
+#include <list>
+#include <future>
+#include <fstream>
+#include <algorithm>
+#include <boost/filesystem.hpp>
+#include <boost/interprocess/sync/file_lock.hpp>
+#include <boost/interprocess/sync/scoped_lock.hpp>
+#include "KeyPool.h"
+
+
+const uint64_t TAIL_READ_SIZE = 4096;
+const char* LOCK_SUFFIX = ".lock";
+
+
+KeyPool::KeyPool(std::string filename) {
+	_filename = filename;
+	_lock_filename = filename + LOCK_SUFFIX;
+}
+
+
+bool KeyPool::_ReadLastKey(uint64_t size, std::string* key, uint64_t* key_offset) {
+	std::ifstream pool(_filename, std::ios::binary);
+	/* A short or failed read must not pass for a (corrupt) key, which would be cut out of the pool */
+	pool.exceptions(std::ios::failbit | std::ios::badbit);
+	/* Only the end of the file is read, the pool may hold many thousands of keys */
+	uint64_t tail_size = TAIL_READ_SIZE;
+	while (true) {
+		tail_size = std::min(tail_size, size);
+		std::string tail(tail_size, 0);
+		pool.seekg(size - tail_size);
+		pool.read(&tail[0], tail_size);
+		if ((uint64_t)pool.gcount() != tail_size) {
+			throw std::ios_base::failure("Could not read the key pool");
+		}
+		size_t end = tail.find_last_not_of("\r\n");
+		if (end == std::string::npos && tail_size == size) {
+			return false;
+		}
+		size_t start = (end == std::string::npos) ? std::string::npos : tail.find_last_of('\n', end);
+		if (start != std::string::npos || tail_size == size) {
+			start = (start == std::string::npos) ? 0 : start + 1;
+			*key = tail.substr(start, end + 1 - start);
+			*key_offset = size - tail_size + start;
+			return true;
+		}
+		tail_size *= 2;
+	}
+}
+
+
+KeyManager* KeyPool::TakeKey() {
+	if (!boost::filesystem::exists(_filename)) {
+		return NULL;
+	}
+	KeyManager* key_manager = NULL;
+	try {
+		std::ofstream(_lock_filename, std::ios::app).close();
+		boost::interprocess::file_lock lock(_lock_filename.c_str());
+		boost::interprocess::scoped_lock<boost::interprocess::file_lock> guard(lock);
+		while (!key_manager) {
+			std::string key;
+			uint64_t key_offset;
+			if (!this->_ReadLastKey(boost::filesystem::file_size(_filename), &key, &key_offset)) {
+				return NULL;
+			}
+			/* The key is decoded before it is cut out of the pool, a corrupt one is dropped so it does not hide the rest */
+			try {
+				key_manager = new KeyManager(key);
+			}
+			catch (const std::exception&) {
+				key_manager = NULL;
+			}
+			boost::filesystem::resize_file(_filename, key_offset);
+		}
+	}
+	catch (const std::exception&) {
+		/* A key left in the pool must not be used, another client would take it too */
+		delete key_manager;
+		return NULL;
+	}
+	return key_manager;
+}
+
+
+std::string GenerateEncodedKey() {
+	KeyManager key_manager = KeyManager();
+	std::string* encoded = key_manager.GetEncodedPrivateKey();
+	std::string result = *encoded;
+	delete encoded;
+	result.erase(std::remove_if(result.begin(), result.end(), [](char c) { return c == '\r' || c == '\n'; }), result.end());
+	return result;
+}
+
+
+void KeyPool::Generate(int count, int thread_count) {
+	thread_count = std::max(1, std::min(thread_count, count));
+	std::list<std::future<std::list<std::string>>> workers;
+	for (int i = 0; i < thread_count; i++) {
+		int worker_count = count / thread_count + (i < count % thread_count ? 1 : 0);
+		workers.push_back(std::async(std::launch::async, [worker_count]() {
+			std::list<std::string> keys;
+			for (int j = 0; j < worker_count; j++) {
+				keys.push_back(GenerateEncodedKey());
+			}
+			return keys;
+		}));
+	}
+	std::ofstream(_filename, std::ios::app).close();
+	std::ofstream(_lock_filename, std::ios::app).close();
+	boost::interprocess::file_lock lock(_lock_filename.c_str());
+	for (auto& worker : workers) {
+		std::list<std::string> keys = worker.get();
+		boost::interprocess::scoped_lock<boost::interprocess::file_lock> guard(lock);
+		std::ofstream pool(_filename, std::ios::app | std::ios::binary);
+		for (auto const& key : keys) {
+			pool << key << "\n";
+		}
+	}
+}
@@ -0,0 +1,31 @@
+#pragma once
+#include <string>
+#include <cstdint>
+#include "KeyManager.h"
+
+
+/*
+* A file of pre-generated RSA private keys, one base64 DER key per line, for provisioning many clients without
+* generating a key for each of them on startup. Clients take keys from the end of the file under a lock of
+* <pool>.lock, so several processes can share one pool.
+*/
+class KeyPool {
+private:
+	std::string _filename;
+	/* File locks are mandatory on Windows, locking the pool itself would block reading and truncating it */
+	std::string _lock_filename;
+	/*
+	* Reads the last key of a pool of size bytes and the offset its line starts at, returns false if there is none.
+	* Throws if the pool could not be read
+	*/
+	bool _ReadLastKey(uint64_t size, std::string* key, uint64_t* key_offset);
+public:
+	KeyPool(std::string filename);
+	/*
+	* Removes a key from the pool, returns NULL if the pool is missing or empty. Corrupt keys (e.g. torn by a crash
+	* while generating) are dropped from the pool and skipped. User must free
+	*/
+	KeyManager* TakeKey();
+	/* Generates count keys on thread_count threads and appends them to the pool */
+	void Generate(int count, int thread_count);
+};
@@ -1,3 +1,5 @@
+#include <iostream>
+#include <sstream>
 #include "Model.h"
 
 
@@ -5,6 +7,10 @@ Model::Model() {
 	_controller = new Controller();
 }
 
+Model::Model(Controller* controller) {
+	_controller = controller;
+}
+
 Model::~Model() {
 	delete _controller;
 }
@@ -34,6 +40,9 @@ void Usage() {
 	std::cout << SEND_REGULAR_MESSAGE << ") Send a text message" << std::endl;
 	std::cout << REQUEST_SYMMETIC_KEY << ") Send a request for symmetirc key" << std::endl;
 	std::cout << SEND_SYMMETRIC_KEY << ") Respond with a symmetric key" << std::endl;
+	std::cout << SEND_REGULAR_MESSAGE_TO_ALL << ") Send a text message to all users" << std::endl;
+	std::cout << REQUEST_SYMMETIC_KEY_FROM_ALL << ") Send a request for symmetirc key to all users" << std::endl;
+	std::cout << PRINT_REQUEST_TIMINGS << ") Print request timings" << std::endl;
 	std::cout << EXIT << ") Exit" << std::endl;
 }
 
@@ -45,6 +54,9 @@ bool IsValidCommand(int input_command) {
 		(input_command == SEND_REGULAR_MESSAGE) ||
 		(input_command == REQUEST_SYMMETIC_KEY) ||
 		(input_command == SEND_SYMMETRIC_KEY) ||
+		(input_command == SEND_REGULAR_MESSAGE_TO_ALL) ||
+		(input_command == REQUEST_SYMMETIC_KEY_FROM_ALL) ||
+		(input_command == PRINT_REQUEST_TIMINGS) ||
 		(input_command == EXIT));
 }
 
@@ -79,39 +91,119 @@ UserCommand Model::InputCommandFromUser() {
 	return input_command;
 }
 
+std::string* ReadUserNameFromCIN() {
+	std::string user_name;
+	std::cout << "Please enter the user's name: ";
+	std::cin >> user_name;
+	while (user_name.length() == 0 || user_name.length() > 254) {
+		if (user_name.length() == 0) {
+			std::cerr << "Empty user names are not supported!" << std::endl;
+		}
+		if (user_name.length() > 254) {
+			std::cerr << "User name too long!";
+		}
+		std::cout << "Please enter the user's name: " << std::endl;
+		std::cin >> user_name;
+	}
+	return new std::string(user_name);
+}
+
+/* Prints why an operation failed, the client cannot go on without the server */
+bool ReportStatus(ControllerStatus status, std::string operation) {
+	if (status == OPERATION_SUCCEEDED) {
+		return true;
+	}
+	std::cerr << GetStatusDescription(status) << std::endl << "--- " << operation << " Failed! ---" << std::endl;
+	if (status == NETWORK_FAILURE) {
+		std::cerr << "Shutting down" << std::endl;
+		exit(-1);
+	}
+	return false;
+}
+
+void PrintMessages(std::list<ReceivedMessage>& messages) {
+	for (auto const& message : messages) {
+		std::cout << "From: " << message.sender_name << std::endl << "Content: " << std::endl;
+		if (!message.is_decrypted) {
+			std::cerr << "\tCan't decrypt message" << std::endl;
+		}
+		else {
+			switch (message.message_type) {
+			case SYMMETRIC_KEY_REQUEST:
+				std::cout << "\tRequest for symmetric key" << std::endl;
+				break;
+			case SYMMETRIC_KEY_RESPONSE:
+				std::cout << "\tSymmetric key recieved" << std::endl;
+				break;
+			case REGULAR_MESSAGE_REQUEST:
+				std::cout << message.content << std::endl;
+				break;
+			default:
+				std::cerr << "--- Unexpected message type! ---" << std::endl;
+			}
+		}
+		std::cout << "----<EOM>----" << std::endl << std::endl;
+	}
+}
+
 void Model::DispatchUserInput(UserCommand input) {
 	std::string message;
 	std::array<char, 255> target_user_name_array;
+	std::list<std::string> user_names;
+	std::list<ReceivedMessage> messages;
+	int sent_count;
 	if ((input == REQUEST_PUBLIC_KEY) || (input == SEND_REGULAR_MESSAGE) || (input == REQUEST_SYMMETIC_KEY) || (input == SEND_SYMMETRIC_KEY)) {
 		target_user_name_array.fill(0);
 		std::string* target_user_name = GetUserName();
-		std::copy_n(std::begin(*target_user_name), target_user_name->size(), target_user_name_array.begin());
+		std::copy_n(std::begin(*target_user_name), std::min(target_user_name->size(), target_user_name_array.size() - 1), target_user_name_array.begin());
 		delete target_user_name;
 	}
 	switch (input)
 	{
-	case REGISTER:
-		_controller->Register();
+	case REGISTER: {
+		std::string* user_name = ReadUserNameFromCIN();
+		ReportStatus(_controller->Register(*user_name), "Signup");
+		delete user_name;
 		break;
+	}
 	case REQUEST_CLIENT_LIST:
-		_controller->UpdateUserList();
+		if (ReportStatus(_controller->UpdateUserList(&user_names), "User List Update Request")) {
+			for (auto const& user_name : user_names) {
+				std::cout << "\tUser Name: " << user_name << std::endl;
+			}
+		}
 		break;
 	case REQUEST_PUBLIC_KEY:
-		_controller->RequestPublicKey(target_user_name_array);
+		ReportStatus(_controller->RequestPublicKey(target_user_name_array), "User Public Key Request");
 		break;
 	case REQUEST_QUEUED_MESSAGES:
-		_controller->RequestMessages();
+		if (ReportStatus(_controller->RequestMessages(&messages), "Awaiting Messages Request")) {
+			PrintMessages(messages);
+		}
 		break;
 	case SEND_REGULAR_MESSAGE:
 		std::cout << "Input message for " << target_user_name_array.data() << " :";
 		std::cin >> message;
-		_controller->SendMessageToUser(target_user_name_array, (char*)message.c_str(), message.length());
+		ReportStatus(_controller->SendMessageToUser(target_user_name_array, (char*)message.c_str(), message.length()), "Send Message");
 		break;
 	case REQUEST_SYMMETIC_KEY:
-		_controller->RequestSymmetricKeyFromUser(target_user_name_array);
+		ReportStatus(_controller->RequestSymmetricKeyFromUser(target_user_name_array), "Symmetric Key Request");
 		break;
 	case SEND_SYMMETRIC_KEY:
-		_controller->GenerateSymmetricKeyForUser(target_user_name_array);
+		ReportStatus(_controller->GenerateSymmetricKeyForUser(target_user_name_array), "Send Symmetric Key");
+		break;
+	case SEND_REGULAR_MESSAGE_TO_ALL:
+		std::cout << "Input message for all users :";
+		std::cin >> message;
+		if (ReportStatus(_controller->SendMessageToAllUsers((char*)message.c_str(), message.length(), &sent_count), "Send Message To All")) {
+			std::cout << "Message sent to " << sent_count << " users" << std::endl;
+		}
+		break;
+	case REQUEST_SYMMETIC_KEY_FROM_ALL:
+		ReportStatus(_controller->RequestSymmetricKeyFromAllUsers(), "Symmetric Key Request To All");
+		break;
+	case PRINT_REQUEST_TIMINGS:
+		ReportStatus(_controller->DumpMetrics(std::cout), "Print Request Timings");
 		break;
 	case EXIT:
 	default:
@@ -119,4 +211,126 @@ void Model::DispatchUserInput(UserCommand input) {
 		exit(0);
 		break;
 	}
-}
\ No newline at end of file
+}
+
+
+std::array<char, 255> ToUserNameArray(std::string user_name) {
+	std::array<char, 255> user_name_array;
+	user_name_array.fill(0);
+	std::copy_n(user_name.begin(), std::min(user_name.size(), user_name_array.size() - 1), user_name_array.begin());
+	return user_name_array;
+}
+
+
+/* The text after the command and its arguments, up to the end of the line */
+std::string ReadRestOfLine(std::istream& arguments) {
+	std::string text;
+	std::getline(arguments >> std::ws, text);
+	return text;
+}
+
+
+ControllerStatus Model::DispatchBatchCommand(std::string command, std::istream& arguments) {
+	std::string user_name, text;
+	ControllerStatus status;
+	if (command == "register") {
+		arguments >> user_name;
+		return _controller->Register(user_name);
+	}
+	if (command == "list") {
+		std::list<std::string> user_names;
+		status = _controller->UpdateUserList(&user_names);
+		for (auto const& name : user_names) {
+			std::cout << "user " << name << std::endl;
+		}
+		return status;
+	}
+	if (command == "public-key") {
+		arguments >> user_name;
+		return _controller->RequestPublicKey(ToUserNameArray(user_name));
+	}
+	if (command == "messages") {
+		std::list<ReceivedMessage> messages;
+		status = _controller->RequestMessages(&messages);
+		for (auto const& message : messages) {
+			std::cout << "message " << message.sender_name << " ";
+			if (!message.is_decrypted) {
+				std::cout << "undecryptable" << std::endl;
+				continue;
+			}
+			switch (message.message_type) {
+			case SYMMETRIC_KEY_REQUEST:
+				std::cout << "key-request" << std::endl;
+				break;
+			case SYMMETRIC_KEY_RESPONSE:
+				std::cout << "key" << std::endl;
+				break;
+			case REGULAR_MESSAGE_REQUEST:
+				std::cout << "text " << message.content << std::endl;
+				break;
+			default:
+				std::cout << "type-" << message.message_type << std::endl;
+			}
+		}
+		return status;
+	}
+	if (command == "send") {
+		arguments >> user_name;
+		text = ReadRestOfLine(arguments);
+		return _controller->SendMessageToUser(ToUserNameArray(user_name), (char*)text.c_str(), text.length());
+	}
+	if (command == "request-key") {
+		arguments >> user_name;
+		return _controller->RequestSymmetricKeyFromUser(ToUserNameArray(user_name));
+	}
+	if (command == "send-key") {
+		arguments >> user_name;
+		return _controller->GenerateSymmetricKeyForUser(ToUserNameArray(user_name));
+	}
+	if (command == "send-all") {
+		int sent_count = 0;
+		text = ReadRestOfLine(arguments);
+		status = _controller->SendMessageToAllUsers((char*)text.c_str(), text.length(), &sent_count);
+		std::cout << "sent " << sent_count << std::endl;
+		return status;
+	}
+	if (command == "request-key-all") {
+		return _controller->RequestSymmetricKeyFromAllUsers();
+	}
+	if (command == "timings") {
+		return _controller->DumpMetrics(std::cout);
+	}
+	throw std::invalid_argument(command);
+}
+
+
+int Model::RunBatch(std::istream& script) {
+	int failed = 0;
+	std::string line, command;
+	while (std::getline(script, line)) {
+		std::istringstream arguments(line);
+		if (!(arguments >> command) || command[0] == '#') {
+			continue;
+		}
+		if (command == "exit") {
+			break;
+		}
+		ControllerStatus status;
+		try {
+			status = this->DispatchBatchCommand(command, arguments);
+		}
+		catch (std::invalid_argument& e) {
+			std::cout << "error " << command << " Unknown command!" << std::endl;
+			failed++;
+			continue;
+		}
+		if (status == OPERATION_SUCCEEDED) {
+			std::cout << "ok " << command << std::endl;
+		}
+		else {
+			std::cout << "error " << command << " " << GetStatusDescription(status) << std::endl;
+			failed++;
+		}
+	}
+	return failed;
+}
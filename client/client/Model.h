@@ -1,7 +1,11 @@
 #pragma once
+#include <istream>
 #include "Controller.h"
 
 
+const int METRICS_DUMP_INTERVAL_SECONDS = 60;
+
+
 enum UserCommand {
 	EXIT = 0,
 	REGISTER = 10,
@@ -11,6 +15,9 @@ enum UserCommand {
 	SEND_REGULAR_MESSAGE = 50,
 	REQUEST_SYMMETIC_KEY = 51,
 	SEND_SYMMETRIC_KEY = 52,
+	SEND_REGULAR_MESSAGE_TO_ALL = 53,
+	REQUEST_SYMMETIC_KEY_FROM_ALL = 54,
+	PRINT_REQUEST_TIMINGS = 60,
 	INVALID_INPUT = -1,
 };
 
@@ -21,8 +28,16 @@ private:
 	std::string* GetUserName();
 	UserCommand InputCommandFromUser();
 	void DispatchUserInput(UserCommand input);
+	ControllerStatus DispatchBatchCommand(std::string command, std::istream& arguments);
 public:
 	Model();
+	/* Runs the menus of the given controller, which the Model deletes */
+	Model(Controller* controller);
 	~Model();
 	void Run();
+	/*
+	* Runs the commands in the script, one per line, without prompts. Prints the results of every command and an
+	* "ok <command>" or "error <command> <description>" line for it. Returns the number of failed commands.
+	*/
+	int RunBatch(std::istream& script);
 };
@@ -42,8 +42,18 @@ RequestHeader::RequestHeader(std::array<char, 16> client_id, unsigned short code
 	_payload_size = payload->data_size();
 }
 
+unsigned short RequestHeader::GetCode() {
+	return _code;
+}
+
+void RequestHeader::SetTraceID(uint64_t trace_id) {
+	_trace_id = trace_id;
+}
+
 PackedPayload* RequestHeader::pack() {
-	int data_size = sizeof(_client_id) + sizeof(_version) + sizeof(_code) + sizeof(_payload_size) + _payload->data_size();
+	int extension_size = _trace_id ? sizeof(_trace_id) : 0;
+	char version = _trace_id ? (_version | TRACE_FLAG) : _version;
+	int data_size = sizeof(_client_id) + sizeof(_version) + sizeof(_code) + sizeof(_payload_size) + extension_size + _payload->data_size();
 	char* data = (char*)malloc(sizeof(char)*data_size);
 	if (!data) {
 		throw ProtocolException();
@@ -51,12 +61,16 @@ PackedPayload* RequestHeader::pack() {
 	char* index = data;
 	memcpy(index, _client_id.data(), _client_id.size() * sizeof(char));
 	index = index + _client_id.size() * sizeof(char);
-	memcpy(index, &_version, sizeof(char));
+	memcpy(index, &version, sizeof(char));
 	index = index + sizeof(char);
 	memcpy(index, &_code, sizeof(unsigned short));
 	index = index + sizeof(short);
 	memcpy(index, &_payload_size, sizeof(int));
 	index = index + sizeof(int);
+	if (extension_size) {
+		memcpy(index, &_trace_id, extension_size);
+		index = index + extension_size;
+	}
 	if (_payload_size) {
 		memcpy(index, _payload->get_data(), _payload_size * sizeof(char));
 	}
@@ -113,6 +127,71 @@ SendMessageRequest::SendMessageRequest(std::array<char, 16> client_id, uint8_t t
 }
 
 
+MultiSendMessageRequest::MultiSendMessageRequest(std::list<std::array<char, 16>> client_ids, uint8_t type, int content_size, char* message_content) : RequestPayload(NULL, 0) {
+	uint8_t shared_content = 1;
+	unsigned int recipient_count = client_ids.size();
+	_data_size = sizeof(uint8_t) * 2 + sizeof(int) * 2 + content_size * sizeof(char) + recipient_count * 16 * sizeof(char);
+	_data = (char*)malloc(sizeof(char) * _data_size);
+	if (!_data) {
+		throw ProtocolException();
+	}
+	char* index = _data;
+	memcpy(index, &type, sizeof(uint8_t));
+	index = index + sizeof(uint8_t);
+	memcpy(index, &shared_content, sizeof(uint8_t));
+	index = index + sizeof(uint8_t);
+	memcpy(index, &recipient_count, sizeof(int));
+	index = index + sizeof(int);
+	memcpy(index, &content_size, sizeof(int));
+	index = index + sizeof(int);
+	if (message_content) {
+		memcpy(index, message_content, content_size * sizeof(char));
+	}
+	index = index + content_size * sizeof(char);
+	for (auto const& client_id : client_ids) {
+		memcpy(index, client_id.data(), client_id.size() * sizeof(char));
+		index = index + client_id.size() * sizeof(char);
+	}
+}
+
+
+MultiSendMessageRequest::MultiSendMessageRequest(std::list<std::pair<std::array<char, 16>, std::string>> messages, uint8_t type) : RequestPayload(NULL, 0) {
+	uint8_t shared_content = 0;
+	unsigned int recipient_count = messages.size();
+	_data_size = sizeof(uint8_t) * 2 + sizeof(int);
+	for (auto const& message : messages) {
+		_data_size += message.first.size() * sizeof(char) + sizeof(int) + message.second.size() * sizeof(char);
+	}
+	_data = (char*)malloc(sizeof(char) * _data_size);
+	if (!_data) {
+		throw ProtocolException();
+	}
+	char* index = _data;
+	memcpy(index, &type, sizeof(uint8_t));
+	index = index + sizeof(uint8_t);
+	memcpy(index, &shared_content, sizeof(uint8_t));
+	index = index + sizeof(uint8_t);
+	memcpy(index, &recipient_count, sizeof(int));
+	index = index + sizeof(int);
+	for (auto const& message : messages) {
+		int content_size = message.second.size();
+		memcpy(index, message.first.data(), message.first.size() * sizeof(char));
+		index = index + message.first.size() * sizeof(char);
+		memcpy(index, &content_size, sizeof(int));
+		index = index + sizeof(int);
+		memcpy(index, message.second.data(), content_size * sizeof(char));
+		index = index + content_size * sizeof(char);
+	}
+}
+
+
+MultiSendMessageRequest::~MultiSendMessageRequest() {
+	if (_data) {
+		free(_data);
+	}
+}
+
+
 ResponseHeader::ResponseHeader(char data[7]) {
 	_server_version = (uint8_t)data[0];
 	_code = ShrotFromBuffer(data + 1);
@@ -211,6 +290,18 @@ int MessageSentResponse::GetMessageID() {
 }
 
 
+MessagesSentResponse::MessagesSentResponse(char* data, int data_size) : ResponsePayload() {
+	if (data_size % 20) {
+		throw ProtocolException();
+	}
+	for (int i = 0; i < data_size / 20; i++) {
+		std::array<char, 16> client_id;
+		std::copy_n(data + i * 20, 16, client_id.begin());
+		messages.push_back(std::make_pair(client_id, (int)IntFromBuffer(data + i * 20 + 16)));
+	}
+}
+
+
 AwaitingMessageRecord::AwaitingMessageRecord(char* data, int data_size) {
 	if (data_size < 21) {
 		throw ProtocolException();
@@ -277,4 +368,17 @@ AwaitingMessagesResponse::~AwaitingMessagesResponse() {
 }
 
 
-ServerError::ServerError() : ResponsePayload() {}
\ No newline at end of file
+ServerError::ServerError() : ResponsePayload() {}
+
+
+ServerOverloaded::ServerOverloaded(char* data, int data_size) : ServerError() {
+	if (data_size != 4) {
+		throw ProtocolException();
+	}
+	_retry_after = IntFromBuffer(data);
+}
+
+
+unsigned int ServerOverloaded::GetRetryAfter() {
+	return _retry_after;
+}
\ No newline at end of file
@@ -1,8 +1,14 @@
 #pragma once
 #include <list>
+#include <array>
+#include <cstdint>
+#include <string>
+#include <utility>
 
 
 const int CLIENT_VERSIION = 1; 
+/* Set in the version of requests whose header is followed by an 8 byte trace id, which payload_size doesn't count */
+const char TRACE_FLAG = (char)0x80;
 
 class ProtocolException : public std::exception {
 };
@@ -14,6 +20,7 @@ enum RequestType {
 	USER_PUBLIC_KEY_REQUEST = 1002,
 	MESSAGE_USER_REQUEST = 1003,
 	QUEUED_MESSAGES_REQUEST = 1004,
+	MULTI_MESSAGE_USER_REQUEST = 1005,
 };
 
 enum ResponseType {
@@ -22,7 +29,9 @@ enum ResponseType {
 	USER_PUBLIC_KEY_RESPONSE = 2002,
 	MESSAGE_SENT_TO_USER_RESPONSE = 2003,
 	QUEUED_MESSAGES_RESPONSE = 2004,
+	MESSAGES_SENT_TO_USERS_RESPONSE = 2005,
 	SERVER_ERROR = 9000,
+	SERVER_OVERLOADED = 9001,
 };
 
 
@@ -53,9 +62,13 @@ protected:
 	unsigned short _code;
 	unsigned int _payload_size;
 	RequestPayload* _payload;
+	uint64_t _trace_id = 0;
 public:
 	RequestHeader(std::array<char, 16> client_id, unsigned short code, RequestPayload* payload);
 	PackedPayload* pack();
+	unsigned short GetCode();
+	/* Sends the trace id in the header extension, 0 sends no extension */
+	void SetTraceID(uint64_t trace_id);
 };
 
 
@@ -89,6 +102,16 @@ public:
 };
 
 
+class MultiSendMessageRequest : public RequestPayload {
+public:
+	/* The same content to every recipient */
+	MultiSendMessageRequest(std::list<std::array<char, 16>> client_ids, uint8_t type, int content_size, char* message_content);
+	/* Its own content to every recipient */
+	MultiSendMessageRequest(std::list<std::pair<std::array<char, 16>, std::string>> messages, uint8_t type);
+	virtual ~MultiSendMessageRequest();
+};
+
+
 class ResponsePayload {
 public:
 	virtual ~ResponsePayload() {};
@@ -153,6 +176,14 @@ public:
 };
 
 
+class MessagesSentResponse : public virtual ResponsePayload {
+public:
+	/* Recipient and message id of every message sent, in the order of the request */
+	std::list<std::pair<std::array<char, 16>, int>> messages;
+	MessagesSentResponse(char* data, int data_size);
+};
+
+
 class AwaitingMessageRecord {
 private:
 	std::array<char, 16> _client_id;
@@ -180,4 +211,14 @@ public:
 class ServerError : public virtual ResponsePayload {
 public:
 	ServerError();
+};
+
+
+class ServerOverloaded : public ServerError {
+private:
+	unsigned int _retry_after;
+public:
+	ServerOverloaded(char* data, int data_size);
+	/* Milliseconds to wait before sending the request again */
+	unsigned int GetRetryAfter();
 };
\ No newline at end of file
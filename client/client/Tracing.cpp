@@ -0,0 +1,179 @@
+#include <random>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <thread>
+#ifdef _WIN32
+#include <process.h>
+#define getpid _getpid
+#else
+#include <unistd.h>
+#endif
+#include "Tracing.h"
+
+
+/* Events are written to the trace file when this many were recorded, and when the process exits */
+const size_t FLUSH_EVENT_COUNT = 1024;
+
+thread_local uint64_t current_trace_id = 0;
+
+
+Tracer::Tracer() {
+	_pid = getpid();
+}
+
+
+Tracer::~Tracer() {
+	this->Flush();
+}
+
+
+Tracer& Tracer::Instance() {
+	static Tracer instance;
+	return instance;
+}
+
+
+void Tracer::Enable(std::string filename) {
+	std::lock_guard<std::mutex> guard(_lock);
+	_filename = filename;
+	std::ofstream ofs(_filename, std::ios::trunc);
+	ofs << "[" << std::endl;
+	ofs << "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": " << _pid << ", \"args\": {\"name\": \"client " << _pid << "\"}}," << std::endl;
+	_enabled = true;
+}
+
+
+uint64_t Tracer::GetTraceID() {
+	return current_trace_id;
+}
+
+
+void Tracer::SetTraceID(uint64_t trace_id) {
+	current_trace_id = trace_id;
+}
+
+
+long long ToTraceMicroseconds(std::chrono::system_clock::duration duration) {
+	return std::chrono::duration_cast<std::chrono::microseconds>(duration).count();
+}
+
+
+void Tracer::Record(const char* name, std::chrono::system_clock::time_point start, std::chrono::system_clock::time_point end) {
+	this->Record(name, start, end, current_trace_id);
+}
+
+
+void Tracer::Record(const char* name, std::chrono::system_clock::time_point start, std::chrono::system_clock::time_point end, uint64_t trace_id) {
+	std::ostringstream event;
+	event << "{\"name\": \"" << name << "\", \"cat\": \"client\", \"ph\": \"X\", \"ts\": " << ToTraceMicroseconds(start.time_since_epoch())
+		<< ", \"dur\": " << ToTraceMicroseconds(end - start) << ", \"pid\": " << _pid
+		<< ", \"tid\": " << std::hash<std::thread::id>()(std::this_thread::get_id()) % 1000000;
+	if (trace_id) {
+		event << ", \"args\": {\"trace_id\": \"" << std::hex << std::setfill('0') << std::setw(16) << trace_id << "\"}";
+	}
+	event << "},";
+	bool should_flush;
+	{
+		std::lock_guard<std::mutex> guard(_lock);
+		_events.push_back(event.str());
+		should_flush = _events.size() >= FLUSH_EVENT_COUNT;
+	}
+	if (should_flush) {
+		this->Flush();
+	}
+}
+
+
+void Tracer::Flush() {
+	std::lock_guard<std::mutex> guard(_lock);
+	if (_events.empty()) {
+		return;
+	}
+	std::ofstream ofs(_filename, std::ios::app);
+	for (auto const& event : _events) {
+		ofs << event << std::endl;
+	}
+	_events.clear();
+}
+
+
+TraceSpan::TraceSpan(const char* name) {
+	_name = name;
+	_is_timed = Tracer::Instance().IsEnabled();
+	if (_is_timed) {
+		_start = std::chrono::system_clock::now();
+	}
+}
+
+
+void TraceSpan::_Finish() {
+	if (_is_timed) {
+		Tracer::Instance().Record(_name, _start, std::chrono::system_clock::now());
+		_is_timed = false;
+	}
+}
+
+
+TraceSpan::~TraceSpan() {
+	this->_Finish();
+}
+
+
+uint64_t NewTraceID() {
+	thread_local std::mt19937_64 generator(std::random_device{}());
+	uint64_t trace_id;
+	while (!(trace_id = generator())) {
+	}
+	return trace_id;
+}
+
+
+TraceScope::TraceScope(const char* name) : TraceSpan(name) {
+	_is_outermost = !Tracer::GetTraceID() && Tracer::Instance().IsEnabled();
+	if (_is_outermost) {
+		Tracer::SetTraceID(NewTraceID());
+	}
+}
+
+
+TraceScope::~TraceScope() {
+	this->_Finish();
+	if (_is_outermost) {
+		Tracer::SetTraceID(0);
+	}
+}
+
+
+AsyncTraceScope::AsyncTraceScope(const char* name) {
+	_name = name;
+	_is_timed = Tracer::Instance().IsEnabled();
+	_is_outermost = !Tracer::GetTraceID() && _is_timed;
+	if (_is_outermost) {
+		Tracer::SetTraceID(NewTraceID());
+	}
+	_trace_id = Tracer::GetTraceID();
+	if (_is_timed) {
+		_start = std::chrono::system_clock::now();
+	}
+}
+
+
+AsyncTraceScope::~AsyncTraceScope() {
+	if (_is_outermost) {
+		Tracer::SetTraceID(0);
+	}
+}
+
+
+std::function<void()> AsyncTraceScope::GetFinisher() {
+	if (!_is_timed) {
+		return []() {};
+	}
+	const char* name = _name;
+	uint64_t trace_id = _trace_id;
+	std::chrono::system_clock::time_point start = _start;
+	return [name, trace_id, start]() {
+		Tracer::Instance().Record(name, start, std::chrono::system_clock::now(), trace_id);
+	};
+}
@@ -0,0 +1,87 @@
+#pragma once
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <functional>
+
+
+/*
+* Records spans as Chrome trace events, tagged with the trace id of the user operation running on the thread.
+* The trace id is sent to the server in the request header extension, so the server's spans of the request carry it
+* too. Events are appended to the trace file in the JSON array format, which trace viewers accept without the closing
+* bracket. Disabled by default - spans only read the clock when tracing is enabled.
+*/
+class Tracer {
+private:
+	std::atomic<bool> _enabled{ false };
+	std::mutex _lock;
+	std::vector<std::string> _events;
+	std::string _filename;
+	int _pid;
+
+	Tracer();
+
+public:
+	static Tracer& Instance();
+	virtual ~Tracer();
+
+	void Enable(std::string filename);
+	bool IsEnabled() const { return _enabled.load(std::memory_order_relaxed); }
+	/* The trace id of the thread's current operation, 0 if there is none */
+	static uint64_t GetTraceID();
+	static void SetTraceID(uint64_t trace_id);
+	void Record(const char* name, std::chrono::system_clock::time_point start, std::chrono::system_clock::time_point end);
+	/* Records a span of the trace_id trace, for operations that complete on a thread other than their own */
+	void Record(const char* name, std::chrono::system_clock::time_point start, std::chrono::system_clock::time_point end, uint64_t trace_id);
+	void Flush();
+};
+
+
+/* A span from construction to destruction */
+class TraceSpan {
+private:
+	const char* _name;
+	bool _is_timed;
+	std::chrono::system_clock::time_point _start;
+protected:
+	/* Records the span, only the first call has an effect */
+	void _Finish();
+public:
+	TraceSpan(const char* name);
+	virtual ~TraceSpan();
+};
+
+
+/*
+* The span of a user operation, which starts a new trace unless the thread is already inside one. Spans recorded by
+* the thread until it is destroyed carry the trace id.
+*/
+class TraceScope : public TraceSpan {
+private:
+	bool _is_outermost;
+public:
+	TraceScope(const char* name);
+	virtual ~TraceScope();
+};
+
+
+/*
+* The span of a user operation that completes on another thread. Like TraceScope, it starts a new trace unless the
+* thread is already inside one, and spans recorded by the thread until it is destroyed carry the trace id. The span
+* itself is recorded by the function returned by GetFinisher, wherever the operation completes.
+*/
+class AsyncTraceScope {
+private:
+	const char* _name;
+	bool _is_timed;
+	bool _is_outermost;
+	uint64_t _trace_id;
+	std::chrono::system_clock::time_point _start;
+public:
+	AsyncTraceScope(const char* name);
+	virtual ~AsyncTraceScope();
+	std::function<void()> GetFinisher();
+};
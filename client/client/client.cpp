@@ -1,7 +1,77 @@
-﻿#include "Model.h"
+﻿#include <thread>
+#include <fstream>
+#include <iostream>
+#include "Model.h"
+#include "KeyPool.h"
 
-int main()
+int main(int argc, char* argv[])
 {
-    Model m = Model();
+    /*
+    * client.exe --metrics <file> times every request and periodically writes the timings to the file.
+    * client.exe --trace <file> writes the spans of every operation to the file, in the Chrome trace format.
+    * client.exe --key-pool <file> takes the key of a new user from a pool of pre-generated keys.
+    * client.exe --key-pool <file> --generate-keys <count> adds count keys to the pool and exits.
+    * client.exe --key-exchange x25519 registers with an X25519 key instead of an RSA one, which makes receiving
+    * symmetric keys much faster. Peers must run a client that knows X25519 to send keys to this user.
+    * client.exe --data-dir <directory> keeps server.info, me.info and the contacts in the directory instead of next to
+    * the binary, so one machine can run many users.
+    * client.exe --batch <file> runs the commands in the file (- for stdin) without prompts, see Model::RunBatch.
+    */
+    std::string metrics_filename, trace_filename, key_pool_filename, data_directory, batch_filename;
+    int generate_key_count = 0;
+    KeyExchangeMode key_exchange_mode = RSA_OAEP_KEY_EXCHANGE;
+    for (int i = 1; i + 1 < argc; i += 2) {
+        if (std::string(argv[i]) == "--metrics") {
+            metrics_filename = argv[i + 1];
+        }
+        else if (std::string(argv[i]) == "--trace") {
+            trace_filename = argv[i + 1];
+        }
+        else if (std::string(argv[i]) == "--key-pool") {
+            key_pool_filename = argv[i + 1];
+        }
+        else if (std::string(argv[i]) == "--generate-keys") {
+            generate_key_count = atoi(argv[i + 1]);
+        }
+        else if (std::string(argv[i]) == "--key-exchange" && std::string(argv[i + 1]) == "x25519") {
+            key_exchange_mode = X25519_KEY_EXCHANGE;
+        }
+        else if (std::string(argv[i]) == "--data-dir") {
+            data_directory = argv[i + 1];
+        }
+        else if (std::string(argv[i]) == "--batch") {
+            batch_filename = argv[i + 1];
+        }
+    }
+    if (generate_key_count > 0 && !key_pool_filename.empty()) {
+        KeyPool(key_pool_filename).Generate(generate_key_count, std::thread::hardware_concurrency());
+        return 0;
+    }
+    Controller* controller;
+    try {
+        controller = new Controller(data_directory, key_pool_filename, key_exchange_mode);
+    }
+    catch (ControllerException& e) {
+        std::cerr << e.what() << std::endl;
+        return -1;
+    }
+    if (!metrics_filename.empty()) {
+        controller->EnableMetrics(metrics_filename, METRICS_DUMP_INTERVAL_SECONDS);
+    }
+    if (!trace_filename.empty()) {
+        controller->EnableTracing(trace_filename);
+    }
+    Model m = Model(controller);
+    if (batch_filename == "-") {
+        return m.RunBatch(std::cin) ? 1 : 0;
+    }
+    if (!batch_filename.empty()) {
+        std::ifstream script(batch_filename);
+        if (!script) {
+            std::cerr << "Could not open batch file " << batch_filename << std::endl;
+            return -1;
+        }
+        return m.RunBatch(script) ? 1 : 0;
+    }
     m.Run();
 }
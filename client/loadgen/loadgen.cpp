@@ -0,0 +1,395 @@
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <map>
+#include <random>
+#include <thread>
+#include <chrono>
+#include <atomic>
+#include <sstream>
+#include <cstring>
+#include <boost/asio.hpp>
+#include "Protocol.h"
+#include "Histogram.h"
+
+/*
+* Load generator for the MessageU server. Registers virtual users and then has every thread run a random mix of
+* operations as them, reporting throughput and latency percentiles per request type.
+*
+* Message contents are random bytes of the size the client's encryption produces (Crypto++ is not needed), so the
+* server sees the same request sizes as with real clients.
+*/
+
+const uint8_t SYMMETRIC_KEY_REQUEST_MESSAGE = 1;
+const uint8_t SYMMETRIC_KEY_RESPONSE_MESSAGE = 2;
+const uint8_t TEXT_MESSAGE = 3;
+const int ENCRYPTED_SYMMETRIC_KEY_SIZE = 128;
+const int AES_BLOCK_SIZE = 16;
+
+enum Operation {
+	REFRESH_LIST,
+	FETCH_KEY,
+	EXCHANGE_KEYS,
+	SEND_MESSAGE,
+	POLL_MESSAGES,
+	OPERATION_COUNT,
+};
+
+const char* OPERATION_NAMES[OPERATION_COUNT] = { "list", "key", "exchange", "send", "poll" };
+
+
+class LoadException : public std::exception {
+};
+
+
+struct Options {
+	std::string host = "127.0.0.1";
+	int port = 0;
+	int users = 1000;
+	int threads = 8;
+	double duration = 30;
+	/* Requests per second over all threads, 0 to send as fast as responses arrive */
+	double rate = 0;
+	int message_size = 64;
+	std::array<int, OPERATION_COUNT> mix = { 10, 10, 5, 40, 35 };
+};
+
+
+struct RequestStats {
+	Histogram latency;
+	uint64_t errors = 0;
+	uint64_t overloaded = 0;
+};
+
+
+std::string RequestName(int code) {
+	switch (code) {
+	case SIGNUP_REQUEST: return "SIGNUP_REQUEST";
+	case USER_LIST_REQUEST: return "USER_LIST_REQUEST";
+	case USER_PUBLIC_KEY_REQUEST: return "USER_PUBLIC_KEY_REQUEST";
+	case MESSAGE_USER_REQUEST: return "MESSAGE_USER_REQUEST";
+	case QUEUED_MESSAGES_REQUEST: return "QUEUED_MESSAGES_REQUEST";
+	case MULTI_MESSAGE_USER_REQUEST: return "MULTI_MESSAGE_USER_REQUEST";
+	default: return std::to_string(code);
+	}
+}
+
+
+ResponsePayload* ParseResponse(ResponseHeader* header, char* data_read) {
+	int buffer_size = header->GetPyaloadSize();
+	switch (header->GetResponseCode()) {
+	case SIGNUP_SUCCESS_RESPONSE:
+		return new SignupSuccessResponse(data_read, buffer_size);
+	case USER_LIST_RESPONSE:
+		return new UserListResponse(data_read, buffer_size);
+	case USER_PUBLIC_KEY_RESPONSE:
+		return new UserPublicKeyResponse(data_read, buffer_size);
+	case MESSAGE_SENT_TO_USER_RESPONSE:
+		return new MessageSentResponse(data_read, buffer_size);
+	case QUEUED_MESSAGES_RESPONSE:
+		return new AwaitingMessagesResponse(data_read, buffer_size);
+	case MESSAGES_SENT_TO_USERS_RESPONSE:
+		return new MessagesSentResponse(data_read, buffer_size);
+	case SERVER_OVERLOADED:
+		return new ServerOverloaded(data_read, buffer_size);
+	default:
+		return new ServerError();
+	}
+}
+
+
+class LoadWorker {
+private:
+	const Options& _options;
+	std::vector<std::array<char, 16>>& _users;
+	std::map<int, RequestStats> _stats;
+	boost::asio::io_context _io_context;
+	boost::asio::ip::tcp::resolver::results_type _endpoints;
+	std::mt19937_64 _random;
+
+	std::string _RandomBytes(int size) {
+		std::string result(size, 0);
+		for (auto& c : result) {
+			c = (char)_random();
+		}
+		return result;
+	}
+
+	std::array<char, 16> _RandomUser() {
+		return _users[_random() % _users.size()];
+	}
+
+	/*
+	* Sends one request on a new connection, as the client does. Latency is measured from start, the time the
+	* request was due, so requests delayed by slow responses count as slow.
+	* Returns the response (to be deleted by the caller), or NULL if the server failed or was overloaded.
+	*/
+	ResponsePayload* _Send(std::array<char, 16> client_id, unsigned short code, RequestPayload* payload, std::chrono::steady_clock::time_point start) {
+		RequestStats& stats = _stats[code];
+		RequestHeader header = RequestHeader(client_id, code, payload);
+		PackedPayload* packed = header.pack();
+		ResponsePayload* response = NULL;
+		try {
+			boost::asio::ip::tcp::socket sock(_io_context);
+			boost::asio::connect(sock, _endpoints);
+			boost::asio::write(sock, boost::asio::buffer(packed->_data, packed->_data_length));
+			char header_data[7];
+			boost::asio::read(sock, boost::asio::buffer(header_data, sizeof(header_data)));
+			ResponseHeader response_header = ResponseHeader(header_data);
+			std::vector<char> payload_data(response_header.GetPyaloadSize());
+			boost::asio::read(sock, boost::asio::buffer(payload_data));
+			response = ParseResponse(&response_header, payload_data.data());
+		}
+		catch (const std::exception&) {
+			stats.errors++;
+		}
+		free(packed->_data);
+		delete packed;
+		if (!response) {
+			return NULL;
+		}
+		if (dynamic_cast<ServerOverloaded*>(response)) {
+			stats.overloaded++;
+		}
+		else if (dynamic_cast<ServerError*>(response)) {
+			stats.errors++;
+		}
+		else {
+			stats.latency.Record(std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count());
+			return response;
+		}
+		delete response;
+		return NULL;
+	}
+
+	void _SendMessage(std::array<char, 16> sender, std::array<char, 16> receiver, uint8_t type, std::string content, std::chrono::steady_clock::time_point start) {
+		SendMessageRequest request = SendMessageRequest(receiver, type, content.size(), content.empty() ? NULL : (char*)content.data());
+		delete _Send(sender, MESSAGE_USER_REQUEST, &request, start);
+		free(request.get_data());
+	}
+
+	void _RunOperation(Operation operation, std::chrono::steady_clock::time_point start) {
+		std::array<char, 16> user = _RandomUser();
+		std::array<char, 16> peer = _RandomUser();
+		switch (operation) {
+		case REFRESH_LIST: {
+			UserListRequest request = UserListRequest();
+			delete _Send(user, USER_LIST_REQUEST, &request, start);
+			break;
+		}
+		case FETCH_KEY: {
+			UserPublicKeyRequest request = UserPublicKeyRequest(peer);
+			delete _Send(user, USER_PUBLIC_KEY_REQUEST, &request, start);
+			free(request.get_data());
+			break;
+		}
+		case EXCHANGE_KEYS:
+			_SendMessage(user, peer, SYMMETRIC_KEY_REQUEST_MESSAGE, "", start);
+			_SendMessage(peer, user, SYMMETRIC_KEY_RESPONSE_MESSAGE, _RandomBytes(ENCRYPTED_SYMMETRIC_KEY_SIZE), std::chrono::steady_clock::now());
+			break;
+		case SEND_MESSAGE:
+			/* AES in ECB mode with PKCS padding always adds 1 to 16 bytes */
+			_SendMessage(user, peer, TEXT_MESSAGE, _RandomBytes((_options.message_size / AES_BLOCK_SIZE + 1) * AES_BLOCK_SIZE), start);
+			break;
+		case POLL_MESSAGES: {
+			MessageListRequest request = MessageListRequest();
+			delete _Send(user, QUEUED_MESSAGES_REQUEST, &request, start);
+			break;
+		}
+		default:
+			break;
+		}
+	}
+
+public:
+	LoadWorker(const Options& options, std::vector<std::array<char, 16>>& users, uint64_t seed) : _options(options), _users(users), _random(seed) {
+		boost::asio::ip::tcp::resolver resolver(_io_context);
+		_endpoints = resolver.resolve(options.host, std::to_string(options.port));
+	}
+
+	/* Registers the users at indices first, first + step, ... */
+	void Register(size_t first, size_t step) {
+		std::array<char, 16> no_id;
+		no_id.fill(0);
+		for (size_t i = first; i < _users.size(); i += step) {
+			std::array<char, 255> name;
+			std::array<char, 160> public_key;
+			name.fill(0);
+			std::string user_name = "load-" + std::to_string(i) + "-" + std::to_string(_random() % 1000000);
+			std::copy_n(user_name.begin(), user_name.size(), name.begin());
+			std::string key = _RandomBytes(public_key.size());
+			std::copy_n(key.begin(), key.size(), public_key.begin());
+			SignupRequest request = SignupRequest(name, public_key);
+			ResponsePayload* response = _Send(no_id, SIGNUP_REQUEST, &request, std::chrono::steady_clock::now());
+			SignupSuccessResponse* signup = dynamic_cast<SignupSuccessResponse*>(response);
+			if (!signup) {
+				delete response;
+				throw LoadException();
+			}
+			_users[i] = signup->GetClientID();
+			delete response;
+		}
+	}
+
+	void Run(std::chrono::steady_clock::time_point end) {
+		std::discrete_distribution<int> mix(_options.mix.begin(), _options.mix.end());
+		std::chrono::duration<double> interval(_options.rate ? _options.threads / _options.rate : 0);
+		auto next = std::chrono::steady_clock::now();
+		while (next < end) {
+			if (_options.rate) {
+				std::this_thread::sleep_until(next);
+			}
+			else {
+				next = std::chrono::steady_clock::now();
+			}
+			_RunOperation((Operation)mix(_random), next);
+			next += std::chrono::duration_cast<std::chrono::steady_clock::duration>(interval);
+		}
+	}
+
+	const std::map<int, RequestStats>& GetStats() {
+		return _stats;
+	}
+};
+
+
+void Usage() {
+	std::cerr << "Usage: loadgen --port <port> [--host <host>] [--users <count>] [--threads <count>]" << std::endl
+		<< "\t[--duration <seconds>] [--rate <requests per second, 0 for unlimited>] [--message-size <bytes>]" << std::endl
+		<< "\t[--mix list=10,key=10,exchange=5,send=40,poll=35]" << std::endl;
+	exit(-1);
+}
+
+
+std::array<int, OPERATION_COUNT> ParseMix(std::string text) {
+	std::array<int, OPERATION_COUNT> mix;
+	mix.fill(0);
+	std::stringstream stream(text);
+	std::string item;
+	while (std::getline(stream, item, ',')) {
+		size_t separator = item.find('=');
+		if (separator == std::string::npos) {
+			Usage();
+		}
+		std::string name = item.substr(0, separator);
+		int operation = 0;
+		while (operation < OPERATION_COUNT && name != OPERATION_NAMES[operation]) {
+			operation++;
+		}
+		if (operation == OPERATION_COUNT) {
+			Usage();
+		}
+		mix[operation] = std::stoi(item.substr(separator + 1));
+	}
+	return mix;
+}
+
+
+Options ParseOptions(int argc, char* argv[]) {
+	Options options;
+	for (int i = 1; i + 1 < argc; i += 2) {
+		std::string name = argv[i];
+		std::string value = argv[i + 1];
+		if (name == "--host") { options.host = value; }
+		else if (name == "--port") { options.port = std::stoi(value); }
+		else if (name == "--users") { options.users = std::stoi(value); }
+		else if (name == "--threads") { options.threads = std::stoi(value); }
+		else if (name == "--duration") { options.duration = std::stod(value); }
+		else if (name == "--rate") { options.rate = std::stod(value); }
+		else if (name == "--message-size") { options.message_size = std::stoi(value); }
+		else if (name == "--mix") { options.mix = ParseMix(value); }
+		else { Usage(); }
+	}
+	if (argc % 2 == 0 || !options.port || options.users < 2 || options.threads < 1) {
+		Usage();
+	}
+	return options;
+}
+
+
+void PrintReport(const std::map<int, RequestStats>& stats, double seconds) {
+	std::cout << std::left << std::setw(28) << "request" << std::right
+		<< std::setw(10) << "count" << std::setw(8) << "errors" << std::setw(10) << "overload" << std::setw(10) << "req/s"
+		<< std::setw(9) << "mean" << std::setw(9) << "p50" << std::setw(9) << "p90" << std::setw(9) << "p99"
+		<< std::setw(9) << "p99.9" << std::setw(9) << "max" << "  (ms)" << std::endl;
+	std::cout << std::fixed << std::setprecision(2);
+	for (auto const& entry : stats) {
+		const Histogram& latency = entry.second.latency;
+		std::cout << std::left << std::setw(28) << RequestName(entry.first) << std::right
+			<< std::setw(10) << latency.GetTotalCount() << std::setw(8) << entry.second.errors << std::setw(10) << entry.second.overloaded
+			<< std::setw(10) << latency.GetTotalCount() / seconds
+			<< std::setw(9) << latency.GetMean() / 1000
+			<< std::setw(9) << latency.GetValueAtPercentile(50) / 1000.0
+			<< std::setw(9) << latency.GetValueAtPercentile(90) / 1000.0
+			<< std::setw(9) << latency.GetValueAtPercentile(99) / 1000.0
+			<< std::setw(9) << latency.GetValueAtPercentile(99.9) / 1000.0
+			<< std::setw(9) << latency.GetMax() / 1000.0 << std::endl;
+	}
+}
+
+
+std::map<int, RequestStats> MergeStats(std::vector<LoadWorker*>& workers) {
+	std::map<int, RequestStats> merged;
+	for (auto worker : workers) {
+		for (auto const& entry : worker->GetStats()) {
+			RequestStats& stats = merged[entry.first];
+			stats.latency.Merge(entry.second.latency);
+			stats.errors += entry.second.errors;
+			stats.overloaded += entry.second.overloaded;
+		}
+	}
+	return merged;
+}
+
+
+int main(int argc, char* argv[]) {
+	Options options = ParseOptions(argc, argv);
+	std::vector<std::array<char, 16>> users(options.users);
+	std::vector<LoadWorker*> workers;
+	std::random_device seed;
+	for (int i = 0; i < options.threads; i++) {
+		workers.push_back(new LoadWorker(options, users, ((uint64_t)seed() << 32) | seed()));
+	}
+
+	std::cout << "Registering " << options.users << " users" << std::endl;
+	auto start = std::chrono::steady_clock::now();
+	std::vector<std::thread> threads;
+	std::atomic<bool> failed(false);
+	for (int i = 0; i < options.threads; i++) {
+		threads.emplace_back([&workers, &failed, &options, i]() {
+			try {
+				workers[i]->Register(i, options.threads);
+			}
+			catch (const LoadException&) {
+				failed = true;
+			}
+		});
+	}
+	for (auto& thread : threads) {
+		thread.join();
+	}
+	if (failed) {
+		std::cerr << "Could not register the users!" << std::endl;
+		return -1;
+	}
+	PrintReport(MergeStats(workers), std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+
+	std::cout << std::endl << "Running for " << options.duration << " seconds with " << options.threads << " threads" << std::endl;
+	threads.clear();
+	start = std::chrono::steady_clock::now();
+	auto end = start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(options.duration));
+	for (int i = 0; i < options.threads; i++) {
+		threads.emplace_back([&workers, end, i]() { workers[i]->Run(end); });
+	}
+	for (auto& thread : threads) {
+		thread.join();
+	}
+	std::map<int, RequestStats> stats = MergeStats(workers);
+	stats.erase(SIGNUP_REQUEST);
+	PrintReport(stats, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+	for (auto worker : workers) {
+		delete worker;
+	}
+	return 0;
+}
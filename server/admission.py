@@ -0,0 +1,133 @@
+import time
+import threading
+import collections
+from dataclasses import dataclass
+from typing import Hashable, Optional
+from metrics import metrics
+
+
+DEFAULT_MAX_CONNECTIONS = 1024
+# An idle connection of the event loop costs a socket and a few buffers, not a thread
+DEFAULT_EVENT_LOOP_MAX_CONNECTIONS = 16384
+DEFAULT_MAX_IN_FLIGHT_BYTES = 512 * 1024 * 1024
+# Clients turned away for too many connections or in-flight bytes are told to retry after this many seconds
+BUSY_RETRY_SECONDS = 0.1
+# Least recently used buckets are dropped above this many keys - a dropped bucket starts over full
+MAX_TRACKED_BUCKETS = 100_000
+
+
+@dataclass
+class AdmissionLimits:
+    """
+    Limits enforced before a request is dispatched. Rates are requests per second with bursts of up to twice the
+    rate, a rate of 0 is unlimited.
+    """
+
+    max_connections: int = DEFAULT_MAX_CONNECTIONS
+    client_rate: float = 0
+    ip_rate: float = 0
+    max_in_flight_bytes: int = DEFAULT_MAX_IN_FLIGHT_BYTES
+
+
+class _TokenBucket:
+    def __init__(self, rate: float, now: float) -> None:
+        self._rate = rate
+        self._capacity = 2 * rate
+        self._tokens = self._capacity
+        self._updated = now
+
+    def take(self, now: float) -> float:
+        """
+        :return: 0 if a token was taken, otherwise the seconds until one is available
+        """
+        self._tokens = min(
+            self._capacity, self._tokens + (now - self._updated) * self._rate
+        )
+        self._updated = now
+        if self._tokens >= 1:
+            self._tokens -= 1
+            return 0
+        return (1 - self._tokens) / self._rate
+
+
+class _RateLimiter:
+    def __init__(self, rate: float) -> None:
+        self._rate = rate
+        self._buckets: "collections.OrderedDict[Hashable, _TokenBucket]" = (
+            collections.OrderedDict()
+        )
+
+    def take(self, key: Hashable, now: float) -> float:
+        if not self._rate:
+            return 0
+        bucket = self._buckets.get(key)
+        if bucket is None:
+            bucket = self._buckets[key] = _TokenBucket(self._rate, now)
+            if len(self._buckets) > MAX_TRACKED_BUCKETS:
+                self._buckets.popitem(last=False)
+        else:
+            self._buckets.move_to_end(key)
+        return bucket.take(now)
+
+
+class AdmissionController:
+    """
+    Counts open connections and the payload bytes of requests being handled, and rate limits requests by client id
+    and by address. Rejected requests get an OverloadedResponse telling the client when to retry.
+    """
+
+    def __init__(self, limits: AdmissionLimits) -> None:
+        self._limits = limits
+        self._lock = threading.Lock()
+        self._connections = 0
+        self._in_flight_bytes = 0
+        self._client_limiter = _RateLimiter(limits.client_rate)
+        self._ip_limiter = _RateLimiter(limits.ip_rate)
+        metrics.register_gauges(
+            {
+                "connections_open": lambda: self._connections,
+                "in_flight_bytes": lambda: self._in_flight_bytes,
+            }
+        )
+
+    def open_connection(self) -> bool:
+        with self._lock:
+            if self._connections >= self._limits.max_connections:
+                metrics.increment("admission_rejected_connections")
+                return False
+            self._connections += 1
+            return True
+
+    def close_connection(self) -> None:
+        with self._lock:
+            self._connections -= 1
+
+    def admit_request(
+        self, address: str, client_id: bytes, payload_size: int
+    ) -> Optional[float]:
+        """
+        Must be followed by release_request(payload_size) once the request was handled, if it was admitted.
+        :return: None if the request is admitted, otherwise the seconds the client should wait before retrying
+        """
+        now = time.monotonic()
+        with self._lock:
+            if (
+                self._in_flight_bytes
+                and self._in_flight_bytes + payload_size
+                > self._limits.max_in_flight_bytes
+            ):
+                metrics.increment("admission_rejected_requests")
+                return BUSY_RETRY_SECONDS
+            retry_after = max(
+                self._ip_limiter.take(address, now),
+                self._client_limiter.take(client_id, now),
+            )
+            if retry_after:
+                metrics.increment("admission_rate_limited_requests")
+                return retry_after
+            self._in_flight_bytes += payload_size
+            return None
+
+    def release_request(self, payload_size: int) -> None:
+        with self._lock:
+            self._in_flight_bytes -= payload_size
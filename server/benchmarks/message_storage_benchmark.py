@@ -0,0 +1,78 @@
+#!/bin/python
+"""
+Compares message throughput of DBStorage and SegmentStorage: sender threads queue messages for a set of recipients,
+then every recipient fetches its queue. Both run on files in a temporary directory.
+
+usage: python ./benchmarks/message_storage_benchmark.py [message_size]
+"""
+import sys
+import pathlib
+import tempfile
+import threading
+import time
+from typing import List
+
+sys.path.insert(0, str(pathlib.Path(__file__).parent.parent))
+
+from storage.database_storage import DBStorage
+from storage.segment_storage import SegmentStorage
+
+
+DEFAULT_MESSAGE_SIZE = 1024
+SENDER_THREADS = 16
+RECIPIENT_COUNT = 100
+MESSAGES_PER_SENDER = 2_000
+
+
+def send_messages(
+    storage: DBStorage, sender: bytes, recipients: List[bytes], content: bytes
+) -> None:
+    for index in range(MESSAGES_PER_SENDER):
+        storage.send_message(sender, recipients[index % len(recipients)], 3, content)
+
+
+def measure(storage: DBStorage, message_size: int) -> None:
+    sender = storage.create_new_user("sender", "")
+    recipients = [
+        storage.create_new_user(f"recipient{index}", "")
+        for index in range(RECIPIENT_COUNT)
+    ]
+    content = b"\x00" * message_size
+    threads = [
+        threading.Thread(target=send_messages, args=(storage, sender, recipients, content))
+        for _ in range(SENDER_THREADS)
+    ]
+    start = time.perf_counter()
+    for thread in threads:
+        thread.start()
+    for thread in threads:
+        thread.join()
+    send_time = time.perf_counter() - start
+    start = time.perf_counter()
+    fetched = sum(
+        len(storage.get_message_list_for_user(recipient)) for recipient in recipients
+    )
+    fetch_time = time.perf_counter() - start
+    sent = SENDER_THREADS * MESSAGES_PER_SENDER
+    print(
+        f"{type(storage).__name__}: send {sent / send_time:.1f} messages/s, "
+        f"fetch {fetched / fetch_time:.1f} messages/s"
+    )
+
+
+def main() -> None:
+    message_size = int(sys.argv[1]) if len(sys.argv) > 1 else DEFAULT_MESSAGE_SIZE
+    with tempfile.TemporaryDirectory() as directory:
+        path = pathlib.Path(directory)
+        storage = DBStorage(str(path.joinpath("database.db")))
+        measure(storage, message_size)
+        storage.close_connection()
+        storage = SegmentStorage(
+            str(path.joinpath("segment.db")), str(path.joinpath("messages"))
+        )
+        measure(storage, message_size)
+        storage.close_connection()
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,77 @@
+#!/bin/python
+"""
+Measures DBStorage read throughput (get_user_by_id) with a growing number of reader threads, while one thread keeps
+sending messages, on a WAL database file in a temporary directory.
+
+usage: python ./benchmarks/storage_concurrency_benchmark.py [thread_count ...]
+"""
+import sys
+import random
+import pathlib
+import tempfile
+import threading
+import time
+from typing import List
+
+sys.path.insert(0, str(pathlib.Path(__file__).parent.parent))
+
+from storage.database_storage import DBStorage
+
+
+DEFAULT_THREAD_COUNTS = [1, 2, 4, 8]
+USER_COUNT = 1_000
+MEASURE_SECONDS = 3.0
+
+
+def read_users(
+    storage: DBStorage, user_ids: List[str], stop: threading.Event, reads: List[int]
+) -> None:
+    count = 0
+    while not stop.is_set():
+        storage.get_user_by_id(random.choice(user_ids))
+        count += 1
+    reads.append(count)
+
+
+def send_messages(storage: DBStorage, user_ids: List[str], stop: threading.Event) -> None:
+    while not stop.is_set():
+        storage.send_message(user_ids[0], user_ids[1], 3, b"\x00" * 64)
+
+
+def measure(storage: DBStorage, user_ids: List[str], thread_count: int) -> float:
+    stop = threading.Event()
+    reads: List[int] = []
+    threads = [
+        threading.Thread(target=read_users, args=(storage, user_ids, stop, reads))
+        for _ in range(thread_count)
+    ]
+    threads.append(threading.Thread(target=send_messages, args=(storage, user_ids, stop)))
+    for thread in threads:
+        thread.start()
+    time.sleep(MEASURE_SECONDS)
+    stop.set()
+    for thread in threads:
+        thread.join()
+    return sum(reads) / MEASURE_SECONDS
+
+
+def main() -> None:
+    thread_counts = [int(arg) for arg in sys.argv[1:]] or DEFAULT_THREAD_COUNTS
+    with tempfile.TemporaryDirectory() as directory:
+        storage = DBStorage(
+            str(pathlib.Path(directory).joinpath("benchmark.db")),
+            connection_pool_size=max(thread_counts) + 1,
+        )
+        user_ids = [
+            storage.create_new_user(f"user{index}", "") for index in range(USER_COUNT)
+        ]
+        for thread_count in thread_counts:
+            print(
+                f"{thread_count} reader threads: "
+                f"{measure(storage, user_ids, thread_count):.1f} reads/s"
+            )
+        storage.close_connection()
+
+
+if __name__ == "__main__":
+    main()
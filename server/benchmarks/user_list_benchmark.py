@@ -0,0 +1,58 @@
+#!/bin/python
+"""
+Measures USER_LIST requests per second served by DispatchManager from an in-memory database.
+
+usage: python ./benchmarks/user_list_benchmark.py [user_count ...]
+"""
+import sys
+import time
+import pathlib
+
+sys.path.insert(0, str(pathlib.Path(__file__).parent.parent))
+
+import server_protocol
+from server_logic import DispatchManager
+from storage.database_storage import DBStorage
+
+
+DEFAULT_USER_COUNTS = [10_000, 100_000]
+MEASURE_SECONDS = 3.0
+
+
+def _header(client_id: bytes, code: server_protocol.RequestCode, size: int):
+    return server_protocol.RequestHeader(client_id, 1, code.value, size)
+
+
+def populate(manager: DispatchManager, user_count: int) -> bytes:
+    signup_header = _header(
+        b"\x00" * 16, server_protocol.RequestCode.SIGNUP, server_protocol.SignupRequest.size
+    )
+    client_id = b""
+    for index in range(user_count):
+        payload = f"user{index}".encode().ljust(255, b"\x00") + b"\x00" * 160
+        client_id = manager.dispatch_payload(signup_header, payload).payload
+    return client_id
+
+
+def measure(manager: DispatchManager, client_id: bytes) -> float:
+    header = _header(client_id, server_protocol.RequestCode.USER_LIST, 0)
+    requests = 0
+    start = time.perf_counter()
+    while (elapsed := time.perf_counter() - start) < MEASURE_SECONDS:
+        manager.dispatch_payload(header, b"").pack()
+        requests += 1
+    return requests / elapsed
+
+
+def main() -> None:
+    user_counts = [int(arg) for arg in sys.argv[1:]] or DEFAULT_USER_COUNTS
+    for user_count in user_counts:
+        storage = DBStorage(":memory:")
+        manager = DispatchManager(storage)
+        client_id = populate(manager, user_count)
+        print(f"{user_count} users: {measure(manager, client_id):.1f} requests/s")
+        storage.close_connection()
+
+
+if __name__ == "__main__":
+    main()
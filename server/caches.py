@@ -0,0 +1,103 @@
+import threading
+import collections
+from typing import Dict
+import server_protocol
+from storage.storage_layer import StorageLayer, User
+
+
+DEFAULT_USER_CACHE_SIZE = 100_000
+
+
+class UserDirectoryCache:
+    """
+    Keeps the packed ClientRecords of every known user in one contiguous buffer, so a user list response is a
+    copy of the buffer without the requester's own record instead of a query and a struct.pack per user.
+    """
+
+    record_size: int = server_protocol.ClientRecord.format.size
+
+    def __init__(self) -> None:
+        self._lock = threading.Lock()
+        self._image = bytearray()
+        self._offsets: Dict[bytes, int] = {}
+        self._last_row = 0
+
+    def load(self, storage: StorageLayer) -> None:
+        with self._lock:
+            self._image.clear()
+            self._offsets.clear()
+            self._last_row = 0
+        self.refresh(storage)
+
+    def refresh(self, storage: StorageLayer) -> None:
+        """
+        Adds the users registered since the last load or refresh, including ones registered by other processes.
+        """
+        with self._lock:
+            last_row = self._last_row
+        records = storage.get_user_records(last_row)
+        with self._lock:
+            for row, user_id, name in records:
+                self._append(user_id, name.encode())
+                self._last_row = max(self._last_row, row)
+
+    def _append(self, client_id: bytes, name: bytes) -> None:
+        if client_id in self._offsets:
+            return
+        self._offsets[client_id] = len(self._image)
+        self._image += server_protocol.ClientRecord(client_id, name).pack()
+
+    def add_user(self, client_id: bytes, name: bytes) -> None:
+        with self._lock:
+            self._append(client_id, name)
+
+    def get_packed_list(self, client_id_to_ignore: bytes) -> bytes:
+        with self._lock:
+            offset = self._offsets.get(client_id_to_ignore)
+            if offset is None:
+                return bytes(self._image)
+            with memoryview(self._image) as image:
+                return b"".join(
+                    (image[:offset], image[offset + self.record_size :])
+                )
+
+    def __len__(self) -> int:
+        with self._lock:
+            return len(self._offsets)
+
+
+class UserCache:
+    """
+    A bounded, least-recently-used cache of users (with their decoded public keys) keyed by their user_id.
+    Users are added on signup and on the first lookup that misses, so checking that a user exists is a dictionary
+    lookup for every active user.
+    """
+
+    def __init__(self, max_size: int = DEFAULT_USER_CACHE_SIZE) -> None:
+        self._lock = threading.Lock()
+        self._max_size = max_size
+        self._users: "collections.OrderedDict[bytes, User]" = collections.OrderedDict()
+
+    def add(self, user: User) -> None:
+        with self._lock:
+            self._users[user.id] = user
+            self._users.move_to_end(user.id)
+            while len(self._users) > self._max_size:
+                self._users.popitem(last=False)
+
+    def __contains__(self, user_id: bytes) -> bool:
+        with self._lock:
+            if user_id not in self._users:
+                return False
+            self._users.move_to_end(user_id)
+            return True
+
+    def get_user(self, storage: StorageLayer, user_id: bytes) -> User:
+        with self._lock:
+            user = self._users.get(user_id)
+            if user is not None:
+                self._users.move_to_end(user_id)
+                return user
+        user = User.get_user_by_id(storage, user_id)
+        self.add(user)
+        return user
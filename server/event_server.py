@@ -0,0 +1,419 @@
+import os
+import queue
+import socket
+import threading
+import logging
+import selectors
+import dataclasses
+import concurrent.futures
+import server_protocol
+from typing import Callable, Dict, Iterator, List, Optional
+from metrics import metrics
+from tracing import tracer
+from admission import (
+    AdmissionController,
+    AdmissionLimits,
+    BUSY_RETRY_SECONDS,
+    DEFAULT_EVENT_LOOP_MAX_CONNECTIONS,
+)
+from server_logic import ServerLogic
+from server import (
+    Lingerer,
+    MAX_DISCARDED_PAYLOAD_SIZE,
+    MAX_LINGERING_CONNECTIONS,
+    SEND_BUFFER_SIZE,
+    MAX_SEND_BUFFERS,
+    send_some,
+    check_payload_size,
+    is_blob_message,
+    handle_blob_message,
+)
+
+try:
+    import resource
+except ImportError:
+    # Windows, where the limit on open sockets is not a process resource limit
+    resource = None  # type: ignore
+
+
+logger = logging.getLogger(__name__)
+DEFAULT_WORKER_COUNT = 8
+LISTEN_BACKLOG = 1024
+RECEIVE_SIZE = 64 * 1024
+# File descriptors kept for the server itself: the listening socket, the wakeup pipe, database and blob files, and
+# rejected connections lingering
+FILE_DESCRIPTOR_RESERVE = 256 + MAX_LINGERING_CONNECTIONS
+
+
+def fit_open_files_limit(max_connections: int) -> int:
+    """
+    Raises the soft limit on open files (up to the hard limit) so the loop can hold max_connections sockets.
+    :return: the most connections the limit allows, which is less than max_connections if it could not be raised
+    """
+    if resource is None:
+        return max_connections
+    soft, hard = resource.getrlimit(resource.RLIMIT_NOFILE)
+    wanted = max_connections + FILE_DESCRIPTOR_RESERVE
+    if soft != resource.RLIM_INFINITY and soft < wanted:
+        raised = wanted if hard == resource.RLIM_INFINITY else min(wanted, hard)
+        try:
+            resource.setrlimit(resource.RLIMIT_NOFILE, (raised, hard))
+            soft = raised
+        except (ValueError, OSError):
+            pass
+    if soft == resource.RLIM_INFINITY or soft >= wanted:
+        return max_connections
+    allowed = max(soft - FILE_DESCRIPTOR_RESERVE, 1)
+    logger.warning(
+        f"The open files limit ({soft}) only allows {allowed} of {max_connections} connections"
+    )
+    return allowed
+
+
+class _Connection:
+    """
+    The state of one client connection: the request header and payload while reading, and the response chunks that
+    are left to send while writing.
+    """
+
+    def __init__(self, sock: socket.socket, address) -> None:
+        self.sock = sock
+        self.address = address
+        self.header_data = bytearray()
+        self.header: Optional[server_protocol.RequestHeader] = None
+        self.payload = bytearray()
+        self.payload_read = 0
+        self.response: Optional[Iterator[bytes]] = None
+        self.pending: List[memoryview] = []
+        # Payload bytes counted by the admission controller, None while the request is not admitted
+        self.admitted_bytes: Optional[int] = None
+        self.retry_after: Optional[float] = None
+
+
+class EventServer:
+    """
+    A single threaded selector loop that multiplexes every client connection, handing complete requests to a bounded
+    pool of workers that run ServerLogic. Idle connections cost a socket and a _Connection, not a thread.
+    Large messages that go to the blob store are still received by a worker with a blocking socket.
+    """
+
+    def __init__(
+        self,
+        server_address,
+        worker_count: int = DEFAULT_WORKER_COUNT,
+        segment_storage: bool = False,
+        worker_index: Optional[int] = None,
+        admission_limits: Optional[AdmissionLimits] = None,
+        message_ttls: Optional[Dict[int, float]] = None,
+    ) -> None:
+        """
+        :param worker_index: index of this worker process, when several processes listen on the same port
+        :param message_ttls: seconds an undelivered message of each type is kept, see ServerLogic
+        :param admission_limits: limits of this process, by default AdmissionLimits() with
+            DEFAULT_EVENT_LOOP_MAX_CONNECTIONS connections. The connection limit is lowered to what the open files
+            limit allows
+        """
+        admission_limits = admission_limits or AdmissionLimits(
+            max_connections=DEFAULT_EVENT_LOOP_MAX_CONNECTIONS
+        )
+        admission_limits = dataclasses.replace(
+            admission_limits,
+            max_connections=fit_open_files_limit(admission_limits.max_connections),
+        )
+        self.admission = AdmissionController(admission_limits)
+        self._lingerer = Lingerer()
+        self.server_logic = ServerLogic(
+            segment_storage=segment_storage,
+            worker_index=worker_index,
+            message_ttls=message_ttls,
+        )
+        self._workers = concurrent.futures.ThreadPoolExecutor(max_workers=worker_count)
+        self._selector = selectors.DefaultSelector()
+        self.socket = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+        self.socket.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+        if worker_index is not None:
+            self.socket.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEPORT, 1)
+        self.socket.bind(server_address)
+        self.socket.listen(LISTEN_BACKLOG)
+        self.socket.setblocking(False)
+        self.server_address = self.socket.getsockname()
+        self._selector.register(self.socket, selectors.EVENT_READ)
+        # Workers hand finished connections back through this queue and wake the loop by writing to the pipe
+        self._ready: "queue.Queue[_Connection]" = queue.Queue()
+        self._wakeup_read, self._wakeup_write = os.pipe()
+        os.set_blocking(self._wakeup_read, False)
+        os.set_blocking(self._wakeup_write, False)
+        self._selector.register(self._wakeup_read, selectors.EVENT_READ)
+        self._running = False
+        # Requests submitted to the workers that did not start yet
+        self._queued_requests = 0
+        self._queued_requests_lock = threading.Lock()
+        metrics.register_gauges(
+            {
+                "event_loop_queued_requests": lambda: self._queued_requests,
+                "event_loop_ready_responses": self._ready.qsize,
+            }
+        )
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, exc_type, exc_val, exc_tb):
+        self.server_close()
+
+    def serve_forever(self) -> None:
+        self._running = True
+        while self._running:
+            for key, events in self._selector.select():
+                if key.fileobj is self.socket:
+                    self._accept()
+                elif key.fileobj == self._wakeup_read:
+                    self._drain_ready()
+                elif events & selectors.EVENT_READ:
+                    self._read(key.data)
+                else:
+                    self._write(key.data)
+
+    def shutdown(self) -> None:
+        self._running = False
+        self._wake_up()
+
+    def _wake_up(self) -> None:
+        try:
+            os.write(self._wakeup_write, b"\x00")
+        except BlockingIOError:
+            # The pipe is full, so the loop is woken up anyway
+            pass
+
+    def server_close(self) -> None:
+        # Workers hand connections back through _ready and the wakeup pipe, so they are stopped before either is torn
+        # down
+        self._workers.shutdown(wait=True)
+        while not self._ready.empty():
+            connection = self._ready.get_nowait()
+            connection.sock.close()
+            self._dispose_response(connection)
+        for key in list(self._selector.get_map().values()):
+            if isinstance(key.data, _Connection):
+                key.data.sock.close()
+                self._dispose_response(key.data)
+        self._selector.close()
+        self.socket.close()
+        os.close(self._wakeup_read)
+        os.close(self._wakeup_write)
+        self._lingerer.close()
+        self.server_logic.close_connection()
+
+    def _accept(self) -> None:
+        while True:
+            try:
+                sock, address = self.socket.accept()
+            except BlockingIOError:
+                return
+            sock.setblocking(False)
+            metrics.increment("connections_accepted")
+            if not self.admission.open_connection():
+                self._send_overloaded(sock, BUSY_RETRY_SECONDS)
+                self._lingerer.linger(sock)
+                continue
+            self._selector.register(sock, selectors.EVENT_READ, _Connection(sock, address))
+
+    @staticmethod
+    def _send_overloaded(sock: socket.socket, retry_after: float) -> None:
+        # The overload response is small enough for the socket buffer of a new connection
+        try:
+            sock.send(server_protocol.OverloadedResponse(retry_after).pack())
+        except OSError:
+            pass
+
+    def _release(self, connection: _Connection) -> None:
+        if connection.admitted_bytes is not None:
+            self.admission.release_request(connection.admitted_bytes)
+        self.admission.close_connection()
+
+    def _close(self, connection: _Connection) -> None:
+        try:
+            self._selector.unregister(connection.sock)
+        except KeyError:
+            pass
+        connection.sock.close()
+        self._dispose_response(connection)
+        self._release(connection)
+
+    @staticmethod
+    def _dispose_response(connection: _Connection) -> None:
+        """Releases what the response holds (e.g. pinned blobs) when it was not sent to the end."""
+        if connection.response is not None:
+            response, connection.response = connection.response, None
+            try:
+                server_protocol.close_chunks(response)
+            except Exception:
+                logger.exception(f"Could not dispose of the response to {connection.address}")
+
+    def _read(self, connection: _Connection) -> None:
+        try:
+            if connection.header is None:
+                if not self._read_header(connection):
+                    return
+                if not self._start_request(connection):
+                    return
+            with memoryview(connection.payload) as payload:
+                while connection.payload_read < len(payload):
+                    received = connection.sock.recv_into(
+                        payload[connection.payload_read :],
+                        min(RECEIVE_SIZE, len(payload) - connection.payload_read),
+                    )
+                    if not received:
+                        self._close(connection)
+                        return
+                    connection.payload_read += received
+                    metrics.increment("bytes_received", received)
+        except BlockingIOError:
+            return
+        except (OSError, server_protocol.ProtocolError):
+            logger.exception(f"Caught an exception while reading from {connection.address}")
+            self._close(connection)
+            return
+        if connection.retry_after is not None:
+            connection.response = server_protocol.OverloadedResponse(
+                connection.retry_after
+            ).chunks()
+            self._selector.modify(connection.sock, selectors.EVENT_WRITE, connection)
+            return
+        self._selector.unregister(connection.sock)
+        self._submit(self._dispatch, connection)
+
+    def _read_header(self, connection: _Connection) -> bool:
+        """
+        Reads the request header and the trace id extension that follows it in traced requests.
+        :return: whether the whole header was read
+        """
+        while len(connection.header_data) < server_protocol.RequestHeader.full_size(
+            connection.header_data
+        ):
+            data = connection.sock.recv(
+                server_protocol.RequestHeader.full_size(connection.header_data)
+                - len(connection.header_data)
+            )
+            if not data:
+                self._close(connection)
+                return False
+            metrics.increment("bytes_received", len(data))
+            connection.header_data += data
+        connection.header = server_protocol.RequestHeader.unpack(
+            bytes(connection.header_data)
+        )
+        if connection.header.extension_size:
+            connection.header.unpack_extension(
+                connection.header_data[server_protocol.RequestHeader.size :]
+            )
+        return True
+
+    def _start_request(self, connection: _Connection) -> bool:
+        """
+        Admits or rejects the request whose header was read.
+        :return: whether the loop should read the payload
+        """
+        header = connection.header
+        if header.payload_size < 0:
+            raise server_protocol.ProtocolError()
+        connection.retry_after = self.admission.admit_request(
+            connection.address[0], header.client_id, header.payload_size
+        )
+        if connection.retry_after is not None:
+            if header.payload_size > MAX_DISCARDED_PAYLOAD_SIZE:
+                self._send_overloaded(connection.sock, connection.retry_after)
+                self._close(connection)
+                return False
+            # The payload is read and dropped before responding
+        else:
+            connection.admitted_bytes = header.payload_size
+            check_payload_size(header)
+            if is_blob_message(header, self.server_logic.blob_store):
+                self._selector.unregister(connection.sock)
+                self._submit(self._handle_blob_message, connection)
+                return False
+        connection.payload = bytearray(header.payload_size)
+        return True
+
+    def _submit(self, handler: Callable[[_Connection], None], connection: _Connection) -> None:
+        with self._queued_requests_lock:
+            self._queued_requests += 1
+
+        def run() -> None:
+            with self._queued_requests_lock:
+                self._queued_requests -= 1
+            handler(connection)
+
+        self._workers.submit(run)
+
+    def _dispatch(self, connection: _Connection) -> None:
+        # Runs on a worker, the response chunks are pulled by the loop as the socket drains
+        try:
+            with tracer.request(connection.header.trace_id), metrics.timer(
+                "handle_request"
+            ):
+                connection.response = self.server_logic.dispatch_payload_chunks(
+                    connection.header, memoryview(connection.payload)
+                )
+        except Exception:
+            # The connection is not registered with the loop, it must be handed back with a response or it is never
+            # closed
+            logger.exception(f"Caught an exception while handling {connection.address}")
+            self._dispose_response(connection)
+            connection.response = server_protocol.ErrorResponse().chunks()
+        connection.payload = bytearray()
+        self._ready.put(connection)
+        self._wake_up()
+
+    def _handle_blob_message(self, connection: _Connection) -> None:
+        try:
+            connection.sock.setblocking(True)
+            with tracer.request(connection.header.trace_id), metrics.timer(
+                "handle_request"
+            ):
+                handle_blob_message(
+                    connection.sock,
+                    self.server_logic,
+                    connection.header,
+                    self.server_logic.blob_store,
+                )
+        except Exception:
+            logger.exception(f"Caught an exception while handling {connection.address}")
+        finally:
+            connection.sock.close()
+            self._release(connection)
+
+    def _drain_ready(self) -> None:
+        try:
+            os.read(self._wakeup_read, RECEIVE_SIZE)
+        except BlockingIOError:
+            pass
+        while True:
+            try:
+                connection = self._ready.get_nowait()
+            except queue.Empty:
+                return
+            self._selector.register(connection.sock, selectors.EVENT_WRITE, connection)
+
+    def _write(self, connection: _Connection) -> None:
+        try:
+            while (
+                connection.response is not None
+                and sum(len(buffer) for buffer in connection.pending) < SEND_BUFFER_SIZE
+                and len(connection.pending) < MAX_SEND_BUFFERS
+            ):
+                try:
+                    connection.pending.append(memoryview(next(connection.response)))
+                except StopIteration:
+                    connection.response = None
+            if connection.pending:
+                send_some(connection.sock, connection.pending)
+        except BlockingIOError:
+            return
+        except Exception:
+            logger.exception(f"Caught an exception while responding to {connection.address}")
+            self._close(connection)
+            return
+        if connection.response is None and not connection.pending:
+            self._close(connection)
@@ -1,6 +1,21 @@
 #!/bin/python
+import argparse
 import pathlib
+import multiprocessing
+from typing import Dict, Optional, Tuple
+from admission import (
+    AdmissionLimits,
+    DEFAULT_MAX_CONNECTIONS,
+    DEFAULT_EVENT_LOOP_MAX_CONNECTIONS,
+    DEFAULT_MAX_IN_FLIGHT_BYTES,
+)
 from server import Server
+from server_protocol import MessageType
+from storage.database_storage import DEFAULT_MESSAGE_TTLS
+from metrics import serve_metrics, dump_metrics_periodically, DEFAULT_DUMP_INTERVAL
+from tracing import tracer
+from server_logic import prepare_shared_storage
+from event_server import EventServer, DEFAULT_WORKER_COUNT
 
 
 def get_port() -> int:
@@ -15,13 +30,221 @@ def get_port() -> int:
         exit(-1)
 
 
-def main() -> None:
-    port = get_port()
-    with Server(("0.0.0.0", port)) as serv:
+def parse_message_ttl(value: str) -> Tuple[int, float]:
+    """
+    Parses TYPE=SECONDS, where TYPE is a message type name (e.g. text_message) or number.
+    """
+    name, separator, seconds = value.partition("=")
+    try:
+        if not separator:
+            raise ValueError()
+        if name.isdigit():
+            message_type = MessageType(int(name))
+        else:
+            message_type = MessageType[name.upper().replace("-", "_")]
+        ttl = float(seconds)
+        if ttl < 0:
+            raise ValueError()
+    except (KeyError, ValueError):
+        raise argparse.ArgumentTypeError(
+            f"expected TYPE=SECONDS with TYPE one of "
+            f"{', '.join(item.name.lower() for item in MessageType)}, got {value!r}"
+        )
+    return message_type.value, ttl
+
+
+def format_message_ttls(message_ttls: Dict[int, float]) -> str:
+    return ", ".join(
+        f"{MessageType(message_type).name.lower()}={ttl:.0f}"
+        for message_type, ttl in message_ttls.items()
+    )
+
+
+def parse_arguments() -> argparse.Namespace:
+    parser = argparse.ArgumentParser(description="MessageU server")
+    parser.add_argument(
+        "--segment-storage",
+        action="store_true",
+        help="store messages in per-recipient segment files instead of the database",
+    )
+    parser.add_argument(
+        "--message-ttl",
+        type=parse_message_ttl,
+        action="append",
+        metavar="TYPE=SECONDS",
+        help="seconds an undelivered message of the type is kept, 0 to keep it until it is fetched; can be repeated "
+        f"(default: {format_message_ttls(DEFAULT_MESSAGE_TTLS)})",
+    )
+    parser.add_argument(
+        "--no-message-expiry",
+        action="store_true",
+        help="keep undelivered messages of every type until they are fetched",
+    )
+    parser.add_argument(
+        "--event-loop",
+        action="store_true",
+        help="serve every connection from a single selector loop instead of a thread per connection",
+    )
+    parser.add_argument(
+        "--event-loop-workers",
+        type=int,
+        default=DEFAULT_WORKER_COUNT,
+        help="number of threads handling requests for the event loop (default: %(default)s)",
+    )
+    parser.add_argument(
+        "--processes",
+        type=int,
+        default=1,
+        help="number of server processes listening on the port (default: %(default)s)",
+    )
+    parser.add_argument(
+        "--max-connections",
+        type=int,
+        default=None,
+        help=f"most connections open at once, per process (default: {DEFAULT_MAX_CONNECTIONS}, "
+        f"{DEFAULT_EVENT_LOOP_MAX_CONNECTIONS} with --event-loop)",
+    )
+    parser.add_argument(
+        "--client-rate",
+        type=float,
+        default=0,
+        help="requests per second allowed for each client id, 0 for unlimited (default: %(default)s)",
+    )
+    parser.add_argument(
+        "--ip-rate",
+        type=float,
+        default=0,
+        help="requests per second allowed for each address, 0 for unlimited (default: %(default)s)",
+    )
+    parser.add_argument(
+        "--max-in-flight-bytes",
+        type=int,
+        default=DEFAULT_MAX_IN_FLIGHT_BYTES,
+        help="most payload bytes of requests being handled at once, per process (default: %(default)s)",
+    )
+    parser.add_argument(
+        "--metrics-port",
+        type=int,
+        help="serve request, database and connection metrics over HTTP on this localhost port, the following "
+        "ports for the other processes",
+    )
+    parser.add_argument(
+        "--metrics-file",
+        help="write the metrics to this file periodically, suffixed with the process index for several processes",
+    )
+    parser.add_argument(
+        "--metrics-interval",
+        type=float,
+        default=DEFAULT_DUMP_INTERVAL,
+        help="seconds between writes of the metrics file (default: %(default)s)",
+    )
+    parser.add_argument(
+        "--trace-file",
+        help="write request and database spans to this Chrome trace file, suffixed with the process index for "
+        "several processes",
+    )
+    arguments = parser.parse_args()
+    if arguments.processes > 1 and arguments.segment_storage:
+        parser.error("--segment-storage cannot be used with more than one process")
+    if arguments.message_ttl and arguments.no_message_expiry:
+        parser.error("--message-ttl cannot be used with --no-message-expiry")
+    if arguments.message_ttl and arguments.segment_storage:
+        parser.error("messages in segment storage never expire, --message-ttl cannot be used with it")
+    return arguments
+
+
+def get_message_ttls(arguments: argparse.Namespace) -> Optional[Dict[int, float]]:
+    """
+    :return: the TTLs of message types, None for the defaults
+    """
+    if arguments.no_message_expiry:
+        return {}
+    if not arguments.message_ttl:
+        return None
+    message_ttls = dict(DEFAULT_MESSAGE_TTLS)
+    for message_type, ttl in arguments.message_ttl:
+        if ttl:
+            message_ttls[message_type] = ttl
+        else:
+            message_ttls.pop(message_type, None)
+    return message_ttls
+
+
+def serve(
+    arguments: argparse.Namespace, port: int, worker_index: Optional[int] = None
+) -> None:
+    if arguments.metrics_port is not None:
+        serve_metrics(arguments.metrics_port + (worker_index or 0))
+    if arguments.metrics_file is not None:
+        dump_metrics_periodically(
+            arguments.metrics_file
+            if worker_index is None
+            else f"{arguments.metrics_file}.{worker_index}",
+            arguments.metrics_interval,
+        )
+    if arguments.trace_file is not None:
+        tracer.enable(
+            arguments.trace_file
+            if worker_index is None
+            else f"{arguments.trace_file}.{worker_index}"
+        )
+    admission_limits = AdmissionLimits(
+        max_connections=arguments.max_connections
+        if arguments.max_connections is not None
+        else (
+            DEFAULT_EVENT_LOOP_MAX_CONNECTIONS
+            if arguments.event_loop
+            else DEFAULT_MAX_CONNECTIONS
+        ),
+        client_rate=arguments.client_rate,
+        ip_rate=arguments.ip_rate,
+        max_in_flight_bytes=arguments.max_in_flight_bytes,
+    )
+    if arguments.event_loop:
+        serv = EventServer(
+            ("0.0.0.0", port),
+            worker_count=arguments.event_loop_workers,
+            segment_storage=arguments.segment_storage,
+            worker_index=worker_index,
+            admission_limits=admission_limits,
+            message_ttls=get_message_ttls(arguments),
+        )
+    else:
+        serv = Server(
+            ("0.0.0.0", port),
+            segment_storage=arguments.segment_storage,
+            worker_index=worker_index,
+            admission_limits=admission_limits,
+            message_ttls=get_message_ttls(arguments),
+        )
+    with serv:
         try:
             serv.serve_forever()
         except:
-            print("Shutting server down!")
+            if worker_index in (None, 0):
+                print("Shutting server down!")
+
+
+def main() -> None:
+    arguments = parse_arguments()
+    port = get_port()
+    if arguments.processes == 1:
+        serve(arguments, port)
+        return
+    # Every process binds the port with SO_REUSEPORT and the kernel spreads new connections between them
+    prepare_shared_storage()
+    workers = [
+        multiprocessing.Process(target=serve, args=(arguments, port, worker_index))
+        for worker_index in range(arguments.processes)
+    ]
+    for worker in workers:
+        worker.start()
+    try:
+        for worker in workers:
+            worker.join()
+    except KeyboardInterrupt:
+        for worker in workers:
+            worker.join()
 
 
 if __name__ == "__main__":
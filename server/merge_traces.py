@@ -0,0 +1,54 @@
+#!/bin/python
+import json
+import argparse
+from typing import Any, Dict, List, Optional
+
+
+def load_trace_events(path: str) -> List[Dict[str, Any]]:
+    """
+    Loads a trace file in the JSON array format, which may be missing its closing bracket.
+    """
+    with open(path) as trace_file:
+        text = trace_file.read().strip()
+    if isinstance(loaded := _load_json_array(text), list):
+        return loaded
+    return loaded.get("traceEvents", [])
+
+
+def _load_json_array(text: str) -> Any:
+    if text.startswith("[") and not text.endswith("]"):
+        text = text.rstrip(",") + "]"
+    return json.loads(text)
+
+
+def merge_traces(paths: List[str], output: str, trace_id: Optional[str] = None) -> None:
+    """
+    Writes the events of every trace file into one file, keeping only the events of trace_id (and the metadata
+    events) if it is given.
+    """
+    events: List[Dict[str, Any]] = []
+    for path in paths:
+        events.extend(
+            event
+            for event in load_trace_events(path)
+            if trace_id is None
+            or event.get("ph") == "M"
+            or event.get("args", {}).get("trace_id") == trace_id
+        )
+    with open(output, "w") as output_file:
+        json.dump({"traceEvents": events}, output_file)
+
+
+def main() -> None:
+    parser = argparse.ArgumentParser(
+        description="Merge client and server trace files into one file for a trace viewer"
+    )
+    parser.add_argument("traces", nargs="+", help="trace files written with --trace-file")
+    parser.add_argument("--output", required=True, help="the merged trace file")
+    parser.add_argument("--trace-id", help="keep only the spans of this trace id (16 hex digits)")
+    arguments = parser.parse_args()
+    merge_traces(arguments.traces, arguments.output, arguments.trace_id)
+
+
+if __name__ == "__main__":
+    main()
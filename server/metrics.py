@@ -0,0 +1,204 @@
+import os
+import math
+import time
+import logging
+import threading
+import contextlib
+import functools
+import http.server
+from typing import Any, Callable, Dict, Iterator, List, TypeVar
+from tracing import tracer
+
+
+T = TypeVar("T", bound=Callable[..., Any])
+logger = logging.getLogger(__name__)
+# Latencies are counted in buckets growing by 2^(1/BUCKETS_PER_DOUBLING), from 1 microsecond to about 2 minutes
+BUCKETS_PER_DOUBLING = 4
+BUCKET_COUNT = 27 * BUCKETS_PER_DOUBLING
+SMALLEST_LATENCY = 1e-6
+QUANTILES = (0.5, 0.9, 0.99, 0.999)
+DEFAULT_DUMP_INTERVAL = 10.0
+
+
+class _Histogram:
+    def __init__(self) -> None:
+        self.counts = [0] * BUCKET_COUNT
+        self.count = 0
+        self.sum = 0.0
+        self.max = 0.0
+
+    def observe(self, seconds: float) -> None:
+        index = 0
+        if seconds > SMALLEST_LATENCY:
+            index = min(
+                BUCKET_COUNT - 1,
+                int(math.log2(seconds / SMALLEST_LATENCY) * BUCKETS_PER_DOUBLING) + 1,
+            )
+        self.counts[index] += 1
+        self.count += 1
+        self.sum += seconds
+        self.max = max(self.max, seconds)
+
+    def quantile(self, quantile: float) -> float:
+        """
+        :return: the upper bound of the bucket holding the quantile, at most the largest value observed
+        """
+        target = max(1, round(quantile * self.count))
+        seen = 0
+        for index, count in enumerate(self.counts):
+            seen += count
+            if seen >= target:
+                return min(self.max, SMALLEST_LATENCY * 2 ** (index / BUCKETS_PER_DOUBLING))
+        return self.max
+
+
+class Metrics:
+    """
+    Counters, latency histograms and gauges of one server process, rendered in the Prometheus text format.
+    Nothing is recorded until enable() is called, so the instrumentation costs a flag check when metrics are off.
+    Gauges are functions read when the metrics are rendered. Timed blocks are also recorded as trace spans when the
+    tracer is enabled.
+    """
+
+    def __init__(self) -> None:
+        self.enabled = False
+        self._lock = threading.Lock()
+        self._counters: Dict[str, float] = {}
+        self._histograms: Dict[str, _Histogram] = {}
+        self._gauges: Dict[str, Callable[[], float]] = {}
+
+    def enable(self) -> None:
+        self.enabled = True
+
+    def increment(self, name: str, amount: float = 1) -> None:
+        if not self.enabled:
+            return
+        with self._lock:
+            self._counters[name] = self._counters.get(name, 0) + amount
+
+    def observe(self, name: str, seconds: float) -> None:
+        if not self.enabled:
+            return
+        with self._lock:
+            histogram = self._histograms.get(name)
+            if histogram is None:
+                histogram = self._histograms[name] = _Histogram()
+            histogram.observe(seconds)
+
+    def _finish_timer(self, name: str, start: float) -> None:
+        end = time.perf_counter()
+        self.observe(name, end - start)
+        tracer.record(name, start, end)
+
+    @contextlib.contextmanager
+    def timer(self, name: str) -> Iterator[None]:
+        if not (self.enabled or tracer.enabled):
+            yield
+            return
+        start = time.perf_counter()
+        try:
+            yield
+        finally:
+            self._finish_timer(name, start)
+
+    def timed(self, name: str) -> Callable[[T], T]:
+        """
+        Decorates a function to observe its run time under name.
+        """
+
+        def decorator(func: T) -> T:
+            @functools.wraps(func)
+            def wrapper(*args: Any, **kwargs: Any) -> Any:
+                if not (self.enabled or tracer.enabled):
+                    return func(*args, **kwargs)
+                start = time.perf_counter()
+                try:
+                    return func(*args, **kwargs)
+                finally:
+                    self._finish_timer(name, start)
+
+            return wrapper  # type: ignore
+
+        return decorator
+
+    def register_gauges(self, gauges: Dict[str, Callable[[], float]]) -> None:
+        with self._lock:
+            self._gauges.update(gauges)
+
+    def unregister_gauges(self, names: List[str]) -> None:
+        with self._lock:
+            for name in names:
+                self._gauges.pop(name, None)
+
+    def render(self) -> str:
+        with self._lock:
+            counters = dict(self._counters)
+            histograms = {
+                name: (
+                    [histogram.quantile(quantile) for quantile in QUANTILES],
+                    histogram.count,
+                    histogram.sum,
+                )
+                for name, histogram in self._histograms.items()
+            }
+            gauges = dict(self._gauges)
+        lines: List[str] = []
+        for name, value in sorted(counters.items()):
+            lines.append(f"{name}_total {value:g}")
+        for name, gauge in sorted(gauges.items()):
+            try:
+                lines.append(f"{name} {gauge():g}")
+            except Exception:
+                logger.exception(f"Could not read gauge {name}")
+        for name, (quantiles, count, total) in sorted(histograms.items()):
+            for quantile, value in zip(QUANTILES, quantiles):
+                lines.append(f'{name}_seconds{{quantile="{quantile}"}} {value:.6g}')
+            lines.append(f"{name}_seconds_count {count}")
+            lines.append(f"{name}_seconds_sum {total:.6g}")
+        return "\n".join(lines) + "\n"
+
+
+metrics = Metrics()
+
+
+class _MetricsRequestHandler(http.server.BaseHTTPRequestHandler):
+    def do_GET(self) -> None:
+        body = metrics.render().encode()
+        self.send_response(200)
+        self.send_header("Content-Type", "text/plain; version=0.0.4")
+        self.send_header("Content-Length", str(len(body)))
+        self.end_headers()
+        self.wfile.write(body)
+
+    def log_message(self, format: str, *args: Any) -> None:
+        pass
+
+
+def serve_metrics(port: int) -> http.server.ThreadingHTTPServer:
+    """
+    Serves the rendered metrics over HTTP on localhost from a daemon thread.
+    """
+    metrics.enable()
+    server = http.server.ThreadingHTTPServer(("127.0.0.1", port), _MetricsRequestHandler)
+    threading.Thread(target=server.serve_forever, daemon=True).start()
+    return server
+
+
+def dump_metrics_periodically(path: str, interval: float = DEFAULT_DUMP_INTERVAL) -> None:
+    """
+    Rewrites the file at path with the rendered metrics every interval seconds, from a daemon thread.
+    """
+    metrics.enable()
+
+    def dump() -> None:
+        while True:
+            time.sleep(interval)
+            try:
+                with open(path + ".tmp", "w") as dump_file:
+                    dump_file.write(metrics.render())
+                # Readers never see a partially written file
+                os.replace(path + ".tmp", path)
+            except OSError:
+                logger.exception(f"Could not write metrics to {path}")
+
+    threading.Thread(target=dump, daemon=True).start()
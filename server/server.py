@@ -1,34 +1,307 @@
+import time
+import socket
 import logging
+import selectors
+import threading
 import socketserver
+import collections
 import server_protocol
+from typing import Dict, Iterable, List, Optional
+from metrics import metrics
+from tracing import tracer
+from admission import AdmissionController, AdmissionLimits, BUSY_RETRY_SECONDS
 from server_logic import ServerLogic
+from storage.blob_store import BlobStore
 
 
 logger = logging.getLogger(__name__)
+SEND_BUFFER_SIZE = 64 * 1024
+# Most chunks gathered into one send, well below IOV_MAX
+MAX_SEND_BUFFERS = 64
+# Largest payload received into memory, larger messages must go to the blob store
+MAX_PAYLOAD_SIZE = 256 * 1024 * 1024
+# The payload of a rejected request is read and dropped up to this size, so closing the connection does not reset it
+# before the client reads the response. Larger payloads are left unread.
+MAX_DISCARDED_PAYLOAD_SIZE = 64 * 1024
+DISCARD_BUFFER_SIZE = 64 * 1024
+# A rejected connection is closed once the client closes it, sends more than MAX_DISCARDED_PAYLOAD_SIZE or after
+# LINGER_SECONDS
+LINGER_SECONDS = 1.0
+# Rejected connections lingering at once, more are closed right away
+MAX_LINGERING_CONNECTIONS = 128
 
 
-class RequestHandler(socketserver.BaseRequestHandler):
-    def _read_until_size_met(self, size: int) -> bytes:
-        data_read = b""
-        while bytes_left_to_read := size - len(data_read):
-            data_read += self.request.recv(bytes_left_to_read)
-        return data_read
+def receive_into(sock: socket.socket, buffer: memoryview) -> None:
+    received = 0
+    while received < len(buffer):
+        count = sock.recv_into(buffer[received:])
+        if not count:
+            raise ConnectionError("Connection closed by the client")
+        received += count
+    metrics.increment("bytes_received", received)
+
+
+def read_until_size_met(sock: socket.socket, size: int) -> memoryview:
+    """
+    Reads exactly size bytes into one preallocated buffer.
+    """
+    buffer = memoryview(bytearray(size))
+    receive_into(sock, buffer)
+    return buffer
+
+
+def discard(sock: socket.socket, size: int) -> None:
+    """
+    Reads size bytes and drops them, DISCARD_BUFFER_SIZE bytes at a time.
+    """
+    buffer = memoryview(bytearray(min(size, DISCARD_BUFFER_SIZE)))
+    while size:
+        received = min(size, len(buffer))
+        receive_into(sock, buffer[:received])
+        size -= received
+
+
+def check_payload_size(header_obj: server_protocol.RequestHeader) -> None:
+    if not 0 <= header_obj.payload_size <= MAX_PAYLOAD_SIZE:
+        raise server_protocol.ProtocolError(
+            f"Unexpected payload size {header_obj.payload_size}"
+        )
+
+
+def send_some(sock: socket.socket, buffers: List[memoryview]) -> None:
+    """
+    Sends the beginning of buffers with one call and removes whatever was sent from them. The buffers are gathered
+    by sendmsg where it is available, instead of being joined.
+    """
+    if hasattr(sock, "sendmsg"):
+        sent = sock.sendmsg(buffers)
+    else:
+        sent = sock.send(buffers[0])
+    metrics.increment("bytes_sent", sent)
+    while buffers and sent >= len(buffers[0]):
+        sent -= len(buffers.pop(0))
+    if sent:
+        buffers[0] = buffers[0][sent:]
+
+
+def send_chunks(sock: socket.socket, chunks: Iterable[bytes]) -> None:
+    """
+    Sends the response as it is produced, gathering small chunks to avoid a send call per message record.
+    """
+    buffers: List[memoryview] = []
+    buffered = 0
+    try:
+        for chunk in chunks:
+            buffers.append(memoryview(chunk))
+            buffered += len(chunk)
+            if buffered >= SEND_BUFFER_SIZE or len(buffers) >= MAX_SEND_BUFFERS:
+                while buffers:
+                    send_some(sock, buffers)
+                buffered = 0
+        while buffers:
+            send_some(sock, buffers)
+    finally:
+        # A client that disconnects mid response must not leave the rest of it (e.g. pinned blobs) unreleased
+        server_protocol.close_chunks(chunks)
+
+
+def is_blob_message(
+    header_obj: server_protocol.RequestHeader, blob_store: Optional[BlobStore]
+) -> bool:
+    return (
+        header_obj.code == server_protocol.RequestCode.MESSAGE_REQUEST.value
+        and blob_store is not None
+        and header_obj.payload_size - server_protocol.SendMessageRequest.format.size
+        > blob_store.threshold
+    )
+
+
+def handle_blob_message(
+    sock: socket.socket,
+    server_logic: ServerLogic,
+    header_obj: server_protocol.RequestHeader,
+    blob_store: BlobStore,
+) -> None:
+    """
+    Streams the content of a large message straight from the (blocking) socket into the blob store. The sender is
+    authenticated first, so unknown clients cannot make the server write to disk.
+    """
+    check_payload_size(header_obj)
+    if not server_logic.is_registered(header_obj.client_id):
+        logger.error(f"Dropping a blob message from unknown user {header_obj.client_id!r}")
+        metrics.increment("request_message_request_errors")
+        discard(sock, header_obj.payload_size)
+        send_chunks(sock, server_protocol.ErrorResponse().chunks())
+        return
+    request = server_protocol.SendMessageRequest.unpack(
+        read_until_size_met(sock, server_protocol.SendMessageRequest.format.size)
+    )
+    if (
+        request.content_size
+        != header_obj.payload_size - server_protocol.SendMessageRequest.format.size
+    ):
+        raise server_protocol.ProtocolError()
+    reference = blob_store.store(sock.recv, request.content_size)
+    metrics.increment("bytes_received", request.content_size)
+    try:
+        request.message_content = reference
+        send_chunks(sock, server_logic.dispatch_request_chunks(header_obj, request))
+    finally:
+        blob_store.unpin(reference.digest)
+
+
+def reject_request(
+    sock: socket.socket, retry_after: float, payload_size: int = 0
+) -> None:
+    if payload_size <= MAX_DISCARDED_PAYLOAD_SIZE:
+        read_until_size_met(sock, payload_size)
+    send_chunks(sock, server_protocol.OverloadedResponse(retry_after).chunks())
+
+
+class _Lingering:
+    def __init__(self, sock: socket.socket) -> None:
+        self.sock = sock
+        self.deadline = time.monotonic() + LINGER_SECONDS
+        self.discarded = 0
+
+
+class Lingerer:
+    """
+    Closes rejected connections after their response was sent. Closing a socket with unread data resets the connection,
+    which may discard the response before the client reads it, so the request the client already sent is read and
+    dropped first. One thread drains every lingering connection.
+    """
+
+    def __init__(self) -> None:
+        self._added: "collections.deque[socket.socket]" = collections.deque()
+        self._added_lock = threading.Lock()
+        self._count = 0
+        self._selector = selectors.DefaultSelector()
+        # In the order of their deadlines, since they all linger as long
+        self._lingering: "collections.OrderedDict[socket.socket, _Lingering]" = collections.OrderedDict()
+        self._closed = threading.Event()
+        self._thread = threading.Thread(target=self._run, daemon=True)
+        self._thread.start()
+
+    def linger(self, sock: socket.socket) -> None:
+        """
+        Takes over sock, whose response was sent, and closes it once the client is done sending.
+        """
+        try:
+            sock.shutdown(socket.SHUT_WR)
+            sock.setblocking(False)
+        except OSError:
+            sock.close()
+            return
+        with self._added_lock:
+            if self._closed.is_set() or self._count >= MAX_LINGERING_CONNECTIONS:
+                sock.close()
+                return
+            self._count += 1
+            self._added.append(sock)
+
+    def close(self) -> None:
+        self._closed.set()
+        self._thread.join()
+        self._selector.close()
 
+    def _run(self) -> None:
+        while not self._closed.is_set():
+            with self._added_lock:
+                added, self._added = self._added, collections.deque()
+            for sock in added:
+                self._lingering[sock] = _Lingering(sock)
+                self._selector.register(sock, selectors.EVENT_READ, self._lingering[sock])
+            if not self._lingering:
+                # Selecting nothing fails on Windows
+                self._closed.wait(LINGER_SECONDS / 10)
+                continue
+            for key, _ in self._selector.select(LINGER_SECONDS / 10):
+                self._drain(key.data)
+            now = time.monotonic()
+            while self._lingering and next(iter(self._lingering.values())).deadline <= now:
+                self._close(next(iter(self._lingering.values())))
+        with self._added_lock:
+            added, self._added = self._added, collections.deque()
+        for sock in added:
+            sock.close()
+        for lingering in list(self._lingering.values()):
+            self._close(lingering)
+
+    def _drain(self, lingering: _Lingering) -> None:
+        try:
+            while lingering.discarded <= MAX_DISCARDED_PAYLOAD_SIZE:
+                data = lingering.sock.recv(DISCARD_BUFFER_SIZE)
+                if not data:
+                    break
+                lingering.discarded += len(data)
+        except BlockingIOError:
+            return
+        except OSError:
+            pass
+        self._close(lingering)
+
+    def _close(self, lingering: _Lingering) -> None:
+        self._selector.unregister(lingering.sock)
+        del self._lingering[lingering.sock]
+        lingering.sock.close()
+        with self._added_lock:
+            self._count -= 1
+
+
+class RequestHandler(socketserver.BaseRequestHandler):
     def _handle_request(self, header_obj: server_protocol.RequestHeader) -> None:
-        payload = self._read_until_size_met(header_obj.payload_size)
         if not isinstance(self.server, Server):
             raise RuntimeError(
                 "This RequestHandler cannot be used with a different server"
             )
-        self.request.send(
-            self.server.server_logic.dispatch_payload(header_obj, payload)
+        server_logic = self.server.server_logic
+        check_payload_size(header_obj)
+        if is_blob_message(header_obj, server_logic.blob_store):
+            handle_blob_message(
+                self.request, server_logic, header_obj, server_logic.blob_store
+            )
+            return
+        payload = read_until_size_met(self.request, header_obj.payload_size)
+        send_chunks(
+            self.request, server_logic.dispatch_payload_chunks(header_obj, payload)
         )
 
+    def _admit_request(self, header_obj: server_protocol.RequestHeader) -> None:
+        if not isinstance(self.server, Server):
+            raise RuntimeError(
+                "This RequestHandler cannot be used with a different server"
+            )
+        if header_obj.payload_size < 0:
+            raise server_protocol.ProtocolError(
+                f"Unexpected payload size {header_obj.payload_size}"
+            )
+        admission = self.server.admission
+        retry_after = admission.admit_request(
+            self.client_address[0], header_obj.client_id, header_obj.payload_size
+        )
+        if retry_after is not None:
+            reject_request(self.request, retry_after, header_obj.payload_size)
+            return
+        try:
+            self._handle_request(header_obj)
+        finally:
+            admission.release_request(header_obj.payload_size)
+
     def handle(self) -> None:
-        request_header = self._read_until_size_met(server_protocol.RequestHeader.size)
         try:
+            request_header = read_until_size_met(
+                self.request, server_protocol.RequestHeader.size
+            )
             header_obj = server_protocol.RequestHeader.unpack(request_header)
-            self._handle_request(header_obj)
+            if header_obj.extension_size:
+                header_obj.unpack_extension(
+                    read_until_size_met(self.request, header_obj.extension_size)
+                )
+            with tracer.request(header_obj.trace_id), metrics.timer("handle_request"):
+                self._admit_request(header_obj)
+        except ConnectionError as e:
+            logger.warning(f"Lost connection to {self.client_address}: {e}")
         except server_protocol.ProtocolError:
             logger.exception(
                 f"Caught an exception while handling header for {self.client_address}"
@@ -37,15 +310,62 @@ class RequestHandler(socketserver.BaseRequestHandler):
 
 class Server(socketserver.ThreadingTCPServer):
     allow_reuse_address = True
+    # Connections are short lived (one request each), the default backlog of 5 drops bursts of them
+    request_queue_size = 1024
 
-    def __init__(self, server_address, bind_and_activate=True) -> None:
+    def __init__(
+        self,
+        server_address,
+        bind_and_activate=True,
+        segment_storage: bool = False,
+        worker_index: Optional[int] = None,
+        admission_limits: Optional[AdmissionLimits] = None,
+        message_ttls: Optional[Dict[int, float]] = None,
+    ) -> None:
+        """
+        :param worker_index: index of this worker process, when several processes listen on the same port
+        :param admission_limits: limits of this process, AdmissionLimits() by default
+        :param message_ttls: seconds an undelivered message of each type is kept, see ServerLogic
+        """
+        self.allow_reuse_port = worker_index is not None
         super().__init__(
             server_address,
             RequestHandlerClass=RequestHandler,
             bind_and_activate=bind_and_activate,
         )
-        self.server_logic = ServerLogic()
+        self.admission = AdmissionController(admission_limits or AdmissionLimits())
+        self.lingerer = Lingerer()
+        self.server_logic = ServerLogic(
+            segment_storage=segment_storage,
+            worker_index=worker_index,
+            message_ttls=message_ttls,
+        )
+
+    def verify_request(self, request, client_address) -> bool:
+        # Runs on the thread accepting connections, before a thread is started for the connection
+        metrics.increment("connections_accepted")
+        if self.admission.open_connection():
+            return True
+        try:
+            send_chunks(
+                request, server_protocol.OverloadedResponse(BUSY_RETRY_SECONDS).chunks()
+            )
+        except OSError:
+            pass
+        # socketserver closes the rejected request, the duplicate keeps the connection open while it lingers
+        try:
+            self.lingerer.linger(request.dup())
+        except OSError:
+            pass
+        return False
+
+    def process_request_thread(self, request, client_address) -> None:
+        try:
+            super().process_request_thread(request, client_address)
+        finally:
+            self.admission.close_connection()
 
     def __exit__(self, exc_type, exc_val, exc_tb):
+        self.lingerer.close()
         self.server_logic.close_connection()
         super().__exit__(exc_type, exc_val, exc_tb)
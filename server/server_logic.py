@@ -1,15 +1,36 @@
-import uuid
+import io
 import logging
 import pathlib
 import server_protocol
-from storage.database_storage import DBStorage
-from typing import Dict, TypeVar, Any, Callable, Type, List
-from storage.storage_layer import StorageLayer, StorageLayerException, User, UserList
+from metrics import metrics
+from caches import UserDirectoryCache, UserCache, DEFAULT_USER_CACHE_SIZE
+from storage.database_storage import (
+    DBStorage,
+    DEFAULT_LAST_SEEN_FLUSH_INTERVAL,
+    DEFAULT_EXPIRY_INTERVAL,
+)
+from storage.segment_storage import SegmentStorage
+from typing import (
+    Dict,
+    TypeVar,
+    Any,
+    Callable,
+    Type,
+    List,
+    Iterator,
+    Optional,
+    Tuple,
+    Union,
+)
+from storage.blob_store import BlobStore, BlobReference, clear_pins
+from storage.storage_layer import StorageLayer, StorageLayerException, User
 
 
 T = TypeVar("T", bound=Callable[..., Any])
 logger = logging.getLogger(__name__)
 DATABASE_PATH = pathlib.Path(__file__).parent.joinpath("server.db")
+MESSAGES_PATH = pathlib.Path(__file__).parent.joinpath("messages")
+BLOBS_PATH = pathlib.Path(__file__).parent.joinpath("blobs")
 
 
 def safe_call_decorator(func: T) -> T:
@@ -40,6 +61,7 @@ class DispatchManager:
         server_protocol.RequestCode.USER_PUBKEY,
         server_protocol.RequestCode.MESSAGE_REQUEST,
         server_protocol.RequestCode.READ_MESSAGES,
+        server_protocol.RequestCode.MULTI_MESSAGE_REQUEST,
     ]
     _dispatch_request_types_dict: Dict[
         server_protocol.RequestCode, Type[server_protocol.ClientRequest]
@@ -49,14 +71,27 @@ class DispatchManager:
         server_protocol.RequestCode.USER_PUBKEY: server_protocol.UserPublicKeyRequest,
         server_protocol.RequestCode.MESSAGE_REQUEST: server_protocol.SendMessageRequest,
         server_protocol.RequestCode.READ_MESSAGES: server_protocol.GetAvailableMessages,
+        server_protocol.RequestCode.MULTI_MESSAGE_REQUEST: server_protocol.MultiSendMessageRequest,
     }
 
-    def __init__(self, storage: StorageLayer):
+    def __init__(
+        self,
+        storage: StorageLayer,
+        user_cache_size: int = DEFAULT_USER_CACHE_SIZE,
+        shared_storage: bool = False,
+    ):
+        """
+        :param shared_storage: whether other processes register users in the same storage
+        """
         self._storage: StorageLayer = storage
+        self._shared_storage = shared_storage
+        self._user_cache = UserCache(user_cache_size)
+        self._user_directory = UserDirectoryCache()
+        self._user_directory.load(storage)
         self._dispatch_request_funcs_dict: Dict[
             Type[server_protocol.ClientRequest],
             Callable[
-                [server_protocol.ClientRequest, str], server_protocol.ServerResponse
+                [server_protocol.ClientRequest, bytes], server_protocol.ServerResponse
             ],
         ] = {
             server_protocol.SignupRequest: self._dispatch_signup,
@@ -64,6 +99,7 @@ class DispatchManager:
             server_protocol.UserPublicKeyRequest: self._dispatch_user_public_key_request,
             server_protocol.SendMessageRequest: self._dispatch_send_message,
             server_protocol.GetAvailableMessages: self._dispatch_get_messages,
+            server_protocol.MultiSendMessageRequest: self._dispatch_send_messages,
         }
 
     @staticmethod
@@ -72,63 +108,103 @@ class DispatchManager:
 
     @safe_call_decorator
     def _dispatch_signup(
-        self, request: server_protocol.SignupRequest, client_id: str
+        self, request: server_protocol.SignupRequest, client_id: bytes
     ) -> server_protocol.SignupSuccess:
         user = User.create_new_user(self._storage, request)
-        return server_protocol.SignupSuccess(uuid.UUID(user.id).bytes)
+        self._user_cache.add(user)
+        self._user_directory.add_user(user.id, user.name.encode())
+        return server_protocol.SignupSuccess(user.id)
 
     @safe_call_decorator
     def _dispatch_user_list(
-        self, request: server_protocol.UserList, client_id: str
-    ) -> server_protocol.UserListResponse:
-        clients: List[server_protocol.ClientRecord] = []
-        for client in UserList.get_user_list(self._storage, client_id):
-            clients.append(
-                server_protocol.ClientRecord(uuid.UUID(client.id).bytes, client.name.encode())
-            )
-        return server_protocol.UserListResponse(clients)
+        self, request: server_protocol.UserList, client_id: bytes
+    ) -> server_protocol.PackedUserListResponse:
+        if self._shared_storage:
+            self._user_directory.refresh(self._storage)
+        return server_protocol.PackedUserListResponse(
+            self._user_directory.get_packed_list(client_id)
+        )
 
     @safe_call_decorator
     def _dispatch_user_public_key_request(
-        self, request: server_protocol.UserPublicKeyRequest, client_id: str
+        self, request: server_protocol.UserPublicKeyRequest, client_id: bytes
     ) -> server_protocol.UserPublicKey:
-        user = User.get_user_by_id(self._storage, request.target_client_id.hex())
-        return server_protocol.UserPublicKey(uuid.UUID(user.id).bytes, user.public_key)
+        user = self._user_cache.get_user(self._storage, request.target_client_id)
+        return server_protocol.UserPublicKey(user.id, user.public_key)
 
     @safe_call_decorator
     def _dispatch_send_message(
-        self, request: server_protocol.SendMessageRequest, client_id: str
+        self, request: server_protocol.SendMessageRequest, client_id: bytes
     ) -> server_protocol.MessageSent:
-        user = User.get_user_by_id(self._storage, request.target_client_id.hex())
+        user = self._user_cache.get_user(self._storage, request.target_client_id)
         message_id = user.send_message(
             self._storage, client_id, request.message_type, request.message_content
         )
-        return server_protocol.MessageSent(uuid.UUID(user.id).bytes, message_id)
+        return server_protocol.MessageSent(user.id, message_id)
+
+    @safe_call_decorator
+    def _dispatch_send_messages(
+        self, request: server_protocol.MultiSendMessageRequest, client_id: bytes
+    ) -> server_protocol.MessagesSent:
+        """
+        Stores every message in one commit, or none of them if a recipient does not exist.
+        """
+        recipients = [
+            self._user_cache.get_user(self._storage, target_client_id).id
+            for target_client_id, _ in request.messages
+        ]
+        messages: List[Tuple[bytes, int, Union[bytes, BlobReference]]] = [
+            (recipient, request.message_type, content)
+            for recipient, (_, content) in zip(recipients, request.messages)
+        ]
+        blob_store = self._storage.blob_store
+        reference: Optional[BlobReference] = None
+        if (
+            request.shared_content
+            and messages
+            and blob_store is not None
+            and len(request.messages[0][1]) > blob_store.threshold
+        ):
+            # Large shared content is kept once in the blob store instead of in every message
+            content = request.messages[0][1]
+            reference = blob_store.store(io.BytesIO(content).read, len(content))
+            messages = [
+                (recipient, message_type, reference)
+                for recipient, message_type, _ in messages
+            ]
+        try:
+            message_ids = self._storage.send_messages(client_id, messages)
+        finally:
+            if reference is not None:
+                blob_store.unpin(reference.digest)
+        return server_protocol.MessagesSent(list(zip(recipients, message_ids)))
 
     @safe_call_decorator
     def _dispatch_get_messages(
-        self, request: server_protocol.GetAvailableMessages, client_id: str
+        self, request: server_protocol.GetAvailableMessages, client_id: bytes
     ) -> server_protocol.MessageList:
-        user = User.get_user_by_id(self._storage, client_id)
+        user = self._user_cache.get_user(self._storage, client_id)
         messages = user.get_all_messages(self._storage)
         message_list: List[server_protocol.MessageRecord] = []
         for message in messages:
             message_list.append(
                 server_protocol.MessageRecord(
-                    message.source.bytes, message.message_type, message.content
+                    message.source, message.message_type, message.content
                 )
             )
         return server_protocol.MessageList(message_list)
 
-    def _check_user_valid(self, user_id: bytes) -> bool:
+    def check_user_valid(self, user_id: bytes) -> bool:
+        if user_id in self._user_cache:
+            return True
         try:
-            User.get_user_by_id(self._storage, user_id.decode())
+            self._user_cache.get_user(self._storage, user_id)
             return True
         except StorageLayerException:
             return False
 
     def _dispatch(
-        self, payload: server_protocol.RequestHeader, client_id: str
+        self, payload: server_protocol.RequestHeader, client_id: bytes
     ) -> server_protocol.ServerResponse:
         if type(payload) not in self._dispatch_request_funcs_dict.keys():
             raise ServerLogicalException("This line should never be reached")
@@ -144,30 +220,115 @@ class DispatchManager:
             or server_protocol.RequestCode(request_header.code)
             not in self._dispatch_request_types_dict.keys()
         ):
+            metrics.increment("request_unknown_errors")
             raise ServerLogicalException("Unexpected request code!")
         request = self._dispatch_request_types_dict[
             server_protocol.RequestCode(request_header.code)
         ].unpack(payload)
-        logger.debug("Got request {!r}".format(payload))
-        if request_header.code in DispatchManager.AUTH_REQUIRED_REQUESTS:
-            if self._check_user_valid(request_header.client_id):
-                self._storage.update_user_last_seen(request_header.client_id)
+        logger.debug("Got request %r", request_header)
+        return self.dispatch_request(request_header, request)
+
+    def dispatch_request(
+        self,
+        request_header: server_protocol.RequestHeader,
+        request: server_protocol.ClientRequest,
+    ) -> server_protocol.ServerResponse:
+        name = "request_" + server_protocol.RequestCode(request_header.code).name.lower()
+        with metrics.timer(name):
+            response = self._dispatch_request(request_header, request)
+        if isinstance(response, server_protocol.ErrorResponse):
+            metrics.increment(name + "_errors")
+        return response
+
+    @safe_call_decorator
+    def _dispatch_request(
+        self,
+        request_header: server_protocol.RequestHeader,
+        request: server_protocol.ClientRequest,
+    ) -> server_protocol.ServerResponse:
+        client_id = request_header.client_id
+        if (
+            server_protocol.RequestCode(request_header.code)
+            in DispatchManager.AUTH_REQUIRED_REQUESTS
+        ):
+            if self.check_user_valid(client_id):
+                self._storage.update_user_last_seen(client_id)
             else:
                 raise SecurityException(
                     "User with id {!r} does not exit!".format(request_header.client_id)
                 )
-        return self._dispatch(request, str(uuid.UUID(bytes=request_header.client_id)).replace("-", ""))
+        return self._dispatch(request, client_id)
+
+
+def prepare_shared_storage() -> None:
+    """
+    Creates or migrates the database and drops stale blob pins, before several worker processes open the storage.
+    """
+    DBStorage(str(DATABASE_PATH), expiry_interval=None).close_connection()
+    clear_pins(str(BLOBS_PATH))
 
 
 class ServerLogic:
-    def __init__(self) -> None:
-        self._storage = DBStorage(str(DATABASE_PATH))
-        self._dispatch_manager: DispatchManager = DispatchManager(self._storage)
+    def __init__(
+        self,
+        last_seen_flush_interval: float = DEFAULT_LAST_SEEN_FLUSH_INTERVAL,
+        segment_storage: bool = False,
+        worker_index: Optional[int] = None,
+        message_ttls: Optional[Dict[int, float]] = None,
+    ) -> None:
+        """
+        :param worker_index: index of this worker process when several processes share the storage, the first one
+        expires old messages. prepare_shared_storage must be called before the workers start.
+        :param message_ttls: seconds an undelivered message of each type is kept, DEFAULT_MESSAGE_TTLS by default and
+        nothing expires if empty. Messages in segment storage never expire.
+        """
+        shared_storage = worker_index is not None
+        self._storage: DBStorage
+        if segment_storage:
+            if shared_storage:
+                raise ValueError(
+                    "Segment storage cannot be shared by several worker processes"
+                )
+            if message_ttls:
+                raise ValueError("Messages in segment storage cannot expire")
+            self._storage = SegmentStorage(
+                str(DATABASE_PATH),
+                str(MESSAGES_PATH),
+                last_seen_flush_interval=last_seen_flush_interval,
+                expiry_interval=None,
+            )
+        else:
+            expires = worker_index in (None, 0) and message_ttls != {}
+            self._storage = DBStorage(
+                str(DATABASE_PATH),
+                last_seen_flush_interval=last_seen_flush_interval,
+                blobs_directory=str(BLOBS_PATH),
+                message_ttls=message_ttls,
+                expiry_interval=DEFAULT_EXPIRY_INTERVAL if expires else None,
+                shared=shared_storage,
+            )
+        self._dispatch_manager: DispatchManager = DispatchManager(
+            self._storage, shared_storage=shared_storage
+        )
 
-    def dispatch_payload(
+    def dispatch_payload_chunks(
         self, request_header: server_protocol.RequestHeader, payload: bytes
-    ) -> bytes:
-        return self._dispatch_manager.dispatch_payload(request_header, payload).pack()
+    ) -> Iterator[bytes]:
+        return self._dispatch_manager.dispatch_payload(request_header, payload).chunks()
+
+    def dispatch_request_chunks(
+        self,
+        request_header: server_protocol.RequestHeader,
+        request: server_protocol.ClientRequest,
+    ) -> Iterator[bytes]:
+        return self._dispatch_manager.dispatch_request(request_header, request).chunks()
+
+    def is_registered(self, client_id: bytes) -> bool:
+        return self._dispatch_manager.check_user_valid(client_id)
+
+    @property
+    def blob_store(self) -> Optional[BlobStore]:
+        return self._storage.blob_store
 
     def close_connection(self) -> None:
         self._storage.close_connection()
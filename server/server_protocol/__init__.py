@@ -1,12 +1,20 @@
-from server_protocol.utils import ProtocolError
+from server_protocol.utils import (
+    ProtocolError,
+    StreamedContent,
+    ClosingChunks,
+    close_chunks,
+)
 from server_protocol.client_requests import (
     ClientRequest,
     RequestCode,
+    MessageType,
+    TRACE_FLAG,
     RequestHeader,
     SignupRequest,
     UserList,
     UserPublicKeyRequest,
     SendMessageRequest,
+    MultiSendMessageRequest,
     GetAvailableMessages,
 )
 from server_protocol.server_responses import (
@@ -15,9 +23,12 @@ from server_protocol.server_responses import (
     SignupSuccess,
     ClientRecord,
     UserListResponse,
+    PackedUserListResponse,
     UserPublicKey,
     MessageSent,
+    MessagesSent,
     MessageRecord,
     MessageList,
     ErrorResponse,
+    OverloadedResponse,
 )
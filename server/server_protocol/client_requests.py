@@ -2,7 +2,7 @@ import abc
 import enum
 import struct
 from dataclasses import dataclass
-from typing import ClassVar, Callable
+from typing import ClassVar, Callable, List, Tuple
 from server_protocol.utils import generate_pack, ProtocolError
 
 
@@ -12,6 +12,18 @@ class RequestCode(enum.Enum):
     USER_PUBKEY = 1002
     MESSAGE_REQUEST = 1003
     READ_MESSAGES = 1004
+    MULTI_MESSAGE_REQUEST = 1005
+
+
+# Set in the version of requests that are followed by a trace id extension
+TRACE_FLAG = 0x80
+VERSION_OFFSET = 16
+
+
+class MessageType(enum.Enum):
+    SYMMETRIC_KEY_REQUEST = 1
+    SYMMETRIC_KEY_RESPONSE = 2
+    TEXT_MESSAGE = 3
 
 
 class ClientRequest(abc.ABC):
@@ -36,15 +48,45 @@ class ClientRequest(abc.ABC):
 
 @dataclass
 class RequestHeader(ClientRequest):
+    """
+    When the version has TRACE_FLAG set, the header is followed by an extension holding the trace id of the request,
+    which is not counted in payload_size.
+    """
+
     format: ClassVar[struct.Struct] = struct.Struct("<16sBHi")
+    extension_format: ClassVar[struct.Struct] = struct.Struct("<Q")
     client_id: bytes
     version: int
     code: int
     payload_size: int
     size: int = format.size
+    trace_id: int = 0
+
+    @classmethod
+    def full_size(cls, data: bytes) -> int:
+        """
+        :param data: the beginning of a header
+        :return: the size of the header and its extension, as far as it is known from data
+        """
+        if len(data) > VERSION_OFFSET and data[VERSION_OFFSET] & TRACE_FLAG:
+            return cls.size + cls.extension_format.size
+        return cls.size
+
+    @property
+    def extension_size(self) -> int:
+        return self.extension_format.size if self.version & TRACE_FLAG else 0
+
+    def unpack_extension(self, data: bytes) -> None:
+        try:
+            (self.trace_id,) = self.extension_format.unpack_from(data)
+        except struct.error:
+            raise ProtocolError()
 
     def pack(self) -> bytes:
-        return generate_pack(self, ["client_id", "version", "code", "payload_size"])
+        header = generate_pack(self, ["client_id", "version", "code", "payload_size"])
+        if self.extension_size:
+            return header + self.extension_format.pack(self.trace_id)
+        return header
 
 
 @dataclass
@@ -92,6 +134,52 @@ class SendMessageRequest(ClientRequest):
         return cls(*args)
 
 
+@dataclass
+class MultiSendMessageRequest(ClientRequest):
+    """
+    Messages of one type to several recipients. If shared_content is set the header is followed by one content_size
+    and content, and then by the recipient ids. Otherwise every recipient id is followed by its own content_size and
+    content.
+    """
+
+    format: ClassVar[struct.Struct] = struct.Struct("<BBI")
+    content_size_format: ClassVar[struct.Struct] = struct.Struct("<i")
+    recipient_format: ClassVar[struct.Struct] = struct.Struct("<16s")
+    message_type: int
+    shared_content: int
+    recipient_count: int
+    messages: List[Tuple[bytes, bytes]]
+
+    @classmethod
+    def _unpack_content(cls, data: bytes, offset: int) -> Tuple[bytes, int]:
+        (content_size,) = cls.content_size_format.unpack_from(data, offset)
+        offset += cls.content_size_format.size
+        content = data[offset : offset + content_size]
+        if content_size < 0 or len(content) != content_size:
+            raise ProtocolError()
+        return content, offset + content_size
+
+    @classmethod
+    def unpack(cls, data: bytes):
+        try:
+            message_type, shared_content, recipient_count = cls.format.unpack_from(data)
+            offset = cls.format.size
+            if shared_content:
+                content, offset = cls._unpack_content(data, offset)
+            messages = []
+            for _ in range(recipient_count):
+                (target_client_id,) = cls.recipient_format.unpack_from(data, offset)
+                offset += cls.recipient_format.size
+                if not shared_content:
+                    content, offset = cls._unpack_content(data, offset)
+                messages.append((target_client_id, content))
+        except struct.error:
+            raise ProtocolError()
+        if offset != len(data):
+            raise ProtocolError()
+        return cls(message_type, shared_content, recipient_count, messages)
+
+
 @dataclass
 class GetAvailableMessages(ClientRequest):
     size: int = 0
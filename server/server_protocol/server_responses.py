@@ -1,9 +1,10 @@
 import abc
 import enum
+import math
 import struct
-from server_protocol.utils import generate_pack
+from server_protocol.utils import generate_pack, StreamedContent, ClosingChunks
 from dataclasses import dataclass
-from typing import ClassVar, List, Callable
+from typing import ClassVar, List, Callable, Iterator, Union, Tuple
 
 
 class ResponseCode(enum.Enum):
@@ -12,7 +13,9 @@ class ResponseCode(enum.Enum):
     USER_PUBKEY = 2002
     MESSAGE_SENT = 2003
     MESSAGES = 2004
+    MESSAGES_SENT = 2005
     ERROR = 9000
+    OVERLOADED = 9001
 
 
 SERVER_VERSION = 2
@@ -30,11 +33,19 @@ class ServerResponse(abc.ABC):
         self.code: ResponseCode = code
         self.payload_size: int = len(payload)
 
+    def pack_header(self) -> bytes:
+        return self._header_format.pack(self.version, self.code.value, self.payload_size)
+
     def pack(self) -> bytes:
-        return (
-            self._header_format.pack(self.version, self.code.value, self.payload_size)
-            + self.payload
-        )
+        return self.pack_header() + self.payload
+
+    def chunks(self) -> Iterator[bytes]:
+        """
+        The packed response in consecutive chunks, for responses that should not be packed into memory as a whole.
+        """
+        yield self.pack_header()
+        if self.payload:
+            yield self.payload
 
     def __str__(self):
         return f"<{self.__class__.__name__} - {self.__dict__}>"
@@ -80,6 +91,19 @@ class UserListResponse(ServerResponse):
         return b"".join([client.pack() for client in clients])
 
 
+class PackedUserListResponse(ServerResponse):
+    """
+    A user list response whose payload is already a concatenation of packed ClientRecords
+    """
+
+    def __init__(self, packed_clients: bytes):
+        super().__init__(
+            version=SERVER_VERSION,
+            payload=packed_clients,
+            code=ResponseCode.USER_LIST,
+        )
+
+
 class UserPublicKey(ServerResponse):
     def __init__(self, client_id: bytes, public_key: bytes):
         super().__init__(
@@ -108,38 +132,119 @@ class MessageSent(ServerResponse):
         return payload_format.pack(client_id, message_id)
 
 
+class MessagesSent(ServerResponse):
+    def __init__(self, sent_messages: List[Tuple[bytes, int]]):
+        super().__init__(
+            MessagesSent._pack_payload(sent_messages),
+            version=SERVER_VERSION,
+            code=ResponseCode.MESSAGES_SENT,
+        )
+
+    @staticmethod
+    def _pack_payload(sent_messages: List[Tuple[bytes, int]]):
+        payload_format: struct.Struct = struct.Struct("<16si")
+        return b"".join(
+            payload_format.pack(client_id, message_id)
+            for client_id, message_id in sent_messages
+        )
+
+
 class MessageRecord:
     """
     A class that represents a message in the message list response
     """
 
-    def __init__(self, sender_client_id: bytes, message_type: int, message: bytes):
+    header_format: ClassVar[struct.Struct] = struct.Struct("<16sBi")
+
+    def __init__(
+        self,
+        sender_client_id: bytes,
+        message_type: int,
+        message: Union[bytes, StreamedContent],
+    ):
         self.sender_client_id: bytes = sender_client_id
         self.message_type: int = message_type
-        self.message: bytes = message
+        self.message: Union[bytes, StreamedContent] = message
 
-    def pack(self) -> bytes:
-        payload_format: struct.Struct = struct.Struct("<16sBi")
-        message_size: int = len(self.message)
-        return (
-            payload_format.pack(self.sender_client_id, self.message_type, message_size)
-            + self.message
+    @property
+    def message_size(self) -> int:
+        if isinstance(self.message, StreamedContent):
+            return self.message.size
+        return len(self.message)
+
+    @property
+    def size(self) -> int:
+        return self.header_format.size + self.message_size
+
+    def chunks(self) -> Iterator[bytes]:
+        header = self.header_format.pack(
+            self.sender_client_id, self.message_type, self.message_size
         )
+        yield header
+        if isinstance(self.message, StreamedContent):
+            yield from self.message.chunks()
+        elif self.message:
+            yield self.message
+
+    def close(self) -> None:
+        if isinstance(self.message, StreamedContent):
+            self.message.close()
+
+    def pack(self) -> bytes:
+        return b"".join(self.chunks())
 
 
 class MessageList(ServerResponse):
+    """
+    The payload is not packed up front - messages are produced one by one by chunks(), so streamed message content
+    is never loaded into memory.
+    """
+
     def __init__(self, message_list: List[MessageRecord]):
         super().__init__(
             version=SERVER_VERSION,
-            payload=MessageList._pack_payload(message_list),
+            payload=b"",
             code=ResponseCode.MESSAGES,
         )
+        self._messages = message_list
+        self.payload_size = sum(message.size for message in message_list)
 
-    @staticmethod
-    def _pack_payload(messages: List[MessageRecord]):
-        return b"".join([message.pack() for message in messages])
+    def chunks(self) -> Iterator[bytes]:
+        # Closing the chunks releases the streamed content of messages that were not sent
+        return ClosingChunks(self._chunks(), self.close)
+
+    def _chunks(self) -> Iterator[bytes]:
+        yield self.pack_header()
+        for message in self._messages:
+            yield from message.chunks()
+
+    def close(self) -> None:
+        for message in self._messages:
+            message.close()
+
+    def pack(self) -> bytes:
+        return b"".join(self.chunks())
 
 
 class ErrorResponse(ServerResponse):
     def __init__(self):
         super().__init__(payload=b"", version=SERVER_VERSION, code=ResponseCode.ERROR)
+
+
+class OverloadedResponse(ServerResponse):
+    """
+    The request was not handled because the server is at one of its limits. The client should retry after
+    retry_after seconds.
+    """
+
+    def __init__(self, retry_after: float):
+        super().__init__(
+            payload=self._pack_payload(retry_after),
+            version=SERVER_VERSION,
+            code=ResponseCode.OVERLOADED,
+        )
+
+    @staticmethod
+    def _pack_payload(retry_after: float) -> bytes:
+        payload_format: struct.Struct = struct.Struct("<I")
+        return payload_format.pack(math.ceil(retry_after * 1000))
@@ -1,10 +1,59 @@
-from typing import List, Callable, Any
+import abc
+from typing import List, Callable, Any, Iterable, Iterator
 
 
 class ProtocolError(Exception):
     ...
 
 
+class StreamedContent(abc.ABC):
+    """
+    Message content that is not held in memory, but produced in chunks when it is sent.
+    """
+
+    @property
+    @abc.abstractmethod
+    def size(self) -> int:
+        ...
+
+    @abc.abstractmethod
+    def chunks(self) -> Iterator[bytes]:
+        ...
+
+    def close(self) -> None:
+        """
+        Releases the content, whether or not it was sent to the end. Called when the response holding it is disposed.
+        """
+
+
+class ClosingChunks(Iterator[bytes]):
+    """
+    The chunks of a response holding StreamedContent. close() releases the content even if iteration never started,
+    which closing a generator alone does not do.
+    """
+
+    def __init__(self, chunks: Iterator[bytes], close: Callable[[], None]) -> None:
+        self._chunks = chunks
+        self._close = close
+
+    def __iter__(self) -> "ClosingChunks":
+        return self
+
+    def __next__(self) -> bytes:
+        return next(self._chunks)
+
+    def close(self) -> None:
+        close_chunks(self._chunks)
+        self._close()
+
+
+def close_chunks(chunks: Iterable[bytes]) -> None:
+    """Disposes of response chunks that may not have been sent to the end."""
+    close = getattr(chunks, "close", None)
+    if close is not None:
+        close()
+
+
 def generate_pack(class_instance: Any, argument_list: List[str]) -> bytes:
     if not hasattr(class_instance, "format"):
         return b""
@@ -0,0 +1,189 @@
+import os
+import shutil
+import hashlib
+import pathlib
+import tempfile
+import threading
+import contextlib
+from typing import Callable, Dict, Iterator
+from server_protocol import StreamedContent
+
+try:
+    import fcntl
+except ImportError:
+    # Windows, where the server runs as a single process
+    fcntl = None  # type: ignore
+
+
+DEFAULT_BLOB_THRESHOLD = 1024 * 1024
+CHUNK_SIZE = 64 * 1024
+PINS_DIRECTORY = "pins"
+LOCK_FILE = "lock"
+
+
+class BlobReference:
+    """
+    A reference to message content kept in a BlobStore. Received blobs are pinned until unpinned by the receiver, so
+    the file cannot be released before the message referencing it is committed.
+    """
+
+    def __init__(self, digest: str, size: int) -> None:
+        self.digest = digest
+        self.size = size
+
+
+class _DeliveredBlob(StreamedContent):
+    """
+    The content of a blob whose message was fetched (and deleted). The blob stays pinned until it is read to the end or
+    closed, whichever comes first.
+    """
+
+    def __init__(self, store: "BlobStore", digest: str, size: int) -> None:
+        self._store = store
+        self._digest = digest
+        self._size = size
+        self._pinned = True
+        self._pinned_lock = threading.Lock()
+
+    @property
+    def size(self) -> int:
+        return self._size
+
+    def chunks(self) -> Iterator[bytes]:
+        try:
+            with open(self._store.path(self._digest), "rb") as blob:
+                while chunk := blob.read(CHUNK_SIZE):
+                    yield chunk
+        finally:
+            self.close()
+
+    def close(self) -> None:
+        with self._pinned_lock:
+            if not self._pinned:
+                return
+            self._pinned = False
+        self._store.unpin(self._digest)
+
+
+class BlobStore:
+    """
+    A content addressed store for message content larger than threshold, kept as files named by their sha256 digest.
+    is_referenced tells whether any stored message still references a digest, so identical content is kept once.
+    A pinned blob also has a hard link in the pins directory, so a store shared by several processes does not release
+    a blob another process has pinned.
+    """
+
+    def __init__(
+        self,
+        directory: str,
+        is_referenced: Callable[[str], bool],
+        threshold: int = DEFAULT_BLOB_THRESHOLD,
+        shared: bool = False,
+    ) -> None:
+        """
+        :param shared: whether other processes use the store - otherwise pins left by a previous run are dropped
+        """
+        self.threshold = threshold
+        self._directory = pathlib.Path(directory)
+        self._pins_directory = self._directory.joinpath(PINS_DIRECTORY)
+        if not shared:
+            clear_pins(directory)
+        self._pins_directory.mkdir(parents=True, exist_ok=True)
+        self._is_referenced = is_referenced
+        self._lock = threading.Lock()
+        self._pins: Dict[str, int] = {}
+
+    @contextlib.contextmanager
+    def _locked(self) -> Iterator[None]:
+        """
+        Holds the store lock, across processes where file locks are available.
+        """
+        with self._lock:
+            if fcntl is None:
+                yield
+                return
+            with open(self._directory.joinpath(LOCK_FILE), "a") as lock_file:
+                fcntl.flock(lock_file, fcntl.LOCK_EX)
+                yield
+
+    def path(self, digest: str) -> pathlib.Path:
+        return self._directory.joinpath(digest[:2], digest)
+
+    def store(self, read: Callable[[int], bytes], size: int) -> BlobReference:
+        """
+        Writes size bytes returned by read (e.g. socket.recv) to the store, one chunk at a time.
+        """
+        digest = hashlib.sha256()
+        with tempfile.NamedTemporaryFile(dir=self._directory, delete=False) as blob:
+            try:
+                left = size
+                while left:
+                    chunk = read(min(left, CHUNK_SIZE))
+                    if not chunk:
+                        raise ConnectionError("Connection closed while receiving a blob")
+                    digest.update(chunk)
+                    blob.write(chunk)
+                    left -= len(chunk)
+                blob.flush()
+                os.fsync(blob.fileno())
+            except BaseException:
+                os.unlink(blob.name)
+                raise
+        reference = BlobReference(digest.hexdigest(), size)
+        path = self.path(reference.digest)
+        with self._locked():
+            if path.exists():
+                os.unlink(blob.name)
+            else:
+                path.parent.mkdir(exist_ok=True)
+                os.replace(blob.name, path)
+            self._pin(reference.digest)
+        return reference
+
+    def _pin_path(self, digest: str) -> pathlib.Path:
+        return self._pins_directory.joinpath(f"{os.getpid()}-{digest}")
+
+    def _pin(self, digest: str) -> None:
+        if digest not in self._pins:
+            os.link(self.path(digest), self._pin_path(digest))
+        self._pins[digest] = self._pins.get(digest, 0) + 1
+
+    def unpin(self, digest: str) -> None:
+        with self._locked():
+            self._pins[digest] -= 1
+            if not self._pins[digest]:
+                del self._pins[digest]
+                self._pin_path(digest).unlink()
+        self.release(digest)
+
+    def deliver(self, digest: str) -> StreamedContent:
+        """
+        Pins the blob for delivery - must be called before the message referencing it is deleted. Nothing is pinned
+        if this raises.
+        """
+        size = self.path(digest).stat().st_size
+        with self._locked():
+            self._pin(digest)
+        return _DeliveredBlob(self, digest, size)
+
+    def release(self, digest: str) -> None:
+        """
+        Deletes the blob unless it is pinned (by any process) or still referenced by a message.
+        """
+        path = self.path(digest)
+        with self._locked():
+            if digest in self._pins or self._is_referenced(digest):
+                return
+            try:
+                if path.stat().st_nlink > 1:
+                    return
+            except FileNotFoundError:
+                return
+            path.unlink()
+
+
+def clear_pins(directory: str) -> None:
+    """
+    Drops the pins left by processes of a previous run. Must be called before processes start sharing the store.
+    """
+    shutil.rmtree(pathlib.Path(directory).joinpath(PINS_DIRECTORY), ignore_errors=True)
@@ -1,13 +1,23 @@
 import uuid
 import sqlite3
 import datetime
-from typing import Tuple, List, Callable, Any
+import time
+import queue
+import logging
+import contextlib
+import threading
+from typing import Tuple, List, Callable, Any, Dict, Optional, Iterator, Union
+from dataclasses import dataclass
+from server_protocol import StreamedContent, MessageType
+from metrics import metrics
+from storage.blob_store import BlobStore, BlobReference
 from storage.storage_layer import StorageLayer, StorageLayerException
 
 
+SCHEMA_VERSION = 4
 CREATE_TABLES = [
     """CREATE TABLE IF NOT EXISTS client (
-    id VARCHAR(16) NOT NULL,
+    id BLOB(16) NOT NULL,
     name VARCHAR(250) NOT NULL,
     public_key VARBINARY(320) NOT NULL,
     last_seen TIMESTAMP DEFAULT CURRENT_TIMESTAMP,
@@ -15,24 +25,108 @@ CREATE_TABLES = [
 );""",
     """CREATE TABLE IF NOT EXISTS message (
     id INTEGER PRIMARY KEY AUTOINCREMENT NOT NULL ,
-    source VARCHAR(16) NOT NULL,
-    destination VARCHAR(16) NOT NULL,
+    source BLOB(16) NOT NULL,
+    destination BLOB(16) NOT NULL,
     type INT(1) NOT NULL,
     content BLOB NOT NULL,
+    blob VARCHAR(64),
+    created INTEGER NOT NULL DEFAULT 0,
+    fetched INTEGER NOT NULL DEFAULT 0,
     FOREIGN KEY(source) REFERENCES client(id),
     FOREIGN KEY(destination) REFERENCES client(id)
 );""",
+    """CREATE INDEX IF NOT EXISTS message_destination ON message (destination, id);""",
+    """CREATE INDEX IF NOT EXISTS message_expiry ON message (type, created);""",
 ]
+# The statements that upgrade a database from each schema version to the next one
+MIGRATIONS: Dict[int, List[str]] = {
+    # Version 0 keyed clients and messages by 32 character hex strings
+    0: [
+        """ALTER TABLE client RENAME TO hex_client;""",
+        """ALTER TABLE message RENAME TO hex_message;""",
+        """CREATE TABLE client (
+    id BLOB(16) NOT NULL,
+    name VARCHAR(250) NOT NULL,
+    public_key VARBINARY(320) NOT NULL,
+    last_seen TIMESTAMP DEFAULT CURRENT_TIMESTAMP,
+    PRIMARY KEY (id)
+);""",
+        """CREATE TABLE message (
+    id INTEGER PRIMARY KEY AUTOINCREMENT NOT NULL ,
+    source BLOB(16) NOT NULL,
+    destination BLOB(16) NOT NULL,
+    type INT(1) NOT NULL,
+    content BLOB NOT NULL,
+    FOREIGN KEY(source) REFERENCES client(id),
+    FOREIGN KEY(destination) REFERENCES client(id)
+);""",
+        """CREATE INDEX message_destination ON message (destination, id);""",
+        """INSERT INTO client (id, name, public_key, last_seen)
+    SELECT hex_to_blob(id), name, public_key, last_seen FROM hex_client ORDER BY rowid;""",
+        """INSERT INTO message (id, source, destination, type, content)
+    SELECT id, hex_to_blob(source), hex_to_blob(destination), type, content FROM hex_message;""",
+        """DELETE FROM sqlite_sequence WHERE name='message';""",
+        """UPDATE sqlite_sequence SET name='message' WHERE name='hex_message';""",
+        """DROP TABLE hex_message;""",
+        """DROP TABLE hex_client;""",
+    ],
+    # Version 2 keeps large message content in the blob store, referenced by its digest
+    1: ["""ALTER TABLE message ADD COLUMN blob VARCHAR(64);"""],
+    # Version 3 records when messages were created, so they can expire. Existing messages are considered new.
+    2: [
+        """ALTER TABLE message ADD COLUMN created INTEGER NOT NULL DEFAULT 0;""",
+        """UPDATE message SET created=CAST(strftime('%s', 'now') AS INTEGER);""",
+        """CREATE INDEX message_expiry ON message (type, created);""",
+    ],
+    # Version 4 marks fetched messages whose content is still being sent, they are deleted once it was
+    3: ["""ALTER TABLE message ADD COLUMN fetched INTEGER NOT NULL DEFAULT 0;"""],
+}
+SELECT_SCHEMA_VERSION = """PRAGMA user_version;"""
+SET_SCHEMA_VERSION = f"""PRAGMA user_version={SCHEMA_VERSION};"""
+SELECT_CLIENT_TABLE = """SELECT name FROM sqlite_master WHERE type='table' AND name='client';"""
 SELECT_USER_BY_ID = """SELECT * FROM client WHERE id=?;"""
 SELECT_USER_ID_LIST = """SELECT id FROM client WHERE id!=?;"""
+SELECT_USER_RECORDS = """SELECT rowid, id, name FROM client WHERE rowid>? ORDER BY rowid;"""
 INSERT_NEW_USER = """INSERT INTO client (id, name, public_key) VALUES (?,?,?);"""
-SELECT_UNREAD_MESSAGES = """SELECT * FROM message WHERE destination=?;"""
+# Content is cast so the size and chunks are counted in bytes even for content stored as text
+SELECT_UNREAD_MESSAGES = """SELECT id, source, type, length(CAST(content AS BLOB)), blob FROM message
+WHERE destination=? AND fetched=0 ORDER BY id;"""
+SELECT_CONTENT_CHUNK = """SELECT substr(CAST(content AS BLOB), ?, ?) FROM message WHERE id=?;"""
+MARK_MESSAGE_FETCHED = """UPDATE message SET fetched=1 WHERE id=?;"""
+DELETE_FETCHED_MESSAGES = """DELETE FROM message WHERE fetched=1;"""
 UPDATE_LAST_SEEN = """UPDATE client SET last_seen=? WHERE id=?;"""
 DELETE_MESSAGE = """DELETE FROM message WHERE id=?;"""
-INSERT_NEW_MESSAGE = (
-    """INSERT INTO message (source, destination, type, content) VALUES (?,?,?,?);"""
-)
+INSERT_NEW_MESSAGE = """INSERT INTO message (source, destination, type, content, blob, created)
+VALUES (?,?,?,?,?,?);"""
+SELECT_BLOB_REFERENCE = """SELECT 1 FROM message WHERE blob=? LIMIT 1;"""
+SELECT_EXPIRED_MESSAGES = """SELECT id, blob FROM message WHERE type=? AND created<? AND fetched=0 LIMIT ?;"""
+SELECT_AUTO_VACUUM = """PRAGMA auto_vacuum;"""
+ENABLE_INCREMENTAL_VACUUM = """PRAGMA auto_vacuum=INCREMENTAL;"""
+SELECT_FREE_PAGES = """PRAGMA freelist_count;"""
+SELECT_PAGE_SIZE = """PRAGMA page_size;"""
+AUTO_VACUUM_INCREMENTAL = 2
+SELECT_LAST_MESSAGE_ID = """SELECT seq FROM sqlite_sequence WHERE name='message';"""
+BEGIN_IMMEDIATE = """BEGIN IMMEDIATE;"""
+logger = logging.getLogger(__name__)
 DATE_FORMAT = "%Y-%m-%d %H:%M:%S"
+DEFAULT_LAST_SEEN_FLUSH_INTERVAL = 5.0
+MAX_MESSAGE_BATCH_SIZE = 1024
+CONTENT_CHUNK_SIZE = 64 * 1024
+DEFAULT_CONNECTION_POOL_SIZE = 8
+BUSY_TIMEOUT_SECONDS = 30.0
+MEMORY_CONNECTION_STRING = ":memory:"
+DAY_SECONDS = 24 * 60 * 60
+# Seconds an undelivered message of each type is kept, types that are not listed never expire. Unanswered key
+# requests go stale quickly.
+DEFAULT_MESSAGE_TTLS: Dict[int, float] = {
+    MessageType.SYMMETRIC_KEY_REQUEST.value: DAY_SECONDS,
+    MessageType.SYMMETRIC_KEY_RESPONSE.value: 30 * DAY_SECONDS,
+    MessageType.TEXT_MESSAGE.value: 30 * DAY_SECONDS,
+}
+DEFAULT_EXPIRY_INTERVAL = 60.0
+EXPIRY_BATCH_SIZE = 500
+VACUUM_PAGES_PER_STEP = 256
+INCREMENTAL_VACUUM = f"""PRAGMA incremental_vacuum({VACUUM_PAGES_PER_STEP});"""
 
 
 def safe_sql_call(func: Callable[..., Any]) -> Callable[..., Any]:
@@ -47,86 +141,544 @@ def safe_sql_call(func: Callable[..., Any]) -> Callable[..., Any]:
     return _wrapper
 
 
+class _ConnectionPool:
+    """
+    A bounded pool of connections to one database, created on demand. Connections are not bound to threads, since
+    the server starts a new thread for every client connection.
+    """
+
+    def __init__(self, connection_string: str, size: int) -> None:
+        self._connection_string = connection_string
+        self._size = size
+        self._created = 0
+        self._created_lock = threading.Lock()
+        self._idle: "queue.LifoQueue[sqlite3.Connection]" = queue.LifoQueue()
+        self._all: List[sqlite3.Connection] = []
+
+    def _connect(self) -> sqlite3.Connection:
+        connection = sqlite3.connect(
+            self._connection_string,
+            timeout=BUSY_TIMEOUT_SECONDS,
+            check_same_thread=False,
+        )
+        if self._connection_string != MEMORY_CONNECTION_STRING:
+            # WAL lets readers run alongside the single writer instead of waiting for its commit
+            connection.execute("PRAGMA journal_mode=WAL;")
+        return connection
+
+    @contextlib.contextmanager
+    def connection(self) -> Iterator[sqlite3.Connection]:
+        try:
+            connection = self._idle.get_nowait()
+        except queue.Empty:
+            with self._created_lock:
+                can_create = self._created < self._size
+                if can_create:
+                    self._created += 1
+            if can_create:
+                connection = self._connect()
+                with self._created_lock:
+                    self._all.append(connection)
+            else:
+                connection = self._idle.get()
+        try:
+            yield connection
+        finally:
+            self._idle.put(connection)
+
+    def close(self) -> None:
+        with self._created_lock:
+            for connection in self._all:
+                connection.close()
+            self._all.clear()
+
+
+@dataclass
+class ExpiryMetrics:
+    rows_expired: int = 0
+    bytes_reclaimed: int = 0
+
+
+class _PendingMessage:
+    """
+    Messages from one sender waiting in the write queue, which are committed together. The writer thread sets
+    message_ids (or error) and then done.
+    """
+
+    def __init__(self, sender, messages: List[Tuple[Any, Any, Any]]) -> None:
+        self.rows: List[Tuple[Any, ...]] = [
+            (sender, receiver, message_type, content)
+            for receiver, message_type, content in messages
+        ]
+        self.done = threading.Event()
+        self.message_ids: List[int] = []
+        self.error: Optional[Exception] = None
+
+
+class _StoredContent(StreamedContent):
+    """
+    The content of a fetched message kept in the database, read one chunk at a time while it is sent. The message is
+    deleted once the content was read to the end or closed, whichever comes first.
+    """
+
+    def __init__(self, storage: "DBStorage", message_id: int, size: int) -> None:
+        self._storage = storage
+        self._message_id = message_id
+        self._size = size
+        self._open = True
+        self._open_lock = threading.Lock()
+
+    @property
+    def size(self) -> int:
+        return self._size
+
+    def chunks(self) -> Iterator[bytes]:
+        try:
+            for offset in range(0, self._size, CONTENT_CHUNK_SIZE):
+                yield self._storage._read_content_chunk(
+                    self._message_id, offset, min(CONTENT_CHUNK_SIZE, self._size - offset)
+                )
+        finally:
+            self.close()
+
+    def close(self) -> None:
+        with self._open_lock:
+            if not self._open:
+                return
+            self._open = False
+        self._storage._delete_fetched(self._message_id)
+
+
 class DBStorage(StorageLayer):
-    def __init__(self, connection_string: str = ":memory:"):
-        self.connection = sqlite3.connect(connection_string, check_same_thread=False)
+    def __init__(
+        self,
+        connection_string: str = ":memory:",
+        last_seen_flush_interval: float = DEFAULT_LAST_SEEN_FLUSH_INTERVAL,
+        connection_pool_size: int = DEFAULT_CONNECTION_POOL_SIZE,
+        blobs_directory: Optional[str] = None,
+        message_ttls: Optional[Dict[int, float]] = None,
+        expiry_interval: Optional[float] = DEFAULT_EXPIRY_INTERVAL,
+        shared: bool = False,
+    ):
+        """
+        :param expiry_interval: seconds between expiry runs, None to never expire messages
+        :param shared: whether other processes use the same database and blob store
+        """
+        if connection_string == MEMORY_CONNECTION_STRING:
+            # Every connection to :memory: opens a new empty database, so an in-memory storage uses one connection
+            connection_pool_size = 1
+        self._pool = _ConnectionPool(connection_string, connection_pool_size)
+        # SQLite allows a single writer at a time, taking this lock first avoids busy waiting inside SQLite
+        self._write_lock = threading.Lock()
         self._create_tables()
+        self._blob_store: Optional[BlobStore] = None
+        if blobs_directory is not None:
+            self._blob_store = BlobStore(
+                blobs_directory, self._is_blob_referenced, shared=shared
+            )
+        if not shared:
+            # Fetched by a previous run, which never finished sending them
+            self._delete_fetched_messages()
+        self._pending_last_seen: Dict[bytes, str] = {}
+        self._pending_last_seen_lock = threading.Lock()
+        # Fetched messages whose content was sent, deleted together by flush_last_seen
+        self._pending_deletes: List[int] = []
+        self._pending_deletes_lock = threading.Lock()
+        self._last_seen_flush_interval = last_seen_flush_interval
+        self._closed = threading.Event()
+        self._last_seen_flusher = threading.Thread(
+            target=self._flush_last_seen_periodically, daemon=True
+        )
+        self._last_seen_flusher.start()
+        self._message_queue: "queue.Queue[Optional[_PendingMessage]]" = queue.Queue()
+        self._message_writer = threading.Thread(
+            target=self._write_messages, daemon=True
+        )
+        self._message_writer.start()
+        self._message_ttls = DEFAULT_MESSAGE_TTLS if message_ttls is None else message_ttls
+        self._expiry_interval = expiry_interval
+        self._expiry_metrics = ExpiryMetrics()
+        self._expiry_metrics_lock = threading.Lock()
+        self._expirer = threading.Thread(target=self._expire_periodically, daemon=True)
+        if expiry_interval is not None:
+            self._expirer.start()
+        metrics.register_gauges(
+            {
+                "db_write_queue_depth": self._message_queue.qsize,
+                "db_pending_last_seen": lambda: len(self._pending_last_seen),
+                "expiry_rows_expired": lambda: self.expiry_metrics.rows_expired,
+                "expiry_bytes_reclaimed": lambda: self.expiry_metrics.bytes_reclaimed,
+            }
+        )
 
     def close_connection(self):
-        self.connection.close()
+        metrics.unregister_gauges(
+            [
+                "db_write_queue_depth",
+                "db_pending_last_seen",
+                "expiry_rows_expired",
+                "expiry_bytes_reclaimed",
+            ]
+        )
+        self._message_queue.put(None)
+        self._message_writer.join()
+        self._closed.set()
+        self._last_seen_flusher.join()
+        if self._expirer.is_alive():
+            self._expirer.join()
+        self.flush_last_seen()
+        self._pool.close()
 
     @safe_sql_call
     def _create_tables(self) -> None:
-        with self.connection:
-            self.connection.executescript("\n".join(CREATE_TABLES))
+        with self._write_lock, self._pool.connection() as connection:
+            (schema_version,) = connection.execute(SELECT_SCHEMA_VERSION).fetchone()
+            if schema_version == SCHEMA_VERSION:
+                return
+            if connection.execute(SELECT_CLIENT_TABLE).fetchone() is None:
+                # Must be set before the first table is created
+                connection.execute(ENABLE_INCREMENTAL_VACUUM)
+                statements = CREATE_TABLES
+            else:
+                logger.info(f"Migrating database from schema version {schema_version}")
+                statements = [
+                    statement
+                    for version in range(schema_version, SCHEMA_VERSION)
+                    for statement in MIGRATIONS[version]
+                ]
+            connection.create_function("hex_to_blob", 1, bytes.fromhex)
+            try:
+                connection.execute("BEGIN;")
+                for statement in statements:
+                    connection.execute(statement)
+                connection.execute(SET_SCHEMA_VERSION)
+                connection.commit()
+            except sqlite3.Error:
+                connection.rollback()
+                raise
+            (auto_vacuum,) = connection.execute(SELECT_AUTO_VACUUM).fetchone()
+            if auto_vacuum != AUTO_VACUUM_INCREMENTAL:
+                logger.info("Rebuilding database to enable incremental vacuum")
+                connection.execute(ENABLE_INCREMENTAL_VACUUM)
+                connection.execute("VACUUM;")
 
+    @metrics.timed("db_get_user_by_id")
     @safe_sql_call
     def get_user_by_id(
-        self, identifier: str
-    ) -> Tuple[uuid.UUID, str, str, datetime.datetime]:
-        identifier = identifier.replace("-", "")
-        with self.connection:
-            for user in self.connection.execute(SELECT_USER_BY_ID, (identifier,)):
+        self, identifier: bytes
+    ) -> Tuple[bytes, str, str, datetime.datetime]:
+        with self._pool.connection() as connection:
+            for user in connection.execute(SELECT_USER_BY_ID, (identifier,)):
                 return (
-                    uuid.UUID(hex=user[0]),
+                    user[0],
                     user[1],
                     user[2],
                     datetime.datetime.strptime(user[3], DATE_FORMAT),
                 )
-        raise StorageLayerException(f"User {identifier} not found!")
+        raise StorageLayerException(f"User {identifier.hex()} not found!")
 
     @safe_sql_call
-    def check_if_user_exists(self, identifier: str) -> bool:
-        identifier = identifier.replace("-", "")
+    def check_if_user_exists(self, identifier: bytes) -> bool:
         try:
             self.get_user_by_id(identifier)
             return True
         except StorageLayerException:
             return False
 
-    def _generate_available_user_id(self) -> str:
-        identifier = str(uuid.uuid4())
+    def _generate_available_user_id(self) -> bytes:
+        identifier = uuid.uuid4().bytes
         while self.check_if_user_exists(identifier):
-            identifier = str(uuid.uuid4())
-        return str(identifier).replace("-", "")
+            identifier = uuid.uuid4().bytes
+        return identifier
 
+    @metrics.timed("db_create_new_user")
     @safe_sql_call
-    def create_new_user(self, name: str, public_key: str) -> str:
-        identifier = self._generate_available_user_id()
-        with self.connection:
-            self.connection.execute(INSERT_NEW_USER, (identifier, name, public_key))
+    def create_new_user(self, name: str, public_key: str) -> bytes:
+        with self._write_lock:
+            identifier = self._generate_available_user_id()
+            with self._pool.connection() as connection, connection:
+                connection.execute(INSERT_NEW_USER, (identifier, name, public_key))
         return identifier
 
+    @metrics.timed("db_get_user_id_list")
     @safe_sql_call
-    def get_user_id_list(self, id_to_ignore: str) -> List[str]:
-        id_to_ignore = id_to_ignore.replace("-", "")
-        with self.connection:
+    def get_user_id_list(self, id_to_ignore: bytes) -> List[bytes]:
+        with self._pool.connection() as connection:
             return [
                 line[0]
-                for line in self.connection.execute(SELECT_USER_ID_LIST, (id_to_ignore,))
+                for line in connection.execute(SELECT_USER_ID_LIST, (id_to_ignore,))
             ]
 
+    @metrics.timed("db_get_user_records")
     @safe_sql_call
-    def send_message(self, sender, receiver, message_type, content) -> str:
-        cursor = self.connection.cursor()
-        cursor.execute(INSERT_NEW_MESSAGE, (sender, receiver, message_type, content))
-        new_message = cursor.lastrowid
-        cursor.close()
-        return new_message
+    def get_user_records(self, after_row: int = 0) -> List[Tuple[int, bytes, str]]:
+        with self._pool.connection() as connection:
+            return list(connection.execute(SELECT_USER_RECORDS, (after_row,)))
 
+    @property
+    def blob_store(self) -> Optional[BlobStore]:
+        return self._blob_store
+
+    @safe_sql_call
+    def _is_blob_referenced(self, digest: str) -> bool:
+        with self._pool.connection() as connection:
+            return connection.execute(SELECT_BLOB_REFERENCE, (digest,)).fetchone() is not None
+
+    def send_message(self, sender, receiver, message_type, content) -> int:
+        return self.send_messages(sender, [(receiver, message_type, content)])[0]
+
+    @metrics.timed("db_send_messages")
+    def send_messages(self, sender, messages) -> List[int]:
+        """
+        Queues the messages for the writer thread and blocks until the batch containing them is committed.
+        """
+        if not messages:
+            return []
+        pending = _PendingMessage(sender, messages)
+        self._message_queue.put(pending)
+        pending.done.wait()
+        if pending.error is not None:
+            raise StorageLayerException(
+                f"Caught an exception while executing query: {pending.error}"
+            )
+        return pending.message_ids
+
+    def _write_messages(self) -> None:
+        while (pending := self._message_queue.get()) is not None:
+            batch = [pending]
+            batch_size = len(pending.rows)
+            try:
+                while batch_size < MAX_MESSAGE_BATCH_SIZE:
+                    pending = self._message_queue.get_nowait()
+                    if pending is None:
+                        self._message_queue.put(None)
+                        break
+                    batch.append(pending)
+                    batch_size += len(pending.rows)
+            except queue.Empty:
+                pass
+            try:
+                self._insert_message_batch(batch)
+            except Exception as e:
+                # The writer thread must outlive any batch, and no sender may be left waiting on a batch
+                logger.exception("Message writer failed")
+                for pending in batch:
+                    pending.error = e
+                    pending.done.set()
+
+    @metrics.timed("db_insert_message_batch")
+    def _insert_message_batch(self, batch: List[_PendingMessage]) -> None:
+        rows = [row for pending in batch for row in pending.rows]
+        metrics.increment("db_messages_written", len(rows))
+        try:
+            with self._write_lock, self._pool.connection() as connection:
+                with connection:
+                    connection.executemany(
+                        INSERT_NEW_MESSAGE, [self._message_row(*row) for row in rows]
+                    )
+                    # Writes are serialized by the write lock, so the batch got consecutive ids ending at the new
+                    # sequence
+                    (last_id,) = connection.execute(SELECT_LAST_MESSAGE_ID).fetchone()
+            message_id = last_id - len(rows)
+            for pending in batch:
+                pending.message_ids = list(
+                    range(message_id + 1, message_id + 1 + len(pending.rows))
+                )
+                message_id += len(pending.rows)
+        except Exception as e:
+            if not isinstance(e, sqlite3.Error):
+                logger.exception("Could not write a message batch")
+            for pending in batch:
+                pending.message_ids = []
+                pending.error = e
+        finally:
+            for pending in batch:
+                pending.done.set()
+
+    @staticmethod
+    def _message_row(
+        sender, receiver, message_type, content: Union[bytes, BlobReference]
+    ) -> Tuple[Any, ...]:
+        if isinstance(content, BlobReference):
+            return sender, receiver, message_type, b"", content.digest, int(time.time())
+        return sender, receiver, message_type, content, None, int(time.time())
+
+    @metrics.timed("db_get_message_list_for_user")
     @safe_sql_call
     def get_message_list_for_user(
-        self, identifier: str
-    ) -> List[Tuple[str, str, str, int, bytes]]:
-        identifier = identifier.replace("-", "")
-        messages = []
-        with self.connection:
-            for row in self.connection.execute(SELECT_UNREAD_MESSAGES, (identifier,)):
-                messages.append(row)
-                self.connection.execute(DELETE_MESSAGE, (row[0],))
-        return messages
+        self, identifier: bytes
+    ) -> List[Tuple[int, bytes, bytes, int, Union[bytes, StreamedContent]]]:
+        """
+        Takes the messages of the user without loading their contents: messages in the blob store are pinned and deleted,
+        the others are marked fetched, and their content is read from the database while it is sent.
+        """
+        delivered_blobs: Dict[int, StreamedContent] = {}
+        try:
+            with self._write_lock, self._pool.connection() as connection:
+                with connection:
+                    # Other server processes may write between the select and the delete, so the transaction takes the
+                    # database write lock up front
+                    connection.execute(BEGIN_IMMEDIATE)
+                    rows = connection.execute(
+                        SELECT_UNREAD_MESSAGES, (identifier,)
+                    ).fetchall()
+                    for message_id, _, _, _, blob in rows:
+                        if blob is not None:
+                            delivered_blobs[message_id] = self._deliver_blob(blob)
+                    connection.executemany(
+                        DELETE_MESSAGE, [(message_id,) for message_id in delivered_blobs]
+                    )
+                    connection.executemany(
+                        MARK_MESSAGE_FETCHED,
+                        [(row[0],) for row in rows if row[0] not in delivered_blobs],
+                    )
+        except BaseException:
+            # The messages were rolled back, the blobs pinned for them so far are not delivered
+            for content in delivered_blobs.values():
+                content.close()
+            raise
+        # Only created once the messages are committed as fetched, since closing the content deletes the message
+        return [
+            (
+                message_id,
+                source,
+                identifier,
+                message_type,
+                delivered_blobs[message_id]
+                if message_id in delivered_blobs
+                else _StoredContent(self, message_id, content_size),
+            )
+            for message_id, source, message_type, content_size, _ in rows
+        ]
+
+    @safe_sql_call
+    def _read_content_chunk(self, message_id: int, offset: int, size: int) -> bytes:
+        with self._pool.connection() as connection:
+            row = connection.execute(
+                SELECT_CONTENT_CHUNK, (offset + 1, size, message_id)
+            ).fetchone()
+        if row is None or len(row[0]) != size:
+            raise StorageLayerException(f"Content of message {message_id} is gone")
+        return row[0]
+
+    def _delete_fetched(self, message_id: int) -> None:
+        with self._pending_deletes_lock:
+            self._pending_deletes.append(message_id)
+
+    @safe_sql_call
+    def _delete_fetched_messages(self) -> None:
+        with self._write_lock, self._pool.connection() as connection, connection:
+            connection.execute(DELETE_FETCHED_MESSAGES)
+
+    def _deliver_blob(self, digest: str) -> StreamedContent:
+        if self._blob_store is None:
+            raise StorageLayerException(f"Message references blob {digest} but there is no blob store")
+        return self._blob_store.deliver(digest)
 
     def update_user_last_seen(self, user_id) -> None:
+        """
+        Records the time in memory only - pending updates are written together by flush_last_seen, which runs every
+        last_seen_flush_interval seconds and when the connection is closed.
+        """
         last_seen = datetime.datetime.now().strftime(DATE_FORMAT)
-        with self.connection:
-            self.connection.execute(UPDATE_LAST_SEEN, (last_seen, user_id))
+        with self._pending_last_seen_lock:
+            self._pending_last_seen[user_id] = last_seen
+
+    @metrics.timed("db_flush_last_seen")
+    @safe_sql_call
+    def flush_last_seen(self) -> None:
+        """
+        Writes the pending last seen times, and deletes the fetched messages whose content was sent meanwhile.
+        """
+        with self._pending_last_seen_lock:
+            pending, self._pending_last_seen = self._pending_last_seen, {}
+        with self._pending_deletes_lock:
+            deletes, self._pending_deletes = self._pending_deletes, []
+        if not pending and not deletes:
+            return
+        with self._write_lock, self._pool.connection() as connection:
+            with connection:
+                connection.executemany(
+                    UPDATE_LAST_SEEN,
+                    [(last_seen, user_id) for user_id, last_seen in pending.items()],
+                )
+                connection.executemany(
+                    DELETE_MESSAGE, [(message_id,) for message_id in deletes]
+                )
+
+    def _flush_last_seen_periodically(self) -> None:
+        while not self._closed.wait(self._last_seen_flush_interval):
+            try:
+                self.flush_last_seen()
+            except StorageLayerException:
+                logger.exception("Could not flush last seen times")
+
+    @property
+    def expiry_metrics(self) -> ExpiryMetrics:
+        with self._expiry_metrics_lock:
+            return ExpiryMetrics(
+                self._expiry_metrics.rows_expired, self._expiry_metrics.bytes_reclaimed
+            )
+
+    @metrics.timed("db_expire_batch")
+    @safe_sql_call
+    def _expire_batch(self, message_type: int, created_before: float) -> int:
+        with self._write_lock, self._pool.connection() as connection:
+            with connection:
+                connection.execute(BEGIN_IMMEDIATE)
+                expired = connection.execute(
+                    SELECT_EXPIRED_MESSAGES,
+                    (message_type, created_before, EXPIRY_BATCH_SIZE),
+                ).fetchall()
+                connection.executemany(
+                    DELETE_MESSAGE, [(message_id,) for message_id, _ in expired]
+                )
+        if self._blob_store is not None:
+            for digest in {blob for _, blob in expired if blob is not None}:
+                self._blob_store.release(digest)
+        return len(expired)
+
+    @metrics.timed("db_vacuum_free_pages")
+    @safe_sql_call
+    def _vacuum_free_pages(self) -> int:
+        reclaimed = 0
+        while True:
+            with self._write_lock, self._pool.connection() as connection:
+                (free_pages,) = connection.execute(SELECT_FREE_PAGES).fetchone()
+                if not free_pages:
+                    return reclaimed
+                (page_size,) = connection.execute(SELECT_PAGE_SIZE).fetchone()
+                connection.execute(INCREMENTAL_VACUUM).fetchall()
+                (pages_left,) = connection.execute(SELECT_FREE_PAGES).fetchone()
+            reclaimed += (free_pages - pages_left) * page_size
+            if pages_left >= free_pages:
+                return reclaimed
+
+    def expire_messages(self) -> None:
+        """
+        Deletes messages older than their type's TTL and returns the freed pages to the file system. Every batch of
+        EXPIRY_BATCH_SIZE messages and VACUUM_PAGES_PER_STEP pages is a separate write, so requests are not blocked
+        for long.
+        """
+        now = time.time()
+        rows_expired = 0
+        for message_type, ttl in self._message_ttls.items():
+            while expired := self._expire_batch(message_type, now - ttl):
+                rows_expired += expired
+                if expired < EXPIRY_BATCH_SIZE:
+                    break
+        bytes_reclaimed = self._vacuum_free_pages()
+        with self._expiry_metrics_lock:
+            self._expiry_metrics.rows_expired += rows_expired
+            self._expiry_metrics.bytes_reclaimed += bytes_reclaimed
+        if rows_expired or bytes_reclaimed:
+            logger.info(
+                f"Expired {rows_expired} messages, reclaimed {bytes_reclaimed} bytes"
+            )
+
+    def _expire_periodically(self) -> None:
+        while not self._closed.wait(self._expiry_interval):
+            try:
+                self.expire_messages()
+            except StorageLayerException:
+                logger.exception("Could not expire messages")
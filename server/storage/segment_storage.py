@@ -0,0 +1,367 @@
+import os
+import mmap
+import struct
+import pathlib
+import logging
+import threading
+import contextlib
+from typing import Dict, List, Set, Tuple
+from metrics import metrics
+from storage.database_storage import DBStorage, _PendingMessage
+from storage.storage_layer import StorageLayerException
+
+
+logger = logging.getLogger(__name__)
+RECORD_HEADER = struct.Struct("<Q16sBI")
+OFFSET_FORMAT = struct.Struct("<Q")
+# The consumed offset and the generation of the segment it points into
+INDEX_FORMAT = struct.Struct("<QQ")
+SEGMENT_SUFFIX = ".log"
+INDEX_SUFFIX = ".idx"
+TEMPORARY_SUFFIX = ".tmp"
+SEQUENCE_FILENAME = "sequence"
+# Consumed offsets are persisted by the compactor, so a crash delivers the messages fetched in the last interval again
+DEFAULT_COMPACTION_INTERVAL = 1.0
+DEFAULT_COMPACTION_THRESHOLD = 1024 * 1024
+
+
+def _fsync_directory(directory: pathlib.Path) -> None:
+    """Makes a rename in the directory durable. Directories cannot be opened on Windows, where renames are journaled."""
+    if os.name != "posix":
+        return
+    descriptor = os.open(directory, os.O_RDONLY)
+    try:
+        os.fsync(descriptor)
+    finally:
+        os.close(descriptor)
+
+
+class _Queue:
+    """
+    The message queue of a single recipient: an append-only segment file and an index file holding the offset of the
+    first record that was not fetched yet. Fetching only advances the offset in memory; the compactor writes it to the
+    index. Compaction writes the remaining records to a segment of the next generation, and the index names the
+    generation its offset belongs to, so replacing the index switches both at once.
+    """
+
+    def __init__(self, directory: pathlib.Path, recipient: bytes, recover: bool) -> None:
+        self.lock = threading.Lock()
+        self.directory = directory
+        self.name = recipient.hex()
+        self.index_path = directory.joinpath(self.name + INDEX_SUFFIX)
+        self.consumed = 0
+        self.generation = 0
+        # The offset in the index file, so unchanged offsets are not written again
+        self.persisted_consumed = 0
+        # Set once the compactor dropped the queue, which must then be looked up again
+        self.removed = False
+        if self.index_path.exists():
+            index = self.index_path.read_bytes()
+            if len(index) == OFFSET_FORMAT.size:
+                # Written before indexes had a generation
+                (self.consumed,) = OFFSET_FORMAT.unpack(index)
+            else:
+                self.consumed, self.generation = INDEX_FORMAT.unpack(index)
+            self.persisted_consumed = self.consumed
+        self.segment_path = self._segment_path(self.generation)
+        if recover:
+            self._remove_stale_segments()
+            self._reset_stale_index()
+            self._truncate_torn_record()
+
+    def _segment_path(self, generation: int) -> pathlib.Path:
+        if generation == 0:
+            return self.directory.joinpath(self.name + SEGMENT_SUFFIX)
+        return self.directory.joinpath(f"{self.name}.{generation}{SEGMENT_SUFFIX}")
+
+    def _remove_stale_segments(self) -> None:
+        """Removes the segments of other generations, left behind by a crash in the middle of a compaction."""
+        for path in self.directory.glob(self.name + "*" + SEGMENT_SUFFIX):
+            if path != self.segment_path:
+                path.unlink(missing_ok=True)
+
+    def _reset_stale_index(self) -> None:
+        """
+        Rewinds an index left behind by a crash while its fully consumed queue was dropped. The index is rewritten
+        right away, or records appended later would be skipped by the next restart.
+        """
+        if self.consumed > self.segment_size():
+            self.write_index(0, self.generation)
+            _fsync_directory(self.directory)
+
+    def _truncate_torn_record(self) -> None:
+        """Drops a record that a crash left half written at the end of the segment."""
+        size = self.segment_size()
+        offset = self.consumed
+        if size <= offset:
+            return
+        with open(self.segment_path, "rb") as segment:
+            while offset + RECORD_HEADER.size <= size:
+                segment.seek(offset)
+                content_size = RECORD_HEADER.unpack(segment.read(RECORD_HEADER.size))[3]
+                if offset + RECORD_HEADER.size + content_size > size:
+                    break
+                offset += RECORD_HEADER.size + content_size
+        if offset < size:
+            logger.warning(f"Dropping a torn record at offset {offset} of {self.segment_path}")
+            os.truncate(self.segment_path, offset)
+
+    def segment_size(self) -> int:
+        try:
+            return self.segment_path.stat().st_size
+        except FileNotFoundError:
+            return 0
+
+    def write_index(self, consumed: int, generation: int) -> None:
+        """
+        Replaces the index with a synced file, moving the queue to the segment of generation. The rename is durable
+        only once the caller syncs the directory.
+        """
+        temporary_path = self.index_path.with_suffix(INDEX_SUFFIX + TEMPORARY_SUFFIX)
+        with open(temporary_path, "wb") as index:
+            index.write(INDEX_FORMAT.pack(consumed, generation))
+            index.flush()
+            os.fsync(index.fileno())
+        os.replace(temporary_path, self.index_path)
+        self.consumed = consumed
+        self.persisted_consumed = consumed
+        if generation != self.generation:
+            self.generation = generation
+            self.segment_path = self._segment_path(generation)
+
+    def remove_files(self) -> None:
+        """Removes the segment before the index, so a crash in between leaves an index that is reset on restart."""
+        self.segment_path.unlink(missing_ok=True)
+        self.index_path.unlink(missing_ok=True)
+
+
+class SegmentStorage(DBStorage):
+    """
+    Keeps users in SQLite like DBStorage, but stores messages in one append-only segment file per recipient.
+    Fetching reads the unread tail of the segment through mmap and deletes it by advancing the recipient's consumed
+    offset in memory. Every compaction_interval a background thread writes the changed offsets to the indexes with a
+    single directory sync, rewrites segments whose consumed part grew past compaction_threshold, and drops the queues
+    and files of recipients that fetched everything. A crash can deliver the messages fetched since then again.
+    """
+
+    def __init__(
+        self,
+        connection_string: str,
+        messages_directory: str,
+        compaction_interval: float = DEFAULT_COMPACTION_INTERVAL,
+        compaction_threshold: int = DEFAULT_COMPACTION_THRESHOLD,
+        **kwargs,
+    ):
+        self._directory = pathlib.Path(messages_directory)
+        self._directory.mkdir(parents=True, exist_ok=True)
+        self._queues: Dict[bytes, _Queue] = {}
+        # Queues with files from before the start, which are checked for crash leftovers when they are first used
+        self._unrecovered = self._scan_directory()
+        self._queues_lock = threading.Lock()
+        self._sequence_path = self._directory.joinpath(SEQUENCE_FILENAME)
+        self._last_message_id = 0
+        if self._sequence_path.exists():
+            (self._last_message_id,) = OFFSET_FORMAT.unpack(
+                self._sequence_path.read_bytes()
+            )
+        self._compaction_interval = compaction_interval
+        self._compaction_threshold = compaction_threshold
+        self._compaction_stopped = threading.Event()
+        self._compactor = threading.Thread(target=self._compact_periodically, daemon=True)
+        super().__init__(connection_string, **kwargs)
+        self._compactor.start()
+
+    def close_connection(self):
+        super().close_connection()
+        self._compaction_stopped.set()
+        self._compactor.join()
+        # Persists the offsets fetched since the last pass
+        self.compact()
+
+    def _scan_directory(self) -> Set[str]:
+        names = set()
+        for path in self._directory.iterdir():
+            if path.name.endswith(TEMPORARY_SUFFIX):
+                path.unlink(missing_ok=True)
+            elif path.name.endswith((SEGMENT_SUFFIX, INDEX_SUFFIX)):
+                names.add(path.name.split(".")[0])
+        return names
+
+    def _get_queue(self, recipient: bytes) -> _Queue:
+        with self._queues_lock:
+            if recipient not in self._queues:
+                name = recipient.hex()
+                self._queues[recipient] = _Queue(
+                    self._directory, recipient, name in self._unrecovered
+                )
+                self._unrecovered.discard(name)
+            return self._queues[recipient]
+
+    def _lock_queue(self, recipient: bytes) -> _Queue:
+        """Returns the locked queue of recipient, looking it up again if the compactor dropped it in the meantime."""
+        while True:
+            queue = self._get_queue(recipient)
+            queue.lock.acquire()
+            if not queue.removed:
+                return queue
+            queue.lock.release()
+
+    @metrics.timed("db_insert_message_batch")
+    def _insert_message_batch(self, batch: List[_PendingMessage]) -> None:
+        """
+        Runs on the DBStorage writer thread, so message ids are assigned by a single thread. Every segment touched by
+        the batch is synced once. If writing fails, the segments are truncated back to their sizes before the batch, and
+        the locks of their queues are held until then, so no fetch sees a part of a failed batch.
+        """
+        # Headers and contents are written as separate buffers, so large contents are not copied
+        records: Dict[bytes, List[bytes]] = {}
+        metrics.increment(
+            "db_messages_written", sum(len(pending.rows) for pending in batch)
+        )
+        last_message_id = self._last_message_id
+        sizes: Dict[_Queue, int] = {}
+        try:
+            for pending in batch:
+                for sender, receiver, message_type, content in pending.rows:
+                    self._last_message_id += 1
+                    pending.message_ids.append(self._last_message_id)
+                    records.setdefault(receiver, []).extend(
+                        (
+                            RECORD_HEADER.pack(
+                                self._last_message_id, sender, message_type, len(content)
+                            ),
+                            content,
+                        )
+                    )
+            with contextlib.ExitStack() as locks:
+                try:
+                    for receiver, receiver_records in records.items():
+                        queue = self._lock_queue(receiver)
+                        locks.callback(queue.lock.release)
+                        sizes[queue] = queue.segment_size()
+                        with open(queue.segment_path, "ab") as segment:
+                            segment.writelines(receiver_records)
+                            segment.flush()
+                            os.fsync(segment.fileno())
+                    self._sequence_path.write_bytes(
+                        OFFSET_FORMAT.pack(self._last_message_id)
+                    )
+                except Exception:
+                    self._truncate_segments(sizes)
+                    raise
+        except Exception as e:
+            if not isinstance(e, OSError):
+                logger.exception("Could not write a message batch")
+            self._last_message_id = last_message_id
+            for pending in batch:
+                pending.message_ids.clear()
+                pending.error = e
+        finally:
+            for pending in batch:
+                pending.done.set()
+
+    @staticmethod
+    def _truncate_segments(sizes: Dict[_Queue, int]) -> None:
+        for queue, size in sizes.items():
+            try:
+                if queue.segment_size() > size:
+                    os.truncate(queue.segment_path, size)
+            except OSError:
+                logger.exception(f"Could not truncate {queue.segment_path} back to {size} bytes")
+
+    @metrics.timed("db_get_message_list_for_user")
+    def get_message_list_for_user(
+        self, identifier: bytes
+    ) -> List[Tuple[int, bytes, bytes, int, bytes]]:
+        messages: List[Tuple[int, bytes, bytes, int, bytes]] = []
+        try:
+            queue = self._lock_queue(identifier)
+            try:
+                size = queue.segment_size()
+                if size <= queue.consumed:
+                    return messages
+                with open(queue.segment_path, "rb") as segment, mmap.mmap(
+                    segment.fileno(), size, access=mmap.ACCESS_READ
+                ) as view:
+                    offset = queue.consumed
+                    while offset < size:
+                        message_id, source, message_type, content_size = (
+                            RECORD_HEADER.unpack_from(view, offset)
+                        )
+                        offset += RECORD_HEADER.size
+                        messages.append(
+                            (
+                                message_id,
+                                source,
+                                identifier,
+                                message_type,
+                                view[offset : offset + content_size],
+                            )
+                        )
+                        offset += content_size
+                queue.consumed = size
+            finally:
+                queue.lock.release()
+        except (OSError, struct.error) as e:
+            raise StorageLayerException(f"Could not read messages: {e}")
+        return messages
+
+    def _compact(
+        self, recipient: bytes, queue: _Queue, replaced: List[pathlib.Path]
+    ) -> bool:
+        """
+        Drops the queue if everything was fetched, rewrites its segment if the consumed part grew past the threshold,
+        or else writes its consumed offset if it changed. Returns whether the index was replaced; the segment replaced by
+        a compaction is added to replaced, to be removed once the directory is synced.
+        """
+        size = queue.segment_size()
+        if queue.consumed >= size:
+            queue.remove_files()
+            with self._queues_lock:
+                del self._queues[recipient]
+            queue.removed = True
+            return False
+        if queue.consumed >= self._compaction_threshold:
+            compacted_generation = queue.generation + 1
+            compacted_path = queue._segment_path(compacted_generation)
+            with open(queue.segment_path, "rb") as segment, open(
+                compacted_path, "wb"
+            ) as compacted:
+                segment.seek(queue.consumed)
+                while chunk := segment.read(mmap.PAGESIZE * 16):
+                    compacted.write(chunk)
+                compacted.flush()
+                os.fsync(compacted.fileno())
+            # Until the index names the new generation, a restart keeps using the old segment and removes the new one
+            old_segment_path = queue.segment_path
+            queue.write_index(0, compacted_generation)
+            replaced.append(old_segment_path)
+            return True
+        if queue.consumed != queue.persisted_consumed:
+            queue.write_index(queue.consumed, queue.generation)
+            return True
+        return False
+
+    def compact(self) -> None:
+        with self._queues_lock:
+            queues = list(self._queues.items())
+        replaced: List[pathlib.Path] = []
+        synced = True
+        for recipient, queue in queues:
+            try:
+                with queue.lock:
+                    if not queue.removed and self._compact(recipient, queue, replaced):
+                        synced = False
+            except OSError:
+                logger.exception(f"Could not compact {queue.segment_path}")
+        try:
+            if not synced:
+                _fsync_directory(self._directory)
+            for path in replaced:
+                path.unlink(missing_ok=True)
+        except OSError:
+            logger.exception("Could not persist the consumed offsets")
+
+    def _compact_periodically(self) -> None:
+        while not self._compaction_stopped.wait(self._compaction_interval):
+            self.compact()
@@ -1,10 +1,10 @@
 import abc
-import uuid
 import base64
 import datetime
 from dataclasses import dataclass
-from typing import Tuple, Any, List
-from server_protocol import SignupRequest
+from typing import Tuple, Any, List, Optional, Union
+from server_protocol import SignupRequest, StreamedContent
+from storage.blob_store import BlobStore, BlobReference
 
 
 class StorageLayerException(Exception):
@@ -14,8 +14,8 @@ class StorageLayerException(Exception):
 class StorageLayer(abc.ABC):
     @abc.abstractmethod
     def get_user_by_id(
-        self, identifier: str
-    ) -> Tuple[uuid.UUID, str, str, datetime.datetime]:
+        self, identifier: bytes
+    ) -> Tuple[bytes, str, str, datetime.datetime]:
         """
         :param identifier: user_id
         :return: user_id, name, public_key and last_seen_time
@@ -23,25 +23,44 @@ class StorageLayer(abc.ABC):
         ...
 
     @abc.abstractmethod
-    def check_if_user_exists(self, identifier: str) -> bool:
+    def check_if_user_exists(self, identifier: bytes) -> bool:
         ...
 
     @abc.abstractmethod
-    def create_new_user(self, name: str, public_key: str) -> str:
+    def create_new_user(self, name: str, public_key: str) -> bytes:
         ...
 
     @abc.abstractmethod
     def get_message_list_for_user(
-        self, identifier: str
-    ) -> List[Tuple[str, str, str, int, bytes]]:
+        self, identifier: bytes
+    ) -> List[Tuple[int, bytes, bytes, int, Union[bytes, StreamedContent]]]:
         ...
 
     @abc.abstractmethod
-    def get_user_id_list(self, id_to_ignore: str) -> List[str]:
+    def get_user_id_list(self, id_to_ignore: bytes) -> List[bytes]:
         ...
 
     @abc.abstractmethod
-    def send_message(self, sender, receiver, message_type, content) -> str:
+    def get_user_records(self, after_row: int = 0) -> List[Tuple[int, bytes, str]]:
+        """
+        :param after_row: only return users registered after the one with this row number
+        :return: row number, user_id and name of every such user, in registration order
+        """
+        ...
+
+    @abc.abstractmethod
+    def send_message(self, sender, receiver, message_type, content) -> int:
+        ...
+
+    @abc.abstractmethod
+    def send_messages(
+        self, sender, messages: List[Tuple[bytes, int, Union[bytes, BlobReference]]]
+    ) -> List[int]:
+        """
+        Stores all messages atomically
+        :param messages: receiver, message_type and content of every message
+        :return: the message ids, in the order of messages
+        """
         ...
 
     @abc.abstractmethod
@@ -52,20 +71,27 @@ class StorageLayer(abc.ABC):
     def close_connection(self) -> None:
         ...
 
+    @property
+    def blob_store(self) -> Optional[BlobStore]:
+        """
+        The BlobStore large message content can be streamed into, if the storage supports one
+        """
+        return None
+
 
 @dataclass
 class Message:
-    message_id: str
-    source: uuid.UUID
-    destination: uuid.UUID
+    message_id: int
+    source: bytes
+    destination: bytes
     message_type: int
-    content: bytes
+    content: Union[bytes, StreamedContent]
 
 
 class User:
     def __init__(
         self,
-        identifier: uuid.UUID,
+        identifier: bytes,
         name: str,
         public_key: str,
         last_seen: datetime.datetime,
@@ -76,9 +102,9 @@ class User:
         self._last_seen = last_seen
 
     @staticmethod
-    def get_user_by_id(storage_layer: StorageLayer, user_id: str) -> Any:
+    def get_user_by_id(storage_layer: StorageLayer, user_id: bytes) -> Any:
         if not storage_layer.check_if_user_exists(user_id):
-            raise StorageLayerException(f"User {user_id} does not exist!")
+            raise StorageLayerException(f"User {user_id.hex()} does not exist!")
         return User(*storage_layer.get_user_by_id(user_id))
 
     @staticmethod
@@ -99,29 +125,23 @@ class User:
             content,
         ) in storage_layer.get_message_list_for_user(self.id):
             messages.append(
-                Message(
-                    message_id,
-                    uuid.UUID(hex=str(source)),
-                    uuid.UUID(hex=str(destination)),
-                    message_type,
-                    content,
-                )
+                Message(message_id, source, destination, message_type, content)
             )
         return messages
 
     def send_message(
         self,
         storage_layer: StorageLayer,
-        sender: str,
+        sender: bytes,
         message_type: int,
-        content: bytes,
-    ) -> str:
+        content: Union[bytes, BlobReference],
+    ) -> int:
         message_id = storage_layer.send_message(sender, self.id, message_type, content)
         return message_id
 
     @property
-    def id(self) -> str:
-        return str(self._id).replace("-", "")
+    def id(self) -> bytes:
+        return self._id
 
     @property
     def name(self) -> str:
@@ -138,7 +158,7 @@ class User:
 
 class UserList:
     @staticmethod
-    def get_user_list(storage_layer: StorageLayer, user_to_ignore: str) -> List[User]:
+    def get_user_list(storage_layer: StorageLayer, user_to_ignore: bytes) -> List[User]:
         users: List[User] = []
         for user_id in storage_layer.get_user_id_list(user_to_ignore):
             users.append(User.get_user_by_id(storage_layer, user_id))
@@ -0,0 +1,104 @@
+import os
+import json
+import time
+import logging
+import threading
+import contextlib
+from typing import Any, Dict, Iterator, List
+
+
+logger = logging.getLogger(__name__)
+DEFAULT_FLUSH_INTERVAL = 1.0
+
+
+class Tracer:
+    """
+    Records spans as Chrome trace events ("X" events with wall clock microsecond timestamps), tagged with the trace
+    id of the request being handled by the thread. Events are appended to a file in the JSON array format, which
+    trace viewers accept without the closing bracket, so the file is valid while the server is running.
+    Spans are recorded through metrics.timer and metrics.timed, nothing is recorded until enable() is called.
+    """
+
+    def __init__(self) -> None:
+        self.enabled = False
+        self._local = threading.local()
+        self._lock = threading.Lock()
+        self._events: List[Dict[str, Any]] = []
+        self._pid = os.getpid()
+        # Added to time.perf_counter() readings to get the wall clock, which the client traces use as well
+        self._clock_offset = time.time() - time.perf_counter()
+
+    def enable(self, path: str, flush_interval: float = DEFAULT_FLUSH_INTERVAL) -> None:
+        self._pid = os.getpid()
+        with open(path, "w") as trace_file:
+            trace_file.write("[\n")
+        self._events.append(
+            {
+                "name": "process_name",
+                "ph": "M",
+                "pid": self._pid,
+                "args": {"name": f"server {self._pid}"},
+            }
+        )
+        self.enabled = True
+        threading.Thread(
+            target=self._flush_periodically, args=(path, flush_interval), daemon=True
+        ).start()
+
+    @property
+    def trace_id(self) -> int:
+        return getattr(self._local, "trace_id", 0)
+
+    @contextlib.contextmanager
+    def request(self, trace_id: int) -> Iterator[None]:
+        """
+        Tags the spans the current thread records with trace_id, 0 for none.
+        """
+        previous = self.trace_id
+        self._local.trace_id = trace_id
+        try:
+            yield
+        finally:
+            self._local.trace_id = previous
+
+    def record(self, name: str, start: float, end: float) -> None:
+        """
+        :param start: time.perf_counter() reading at the start of the span
+        :param end: time.perf_counter() reading at the end of the span
+        """
+        if not self.enabled:
+            return
+        event: Dict[str, Any] = {
+            "name": name,
+            "cat": "server",
+            "ph": "X",
+            "ts": round((start + self._clock_offset) * 1e6),
+            "dur": round((end - start) * 1e6),
+            "pid": self._pid,
+            "tid": threading.get_ident(),
+        }
+        trace_id = self.trace_id
+        if trace_id:
+            event["args"] = {"trace_id": f"{trace_id:016x}"}
+        with self._lock:
+            self._events.append(event)
+
+    def flush(self, path: str) -> None:
+        with self._lock:
+            events, self._events = self._events, []
+        if not events:
+            return
+        with open(path, "a") as trace_file:
+            trace_file.writelines(json.dumps(event) + ",\n" for event in events)
+
+    def _flush_periodically(self, path: str, interval: float) -> None:
+        while True:
+            time.sleep(interval)
+            try:
+                self.flush(path)
+            except OSError:
+                logger.exception(f"Could not write trace events to {path}")
+
+
+tracer = Tracer()
+